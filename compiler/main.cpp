@@ -1,965 +1,3360 @@
+#include "pipeline.h"
+
+#include <atomic>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
-#include <iostream>
-#include <map>
-#include <sstream>
-#include <string.h>
-#include <string>
-#include <vector>
-using std::cout;
-using std::endl;
-using std::map;
-using std::string;
-using std::stringstream;
-using std::vector;
-
-// ERROR HANDLING //
-
-bool error_has_occoured = false;
-
-// TOKENS //
-
-enum class TokenKind
+#include <iterator>
+#include <new>
+#include <thread>
+#include <utility>
+#if defined(__x86_64__) && defined(__linux__)
+#define TINY_JIT
+#include <csetjmp>
+#include <sys/mman.h>
+#endif
+#ifdef TINY_POSIX_IO
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "../runtime/tiny/simd.h"
+
+namespace tinyc
 {
-    Null,
-
-    Comma,
-    Assign,
-    Line,
-
-    ParenL,
-    ParenR,
-    CurlyL,
-    CurlyR,
-    SquareL,
-    SquareR,
-
-    InsertL,
-    InsertR,
 
-    LessThan,
-    LessThanEqual,
-    GreaterThan,
-    GreaterThanEqual,
+// HEAP ACCOUNTING //
 
-    Return,
+// The global allocation functions are replaced so that the compiler can report
+// its peak heap usage. Each block carries a header recording its size, which
+// keeps the accounting correct for unsized deletes. The library leaves them to
+// the program it is part of.
 
-    String,
-    Identity,
+std::atomic<size_t> heap_current_bytes{0};
+std::atomic<size_t> heap_peak_bytes{0};
 
-    EndOfFile,
-};
+constexpr size_t heap_header_size = alignof(std::max_align_t);
 
-struct Token
+void *counted_alloc(size_t size)
 {
-    TokenKind kind;
-    string str;
-    int line;
-
-    Token() : kind(TokenKind::Null),
-              str(""),
-              line(0) {}
-
-    Token(TokenKind kind, string str, int line) : kind(kind),
-                                                  str(str),
-                                                  line(line) {}
-};
+    void *block = malloc(size + heap_header_size);
+    if (block == nullptr)
+        return nullptr;
+    *(size_t *)block = size;
+
+    size_t current = heap_current_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = heap_peak_bytes.load(std::memory_order_relaxed);
+    while (current > peak && !heap_peak_bytes.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+        ;
 
-// LEXER //
+    return (char *)block + heap_header_size;
+}
 
-struct Lexer
+// Kept out of line: where GCC can see both ends of an allocation, it takes reading
+// the header in front of the block for an out of bounds access
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void counted_free(void *ptr)
 {
-    string *src;
-    vector<Token> tokens;
+    if (ptr == nullptr)
+        return;
+    void *block = (char *)ptr - heap_header_size;
+    heap_current_bytes.fetch_sub(*(size_t *)block, std::memory_order_relaxed);
+    free(block);
+}
 
-    bool finished = false;
-    size_t position = 0;
-    size_t line = 0;
-    size_t token_position = 0;
+}
 
-    Lexer(string *src) : src(src) {}
-};
+using tinyc::counted_alloc;
+using tinyc::counted_free;
 
-void error(const Lexer &lexer, const string msg)
+void *operator new(size_t size)
 {
-    if (error_has_occoured)
-        return;
-    error_has_occoured = true;
-
-    cout << "Error on line " << lexer.line << ": " << msg << endl;
+    void *ptr = counted_alloc(size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
 }
 
-char peek(const Lexer &lexer)
+void *operator new[](size_t size)
 {
-    return (*lexer.src)[lexer.position];
+    return operator new(size);
 }
 
-char next(Lexer &lexer)
+void *operator new(size_t size, const std::nothrow_t &) noexcept
 {
-    char c = peek(lexer);
-    lexer.position++;
-    if (c == '\n')
-        lexer.line++;
-    return c;
+    return counted_alloc(size);
 }
 
-bool match(Lexer &lexer, const char c)
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
 {
-    if (peek(lexer) != c)
-        return false;
-    next(lexer);
-    return true;
+    return counted_alloc(size);
 }
 
-// Assumes that the first character of the word has already been matched
-bool match_word(Lexer &lexer, string word)
+void operator delete(void *ptr) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr) noexcept { counted_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { counted_free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { counted_free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { counted_free(ptr); }
+
+namespace tinyc
+{
+
+// STATISTICS //
+
+void write_json_string(std::ostream &out, string_view str)
 {
-    size_t len = word.length() - 1;
-    bool match = lexer.src->substr(lexer.position, len) == word.substr(1, len);
-    if (match)
-        lexer.position += len;
-    return match;
+    out << '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if ((unsigned char)c < 0x20)
+            out << "\\u" << std::hex << std::setfill('0') << std::setw(4) << (int)c << std::dec;
+        else
+            out << c;
+    }
+    out << '"';
 }
 
-bool char_is_name(const char c)
+void write_stats_json(std::ostream &out, const CompileStats &stats, string_view source_path, bool succeeded)
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    double total = 0;
+    for (const PhaseTime &phase : stats.phases)
+        total += phase.seconds;
+
+    out << "{\n  \"source\": ";
+    write_json_string(out, source_path);
+    out << ",\n  \"succeeded\": " << (succeeded ? "true" : "false")
+        << ",\n  \"phases\": [";
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        out << (i > 0 ? ",\n    " : "\n    ") << "{\"name\": ";
+        write_json_string(out, stats.phases[i].name);
+        out << ", \"ms\": " << stats.phases[i].seconds * 1e3 << "}";
+    }
+    out << "\n  ],"
+        << "\n  \"total_ms\": " << total * 1e3 << ","
+        << "\n  \"source_bytes\": " << stats.source_bytes << ","
+        << "\n  \"tokens\": " << stats.tokens << ","
+        << "\n  \"scopes\": " << stats.scopes << ","
+        << "\n  \"entities\": " << stats.entities << ","
+        << "\n  \"bytes_emitted\": " << stats.bytes_emitted << ","
+        << "\n  \"calls_shared\": " << stats.calls_shared << ","
+        << "\n  \"calls_inlined\": " << stats.calls_inlined << ","
+        << "\n  \"tail_calls\": " << stats.tail_calls << ","
+        << "\n  \"functions_jitted\": " << stats.functions_jitted << ","
+        << "\n  \"peak_heap_bytes\": " << heap_peak_bytes.load() << "\n}\n";
 }
 
-void make_token(Lexer &lexer, const TokenKind kind)
+// BYTECODE LOWERING //
+
+// A register is identified by its file (the type it holds) and its index in that file
+struct Reg
+{
+    TinyType type = TinyType::Unspecified;
+    uint32_t index = no_register;
+};
+
+struct Lowering
 {
-    Token t;
-    t.kind = kind;
-    size_t length = (lexer.position - lexer.token_position);
-    t.str = lexer.src->substr(lexer.token_position, length);
-    t.line = kind != TokenKind::Line ? lexer.line : lexer.line - 1;
+    Compiler &compiler;
+    BytecodeProgram &program;
+    BytecodeFunction *fn = nullptr;
+
+    // Temporaries are allocated above the variables and released after each statement
+    uint32_t value_temps = 0;
+    uint32_t list_temps = 0;
+    uint32_t value_top = 0;
+    uint32_t list_top = 0;
+};
 
-    lexer.tokens.push_back(t);
+void emit_instr(Lowering &lowering, Op op, uint32_t a = 0, uint32_t b = 0)
+{
+    Instr instr;
+    instr.op = op;
+    instr.a = a;
+    instr.b = b;
+    lowering.fn->code.push_back(instr);
+}
 
-    cout
-        << std::setfill('0') << std::setw(2) << (int)t.kind << " "
-        << ((t.kind == TokenKind::Line)
-                ? "new line"
-                : t.str)
-        << endl;
+Reg allocate_register(Lowering &lowering, TinyType type)
+{
+    Reg reg;
+    reg.type = type;
+    if (type == TinyType::List)
+    {
+        reg.index = lowering.list_top++;
+        lowering.fn->list_count = std::max(lowering.fn->list_count, lowering.list_top);
+    }
+    else
+    {
+        reg.type = TinyType::Value;
+        reg.index = lowering.value_top++;
+        lowering.fn->value_count = std::max(lowering.fn->value_count, lowering.value_top);
+    }
+    return reg;
 }
 
-void next_token(Lexer &lexer)
+void emit_move(Lowering &lowering, NodeIndex node, Reg dst, Reg src)
 {
-    if (lexer.finished)
+    if (dst.type != src.type)
+    {
+        error_at(lowering.compiler, node, string("Cannot assign ") + type_name(src.type) + " to " + type_name(dst.type) + ".");
         return;
+    }
+    if (dst.index != src.index)
+        emit_instr(lowering, dst.type == TinyType::List ? Op::MoveList : Op::MoveValue, dst.index, src.index);
+}
 
-    while (peek(lexer) == ' ' || peek(lexer) == '\t')
-        next(lexer);
+Reg lower_expression(Lowering &lowering, NodeIndex node, const Reg *dst = nullptr);
 
-    lexer.token_position = lexer.position;
+Reg lower_call(Lowering &lowering, NodeIndex node, const Reg *dst)
+{
+    Ast &ast = lowering.compiler.ast;
+    Entity *funct = ast.bindings[node];
+    const BytecodeFunction &callee = lowering.program.functions[funct->function.index];
 
-    if (peek(lexer) == '\0')
+    if (ast.nodes[node].count != callee.params.size())
     {
-        make_token(lexer, TokenKind::EndOfFile);
-        lexer.finished = true;
-        return;
+        error_at(lowering.compiler, node, "Function '" + string(funct->identity) + "' expects " + std::to_string(callee.params.size()) + " arguments.");
+        return Reg();
     }
 
-    char c = next(lexer);
-    switch (c)
+    vector<Reg> arg_regs(ast.nodes[node].count);
+    for (size_t i = 0; i < arg_regs.size(); i++)
     {
+        arg_regs[i] = lower_expression(lowering, child(ast, node, i));
+        if (arg_regs[i].type != callee.params[i])
+            error_at(lowering.compiler, child(ast, node, i), "Argument " + std::to_string(i + 1) + " of '" + string(funct->identity) + "' should be " + type_name(callee.params[i]) + ".");
+    }
 
-    case ',':
-        make_token(lexer, TokenKind::Comma);
-        return;
-    case '=':
-        make_token(lexer, TokenKind::Assign);
-        return;
-    case '\n':
-        make_token(lexer, TokenKind::Line);
-        return;
+    TinyType return_type = funct->function.return_type;
+    Reg result;
+    result.type = return_type;
+    if (return_type == TinyType::Value || return_type == TinyType::List)
+        result = (dst != nullptr && dst->type == return_type) ? *dst : allocate_register(lowering, return_type);
 
-    case '(':
-        make_token(lexer, TokenKind::ParenL);
-        return;
-    case ')':
-        make_token(lexer, TokenKind::ParenR);
-        return;
-    case '{':
-        make_token(lexer, TokenKind::CurlyL);
-        return;
-    case '}':
-        make_token(lexer, TokenKind::CurlyR);
-        return;
-    case '[':
-        make_token(lexer, TokenKind::SquareL);
-        return;
-    case ']':
-        make_token(lexer, TokenKind::SquareR);
-        return;
+    emit_instr(lowering, Op::Call, funct->function.index, result.index);
+    for (const Reg &arg : arg_regs)
+        emit_instr(lowering, arg.type == TinyType::List ? Op::ArgList : Op::ArgValue, arg.index);
+
+    return result;
+}
 
-    case '<':
+Reg lower_expression(Lowering &lowering, NodeIndex node, const Reg *dst)
+{
+    Ast &ast = lowering.compiler.ast;
+    switch (ast.nodes[node].kind)
     {
-        switch (peek(lexer))
+    case NodeKind::Identity:
+    {
+        Entity *dec = ast.bindings[node];
+        Reg reg;
+        if (dec == nullptr)
         {
-        case '<':
-            next(lexer);
-            make_token(lexer, TokenKind::InsertL);
-            return;
-        case '=':
-            next(lexer);
-            make_token(lexer, TokenKind::LessThanEqual);
-            return;
+            reg.type = TinyType::Console;
         }
-        make_token(lexer, TokenKind::LessThan);
-        return;
-    }
-
-    case '>':
-    {
-        switch (peek(lexer))
+        else
         {
-        case '>':
-            next(lexer);
-            make_token(lexer, TokenKind::InsertR);
-            return;
-        case '=':
-            next(lexer);
-            make_token(lexer, TokenKind::GreaterThanEqual);
-            return;
+            reg.type = dec->variable.type;
+            reg.index = dec->variable.reg;
         }
-        make_token(lexer, TokenKind::GreaterThan);
-        return;
+        return reg;
     }
 
-    case '"':
+    case NodeKind::Call:
+        return lower_call(lowering, node, dst);
+
+    case NodeKind::String:
     {
-        char n;
-        do
-        {
-            n = next(lexer);
-            if (n == '\0')
-                error(lexer, "Unterminated string at end of file");
-        } while (n != '"');
-        make_token(lexer, TokenKind::String);
-        return;
+        lowering.program.constants.push_back(string_literal(lowering.compiler, node));
+
+        Reg reg = (dst != nullptr && dst->type == TinyType::List) ? *dst : allocate_register(lowering, TinyType::List);
+        emit_instr(lowering, Op::LoadList, reg.index, (uint32_t)(lowering.program.constants.size() - 1));
+        return reg;
     }
 
-    default:
+    case NodeKind::Constant:
     {
-        if (match_word(lexer, "return"))
+        const ConstantValue &constant = lowering.compiler.constants[ast.nodes[node].first];
+        if (constant.type != TinyType::Value && constant.type != TinyType::List)
         {
-            make_token(lexer, TokenKind::Return);
-            return;
+            Reg none;
+            none.type = constant.type;
+            return none;
         }
 
-        if (char_is_name(c))
+        Reg reg = (dst != nullptr && dst->type == constant.type) ? *dst : allocate_register(lowering, constant.type);
+        if (constant.type == TinyType::Value)
         {
-            while (char_is_name(peek(lexer)))
-                next(lexer);
-            make_token(lexer, TokenKind::Identity);
-            return;
+            emit_instr(lowering, Op::LoadValue, reg.index, (uint32_t)constant.value);
         }
-
-        error(lexer, "Unable to parse character '" + string(1, c) + "'");
-        return;
+        else
+        {
+            lowering.program.constants.push_back(constant.list);
+            emit_instr(lowering, Op::LoadList, reg.index, (uint32_t)(lowering.program.constants.size() - 1));
+        }
+        return reg;
     }
+
+    default:
+        return Reg();
     }
 }
 
-// PROGRAM MODEL //
-
-enum class TinyType
+// Lowers `a << b` (or `a >> b` when `ltr` is set) following the insertion table in documentation.md
+void lower_insertion(Lowering &lowering, NodeIndex node, Reg a, Reg b, bool ltr)
 {
-    Unspecified,
-    Value,
-    List,
-    Console,
-    None,
-};
+    TinyType ta = a.type;
+    TinyType tb = b.type;
+    const TinyType V = TinyType::Value, L = TinyType::List, C = TinyType::Console;
+
+    if (ltr && ta == C && tb == V)
+        emit_instr(lowering, Op::ReadValue, b.index);
+    else if (ltr && ta == C && tb == L)
+        emit_instr(lowering, Op::ReadList, b.index);
+    else if (ltr && ta == L && tb == V)
+        emit_instr(lowering, Op::PopBack, a.index, b.index);
+    else if (ltr && ta == V && tb == L)
+        emit_instr(lowering, Op::PushFront, a.index, b.index);
+    else if (ltr && ta == L && tb == L)
+        emit_instr(lowering, Op::PrependAll, a.index, b.index);
+    else if (!ltr && ta == C && tb == V)
+        emit_instr(lowering, Op::PrintValue, b.index);
+    else if (!ltr && ta == C && tb == L)
+        emit_instr(lowering, Op::PrintList, b.index);
+    else if (!ltr && ta == L && tb == V)
+        emit_instr(lowering, Op::PushBack, a.index, b.index);
+    else if (!ltr && ta == V && tb == L)
+        emit_instr(lowering, Op::PopFront, a.index, b.index);
+    else if (!ltr && ta == L && tb == L)
+        emit_instr(lowering, Op::AppendAll, a.index, b.index);
+    else
+        error_at(lowering.compiler, node, string("Cannot insert ") + type_name(ltr ? ta : tb) + " into " + type_name(ltr ? tb : ta) + ".");
+}
 
-string tiny_type_as_c_type(TinyType type)
+// The arguments are gathered into temporaries before any parameter is overwritten. Lists
+// held by the function's own variables are copied, as the variable may still be read,
+// apart from those of block variables, which are about to be reset anyway.
+void lower_tail_call(Lowering &lowering, NodeIndex call)
 {
-    switch (type)
+    Ast &ast = lowering.compiler.ast;
+    Entity *fun = ast.bindings[call];
+    NodeIndex block = child(ast, fun->function.node, ast.nodes[fun->function.node].count - 1);
+
+    vector<Reg> args(ast.nodes[call].count);
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (passes_through(ast, call, i, fun))
+            continue;
+
+        NodeIndex arg = child(ast, call, i);
+        Reg reg = lower_expression(lowering, arg);
+        bool temporary = reg.index >= (reg.type == TinyType::List ? lowering.list_temps : lowering.value_temps);
+        if (!temporary)
+        {
+            Entity *var = ast.bindings[arg];
+            Entity **params_end = fun->function.params + fun->function.param_count;
+            bool local = std::find(fun->function.params, params_end, var) == params_end;
+            Reg copy = allocate_register(lowering, reg.type);
+            emit_instr(lowering, reg.type != TinyType::List ? Op::MoveValue : local ? Op::TakeList : Op::MoveList, copy.index, reg.index);
+            reg = copy;
+        }
+        args[i] = reg;
+    }
+
+    for (size_t i = 0; i < args.size(); i++)
+        if (args[i].index != no_register)
+            emit_instr(lowering, args[i].type == TinyType::List ? Op::TakeList : Op::MoveValue, fun->function.params[i]->variable.reg, args[i].index);
+
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
     {
-    case TinyType::Unspecified:
-        return "_ERROR_UNSPECIFIED_TYPE";
-    case TinyType::Value:
-        return "value";
-    case TinyType::List:
-        return "list";
-    case TinyType::Console:
-        return "_ERROR_CONSOLE_TYPE";
-    case TinyType::None:
-        return "void";
+        if (var->kind != EntityKind::Variable)
+            continue;
+        if (var->variable.type == TinyType::List)
+            emit_instr(lowering, Op::ClearList, var->variable.reg);
+        else
+            emit_instr(lowering, Op::LoadValue, var->variable.reg, 0);
     }
-    return "_ERROR_TINY_TYPE_AS_C_TYPE";
+    emit_instr(lowering, Op::Jump, 0);
 }
 
-enum class EntityKind
+void lower_statement(Lowering &lowering, NodeIndex stmt)
 {
-    Null,
-    Variable,
-    Function,
-};
+    Ast &ast = lowering.compiler.ast;
+    const Node &node = ast.nodes[stmt];
 
-struct Entity
-{
-    EntityKind kind = EntityKind::Null;
-    string identity = "";
-    string c_identity = "_ERROR_NULL_ENTITY";
-    union
+    lowering.value_top = lowering.value_temps;
+    lowering.list_top = lowering.list_temps;
+
+    switch (node.kind)
     {
-        struct
-        {
-            TinyType type;
-        } variable;
-        struct
-        {
-            TinyType return_type;
-            vector<Entity *> *params;
-            size_t param_count;
-        } function;
-    };
+    case NodeKind::AssignStmt:
+    {
+        Entity *dec = ast.bindings[stmt];
+        if (node.count == 0)
+            return;
 
-    Entity(){};
+        Reg dst;
+        dst.type = dec->variable.type;
+        dst.index = dec->variable.reg;
+        Reg src = lower_expression(lowering, child(ast, stmt, 0), &dst);
+        emit_move(lowering, stmt, dst, src);
+        return;
+    }
 
-    Entity(EntityKind kind, string identity) : kind(kind), identity(identity)
+    case NodeKind::LtrInsertStmt:
+    case NodeKind::RtlInsertStmt:
     {
-        if (kind == EntityKind::Variable)
-        {
-            variable.type = TinyType::Unspecified;
-        }
-        else if (kind == EntityKind::Function)
+        bool ltr = node.kind == NodeKind::LtrInsertStmt;
+        Reg target = lower_expression(lowering, child(ast, stmt, 0));
+        for (size_t i = 1; i < ast.nodes[stmt].count; i++)
         {
-            function.return_type = TinyType::Unspecified;
-            function.params = new vector<Entity *>;
-            function.param_count = 0;
+            Reg operand = lower_expression(lowering, child(ast, stmt, i));
+            lower_insertion(lowering, child(ast, stmt, i), target, operand, ltr);
         }
+        return;
     }
 
-    ~Entity()
+    case NodeKind::ReturnStmt:
     {
-        if (kind == EntityKind::Function)
+        if (node.flags & node_tail_call)
+        {
+            lower_tail_call(lowering, child(ast, stmt, 0));
+            return;
+        }
+        if (node.count == 0)
         {
-            delete function.params;
+            emit_instr(lowering, Op::Return);
+            return;
         }
+        Reg reg = lower_expression(lowering, child(ast, stmt, 0));
+        emit_instr(lowering, reg.type == TinyType::List ? Op::ReturnList : Op::ReturnValue, reg.index);
+        return;
     }
 
-    Entity(Entity &&source)
-    {
-        kind = source.kind;
-        identity = source.identity;
-        c_identity = source.c_identity;
-
-        if (source.kind == EntityKind::Variable)
-            variable = source.variable;
-        else if (source.kind == EntityKind::Function)
-            function = source.function;
+    case NodeKind::ExprStmt:
+        lower_expression(lowering, child(ast, stmt, 0));
+        return;
 
-        source.kind = EntityKind::Null;
+    default:
+        return;
     }
-};
+}
 
-struct Scope
+void lower_function(Lowering &lowering, NodeIndex function)
 {
-    std::map<string, Entity> entities;
-    Scope *parent = nullptr;
+    Ast &ast = lowering.compiler.ast;
+    Entity *fun = ast.bindings[function];
+    lowering.fn = &lowering.program.functions[fun->function.index];
+    lowering.value_top = 0;
+    lowering.list_top = 0;
+
+    // Parameters take the first registers, followed by the block's variables, followed by temporaries
+    for (size_t i = 0; i < fun->function.param_count; i++)
+    {
+        Entity *param = fun->function.params[i];
+        param->variable.reg = allocate_register(lowering, param->variable.type).index;
+    }
 
-    Scope(){};
-    Scope(Scope *parent) : parent(parent){};
-};
+    NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+        if (var->kind == EntityKind::Variable)
+            var->variable.reg = allocate_register(lowering, var->variable.type).index;
 
-Entity *fetch(Scope *scope, string id)
-{
-    auto got = scope->entities.find(id);
-    if (got != scope->entities.end())
-        return &got->second;
+    lowering.value_temps = lowering.value_top;
+    lowering.list_temps = lowering.list_top;
 
-    if (scope->parent != nullptr)
-        return fetch(scope->parent, id);
+    for (size_t i = 0; i < ast.nodes[block].count; i++)
+        lower_statement(lowering, child(ast, block, i));
 
-    return nullptr;
+    emit_instr(lowering, Op::Return);
 }
 
-Entity *declare(Scope &scope, EntityKind kind, string id)
+void lower_program(Compiler &compiler)
 {
-    scope.entities.insert({id, Entity(kind, id)});
-    Entity *ent = &scope.entities[id];
+    Ast &ast = compiler.ast;
+    BytecodeProgram &program = compiler.bytecode;
+    Lowering lowering{compiler, program};
+
+    // The syntax tree may be incomplete after an error
+    if (has_errors(compiler))
+        return;
+
+    // Every function's signature is needed before any calls to it can be lowered
+    program.functions.resize(ast.nodes[ast.root].count);
+    bool has_main = false;
+    for (size_t i = 0; i < ast.nodes[ast.root].count; i++)
+    {
+        Entity *fun = ast.bindings[child(ast, ast.root, i)];
+        BytecodeFunction &fn = program.functions[fun->function.index];
+        fn.name = fun->identity;
+        fn.return_type = fun->function.return_type;
+        fn.memoized = compiler.memoize && memoizable(fun);
+        for (size_t p = 0; p < fun->function.param_count; p++)
+            fn.params.push_back(fun->function.params[p]->variable.type);
+
+        if (fun->symbol == symbol_main)
+        {
+            program.main = fun->function.index;
+            has_main = true;
+        }
+    }
 
-    // FIXME: Find a proper policy for generating the C++ identifiers that won't clash
-    ent->c_identity = id == "main" ? id : id + "_";
+    if (!has_main)
+    {
+        error_at(compiler, ast.root, "Program has no main function.");
+        return;
+    }
 
-    return ent;
+    for (size_t i = 0; i < ast.nodes[ast.root].count; i++)
+        lower_function(lowering, child(ast, ast.root, i));
 }
 
-// COMPILER //
+const Pass lower_pass = {"lower", lower_program, false, target_bytecode, "generate bytecode for --run"};
 
-struct Compiler
+// Compiles a program to bytecode, running the passes for bytecode and then lowering
+void compile_bytecode(Compiler &compiler)
 {
-    Lexer *lexer;
-    size_t current_token = 0;
+    Emitter unused;
+    compile_program(compiler, unused, target_bytecode);
+    PhaseTimer timer(compiler.stats, lower_pass.name);
+    lower_pass.run(compiler);
+}
 
-    stringstream *out = nullptr;
+// JIT //
 
-    bool insert_stmt = false;
-    bool inserting_chars = false;
-    bool inserting_ltr = false;
-    bool in_main = false;
-    Entity *in_function = nullptr;
-    TinyType function_returns;
+// Functions that only ever touch values (no lists and no console) are compiled
+// to x86-64 once they have been called often enough. Compiled functions take a
+// pointer to their arguments and return their result in eax, keeping their
+// registers in the native stack frame. Everything else stays in the interpreter.
 
-    Compiler(Lexer *lexer) : lexer(lexer) {}
-};
+#if defined(TINY_JIT)
+
+using JitFunction = int (*)(const int *args);
 
-Token current_token(const Compiler &compiler)
+constexpr uint32_t jit_threshold = 64;             // Calls before a function is compiled
+constexpr uintptr_t jit_stack_budget = 1 << 20;    // Native stack the compiled code may use
+
+uintptr_t jit_stack_limit = 0;
+jmp_buf *jit_overflow_target = nullptr;
+
+[[noreturn]] void jit_stack_overflow()
 {
-    size_t i = std::min(compiler.current_token, compiler.lexer->tokens.size() - 1);
-    return compiler.lexer->tokens.at(i);
+    longjmp(*jit_overflow_target, 1);
 }
 
-TokenKind peek(const Compiler &compiler)
+struct JitRegion
 {
-    return current_token(compiler).kind;
-}
+    void *memory;
+    size_t size;
+};
+
+struct Jit
+{
+    bool enabled = true;
+    size_t *compiled = nullptr; // Where to count the functions compiled, if anywhere
+    vector<bool> eligible;
+    vector<uint32_t> calls;
+    vector<JitFunction> functions;
+    vector<JitRegion> regions;
+    vector<int> args;
+
+    Jit() = default;
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    ~Jit()
+    {
+        for (const JitRegion &region : regions)
+            munmap(region.memory, region.size);
+    }
+};
 
-TokenKind peek_ahead(const Compiler &compiler, size_t amt)
+bool jit_supports(Op op)
 {
-    size_t i = std::min(compiler.current_token + amt, compiler.lexer->tokens.size() - 1);
-    return compiler.lexer->tokens.at(i).kind;
+    return op == Op::MoveValue || op == Op::LoadValue || op == Op::Call || op == Op::ArgValue || op == Op::ReturnValue || op == Op::Return ||
+           op == Op::Jump;
 }
 
-void error(const Compiler &compiler, const string msg)
+// A function is eligible if it only uses value instructions and only calls eligible functions
+void prepare_jit(Jit &jit, const BytecodeProgram &program)
 {
-    if (error_has_occoured)
-        return;
-    error_has_occoured = true;
+    size_t count = program.functions.size();
+    jit.eligible.assign(count, true);
+    jit.calls.assign(count, 0);
+    jit.functions.assign(count, nullptr);
 
-    Token current = current_token(compiler);
-    cout << "Error on line " << current.line << ": " << msg;
-    if (current.kind == TokenKind::Line)
-        cout << " (got new line)";
-    else
-        cout << " (got " << std::setfill('0') << std::setw(2) << (int)current.kind << " " << current.str << ")";
-    cout << endl;
+    size_t max_params = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const BytecodeFunction &fn = program.functions[i];
+        max_params = std::max(max_params, fn.params.size());
+        if (fn.list_count > 0 || fn.return_type == TinyType::List || fn.memoized)
+            jit.eligible[i] = false;
+        for (const Instr &instr : fn.code)
+            if (!jit_supports(instr.op))
+                jit.eligible[i] = false;
+    }
+    jit.args.resize(max_params);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!jit.eligible[i])
+                continue;
+            for (const Instr &instr : program.functions[i].code)
+            {
+                if (instr.op == Op::Call && !jit.eligible[instr.a])
+                {
+                    jit.eligible[i] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
 }
 
-bool match(Compiler &compiler, TokenKind kind)
+struct JitAssembler
 {
-    if (peek(compiler) != kind)
-        return false;
-    next_token(*compiler.lexer);
-    compiler.current_token++;
-    return true;
-}
+    vector<uint8_t> code;
+    vector<std::pair<size_t, size_t>> fixups; // Offset of a call's rel32 field -> index of the callee
+};
 
-void skip_lines(Compiler &compiler)
+void emit_bytes(JitAssembler &as, std::initializer_list<uint8_t> bytes)
 {
-    while (match(compiler, TokenKind::Line))
-        ;
+    as.code.insert(as.code.end(), bytes);
 }
 
-Token eat(Compiler &compiler, TokenKind kind, const string msg)
+void emit_u32(JitAssembler &as, uint32_t n)
 {
-    if (kind != TokenKind::Line)
-    {
-        skip_lines(compiler);
-    }
-
-    Token t = current_token(compiler);
-    if (!match(compiler, kind))
-        error(compiler, msg);
-    return t;
+    for (int i = 0; i < 4; i++)
+        as.code.push_back((uint8_t)(n >> (8 * i)));
 }
 
-bool peek_call(const Compiler &compiler)
+void emit_u64(JitAssembler &as, uint64_t n)
 {
-    return peek(compiler) == TokenKind::Identity && peek_ahead(compiler, 1) == TokenKind::ParenL;
+    for (int i = 0; i < 8; i++)
+        as.code.push_back((uint8_t)(n >> (8 * i)));
 }
 
-bool peek_expression(const Compiler &compiler)
+void patch_rel32(JitAssembler &as, size_t field, size_t target)
 {
-    return peek_call(compiler) ||
-           peek(compiler) == TokenKind::String ||
-           peek(compiler) == TokenKind::Identity;
+    uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(field + 4));
+    memcpy(&as.code[field], &rel, 4);
 }
 
-TinyType compile_expression(Compiler &compiler, Scope &scope, TinyType type_hint = TinyType::Unspecified);
+// Registers live below rbp, one 32-bit slot each
+uint32_t jit_slot(uint32_t reg)
+{
+    return (uint32_t)(-4 * (int32_t)(reg + 1));
+}
 
-TinyType compile_identity(Compiler &compiler, Scope &scope, TinyType type_hint = TinyType::Unspecified)
+void jit_load(JitAssembler &as, uint32_t reg) // mov eax, [rbp + slot]
 {
-    Token identity = eat(compiler, TokenKind::Identity, "Expected identity.");
-    // FIXME: Have a console variable declared in the global scope
-    if (identity.str == "console")
-    {
-        *compiler.out << (compiler.inserting_ltr ? "std::cin" : "std::cout");
+    emit_bytes(as, {0x8B, 0x85});
+    emit_u32(as, jit_slot(reg));
+}
 
-        // FIXME: This should only occour if it happens in the first expression of the insert statement
-        if (!compiler.inserting_ltr)
-            compiler.inserting_chars = true;
+void jit_store(JitAssembler &as, uint32_t reg) // mov [rbp + slot], eax
+{
+    emit_bytes(as, {0x89, 0x85});
+    emit_u32(as, jit_slot(reg));
+}
 
-        return TinyType::Console;
-    }
-    else
+void jit_function(JitAssembler &as, const BytecodeProgram &program, const Jit &jit, uint32_t index,
+                  size_t overflow_stub, vector<size_t> &pending_calls)
+{
+    const BytecodeFunction &fn = program.functions[index];
+
+    uint32_t arg_slots = 0;
+    for (const Instr &instr : fn.code)
+        if (instr.op == Op::Call)
+            arg_slots = std::max<uint32_t>(arg_slots, (uint32_t)program.functions[instr.a].params.size());
+    uint32_t frame = (4 * (fn.value_count + arg_slots) + 15) & ~15u;
+
+    emit_bytes(as, {0x55});             // push rbp
+    emit_bytes(as, {0x48, 0x89, 0xE5}); // mov rbp, rsp
+    emit_bytes(as, {0x48, 0xB8});       // mov rax, &jit_stack_limit
+    emit_u64(as, (uint64_t)(uintptr_t)&jit_stack_limit);
+    emit_bytes(as, {0x48, 0x3B, 0x20}); // cmp rsp, [rax]
+    emit_bytes(as, {0x0F, 0x82});       // jb overflow_stub
+    as.code.resize(as.code.size() + 4);
+    patch_rel32(as, as.code.size() - 4, overflow_stub);
+    emit_bytes(as, {0x48, 0x81, 0xEC}); // sub rsp, frame
+    emit_u32(as, frame);
+
+    // Parameters are copied in from the caller, every other register starts at zero
+    for (uint32_t reg = 0; reg < fn.value_count; reg++)
     {
-        string id = identity.str;
-        Entity *dec = fetch(&scope, id);
-        bool valid_variable = true;
-
-        if (dec == nullptr)
+        if (reg < fn.params.size())
         {
-            dec = declare(scope, EntityKind::Variable, id);
-            dec->variable.type = type_hint;
+            emit_bytes(as, {0x8B, 0x87}); // mov eax, [rdi + 4 * reg]
+            emit_u32(as, 4 * reg);
+            jit_store(as, reg);
         }
-        else if (dec->kind == EntityKind::Function)
+        else
         {
-            valid_variable = false;
-            error(compiler, "Cannot use function as an expression.");
+            emit_bytes(as, {0xC7, 0x85}); // mov dword [rbp + slot], 0
+            emit_u32(as, jit_slot(reg));
+            emit_u32(as, 0);
         }
-
-        *compiler.out << dec->c_identity;
-
-        return valid_variable ? dec->variable.type : TinyType::Unspecified;
     }
 
-    return TinyType::Unspecified;
-}
+    // Jumps only ever go backwards, to instructions that have already been laid out
+    vector<size_t> offsets(fn.code.size());
+    for (size_t pc = 0; pc < fn.code.size(); pc++)
+    {
+        const Instr &instr = fn.code[pc];
+        offsets[pc] = as.code.size();
+        switch (instr.op)
+        {
+        case Op::MoveValue:
+            jit_load(as, instr.b);
+            jit_store(as, instr.a);
+            break;
+
+        case Op::LoadValue:
+            emit_bytes(as, {0xC7, 0x85}); // mov dword [rbp + slot], b
+            emit_u32(as, jit_slot(instr.a));
+            emit_u32(as, instr.b);
+            break;
+
+        case Op::Call:
+        {
+            size_t param_count = program.functions[instr.a].params.size();
+            for (size_t i = 0; i < param_count; i++)
+            {
+                jit_load(as, fn.code[pc + 1 + i].a);
+                emit_bytes(as, {0x89, 0x84, 0x24}); // mov [rsp + 4 * i], eax
+                emit_u32(as, (uint32_t)(4 * i));
+            }
+            pc += param_count;
+
+            emit_bytes(as, {0x48, 0x89, 0xE7}); // mov rdi, rsp
+            if (JitFunction target = jit.functions[instr.a])
+            {
+                emit_bytes(as, {0x48, 0xB8}); // mov rax, target
+                emit_u64(as, (uint64_t)(uintptr_t)target);
+                emit_bytes(as, {0xFF, 0xD0}); // call rax
+            }
+            else
+            {
+                emit_bytes(as, {0xE8}); // call rel32, patched once the callee has been laid out
+                as.fixups.push_back({as.code.size(), instr.a});
+                emit_u32(as, 0);
+                pending_calls.push_back(instr.a);
+            }
+
+            if (instr.b != no_register)
+                jit_store(as, instr.b);
+            break;
+        }
 
-TinyType compile_call(Compiler &compiler, Scope &scope, TinyType type_hint = TinyType::Unspecified)
-{
-    string id = eat(compiler, TokenKind::Identity, "Expected function name.").str;
-    Entity *funct = fetch(&scope, id);
-    bool valid_function = true;
+        case Op::ReturnValue:
+            jit_load(as, instr.a);
+            emit_bytes(as, {0xC9, 0xC3}); // leave; ret
+            break;
 
-    if (funct == nullptr)
-    {
-        valid_function = false;
-        error(compiler, "Function '" + id + "' does not exist.");
-    }
-    else if (funct->kind != EntityKind::Function)
-    {
-        valid_function = false;
-        error(compiler, "'" + id + "' is not a function.");
-    }
+        case Op::Return:
+            emit_bytes(as, {0x31, 0xC0, 0xC9, 0xC3}); // xor eax, eax; leave; ret
+            break;
 
-    eat(compiler, TokenKind::ParenL, "Expected '(' after function name.");
-    *compiler.out
-        << (valid_function ? funct->c_identity : id)
-        << "(";
+        case Op::Jump:
+            emit_bytes(as, {0xE9}); // jmp rel32
+            as.code.resize(as.code.size() + 4);
+            patch_rel32(as, as.code.size() - 4, offsets[instr.a]);
+            break;
 
-    if (peek_expression(compiler))
-    {
-        size_t i = 0;
-        TinyType param_type = compiler.in_function->function.param_count > 0
-                                  ? compiler.in_function->function.params->at(0)->variable.type
-                                  : TinyType::Unspecified;
-        compile_expression(compiler, scope, param_type);
-        while (match(compiler, TokenKind::Comma))
-        {
-            i++;
-            *compiler.out << ",";
-            param_type = compiler.in_function->function.param_count > i
-                             ? compiler.in_function->function.params->at(i)->variable.type
-                             : TinyType::Unspecified;
-            compile_expression(compiler, scope, param_type);
+        default:
+            break;
         }
     }
-
-    eat(compiler, TokenKind::ParenR, "Expected ')' after function arguments.");
-    *compiler.out << ")";
-
-    return valid_function ? funct->function.return_type : TinyType::Unspecified;
 }
 
-TinyType compile_list_literal(Compiler &compiler)
+// Compiles a function along with any of its callees that are not yet compiled
+JitFunction jit_compile(Jit &jit, const BytecodeProgram &program, uint32_t index)
 {
-    vector<int> values;
-    if (peek(compiler) == TokenKind::String)
-    {
-        Token token = eat(compiler, TokenKind::String, "Expected string.");
-        for (int i = 1; i <= token.str.length() - 2; i++)
-            values.push_back((int)token.str[i]);
-    }
-    else
-    {
-        // TODO: Parse array literals
-    }
+    JitAssembler as;
 
-    if (compiler.inserting_chars)
-    {
-        *compiler.out << '"';
+    // Compiled code that runs out of stack ends up here, and unwinds back to the interpreter
+    size_t overflow_stub = 0;
+    emit_bytes(as, {0x48, 0xB8}); // mov rax, jit_stack_overflow
+    emit_u64(as, (uint64_t)(uintptr_t)&jit_stack_overflow);
+    emit_bytes(as, {0xFF, 0xD0}); // call rax
 
-        // FIXME: Generate correct results for special characters (e.g. tabs should become '\t')
-        for (size_t i = 0; i < values.size(); i++)
-            *compiler.out << (char)values.at(i);
+    vector<size_t> offsets(program.functions.size(), SIZE_MAX);
+    vector<size_t> pending = {index};
+    while (!pending.empty())
+    {
+        size_t next = pending.back();
+        pending.pop_back();
+        if (offsets[next] != SIZE_MAX)
+            continue;
 
-        *compiler.out << '"';
+        while (as.code.size() % 16 != 0)
+            as.code.push_back(0xCC); // int3
+        offsets[next] = as.code.size();
+        jit_function(as, program, jit, (uint32_t)next, overflow_stub, pending);
     }
-    else if (compiler.insert_stmt)
+
+    for (const auto &fixup : as.fixups)
+        patch_rel32(as, fixup.first, offsets[fixup.second]);
+
+    size_t size = as.code.size();
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
     {
-        for (size_t i = 0; i < values.size(); i++)
-        {
-            if (i > 0)
-                *compiler.out << "<<";
-            *compiler.out << values.at(i);
-        }
+        jit.eligible[index] = false;
+        return nullptr;
     }
-    else
+    memcpy(memory, as.code.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
     {
-        *compiler.out << '{';
-
-        for (size_t i = 0; i < values.size(); i++)
-        {
-            if (i > 0)
-                *compiler.out << ',';
-            *compiler.out << values.at(i);
-        }
-
-        *compiler.out << '}';
+        munmap(memory, size);
+        jit.eligible[index] = false;
+        return nullptr;
     }
+    jit.regions.push_back({memory, size});
 
-    return TinyType::List;
-}
-
-TinyType compile_expression(Compiler &compiler, Scope &scope, TinyType type_hint)
-{
-    if (peek_call(compiler))
-        return compile_call(compiler, scope, type_hint);
-    else if (peek(compiler) == TokenKind::String)
-        return compile_list_literal(compiler);
-    else if (peek(compiler) == TokenKind::Identity)
-        return compile_identity(compiler, scope, type_hint);
-    else
-        error(compiler, "Expected expression");
-
-    return TinyType::Unspecified;
+    for (size_t i = 0; i < offsets.size(); i++)
+    {
+        if (offsets[i] == SIZE_MAX)
+            continue;
+        jit.functions[i] = (JitFunction)((uint8_t *)memory + offsets[i]);
+        if (jit.compiled != nullptr)
+            (*jit.compiled)++;
+    }
+    return jit.functions[index];
 }
 
-bool peek_token_in_statement(const Compiler &compiler, TokenKind kind)
+// Calls into compiled code, returning false if it ran out of stack
+bool jit_call(JitFunction function, const int *args, int &result)
 {
-    TokenKind t;
-    size_t i = 0;
-    do
-    {
-        t = peek_ahead(compiler, i);
-        if (t == TokenKind::Line || t == TokenKind::EndOfFile)
-            return false;
-        i++;
-    } while (t != kind);
+    jmp_buf overflow;
+    char marker;
+    jit_stack_limit = (uintptr_t)&marker - jit_stack_budget;
+    jit_overflow_target = &overflow;
+    if (setjmp(overflow) != 0)
+        return false;
+    result = function(args);
     return true;
 }
 
-bool peek_assign_stmt(const Compiler &compiler)
-{
-    return peek(compiler) == TokenKind::Identity && (peek_ahead(compiler, 1) == TokenKind::SquareL ||
-                                                     peek_ahead(compiler, 1) == TokenKind::Assign);
-}
+#endif
 
-bool peek_ltr_insert_stmt(const Compiler &compiler)
-{
-    return peek_token_in_statement(compiler, TokenKind::InsertR);
-}
+// VIRTUAL MACHINE //
 
-bool peek_rtl_insert_stmt(const Compiler &compiler)
-{
-    return peek_token_in_statement(compiler, TokenKind::InsertL);
-}
+using VmList = tiny::list;
 
-bool peek_return_stmt(const Compiler &compiler)
+struct VmFrame
 {
-    return peek(compiler) == TokenKind::Return;
-}
+    uint32_t function;
+    const Instr *return_pc; // Where to continue in the caller
+    uint32_t value_base;
+    uint32_t list_base;
+    uint32_t result; // The caller's register that receives the return value
+    uint32_t memo;   // The memo table entry this call's result is stored in, if any
+};
 
-bool peek_statement(const Compiler &compiler)
+struct VmOptions
 {
-    return peek_expression(compiler) ||
-           peek_return_stmt(compiler);
-}
+    bool jit = true;
+    FILE *output = stdout;
+    size_t *functions_jitted = nullptr; // Where to count the functions the JIT compiles, if anywhere
+};
 
-void compile_assign_stmt(Compiler &compiler, Scope &scope)
+struct VmOutput
 {
-    string id = eat(compiler, TokenKind::Identity, "Expected variable name.").str;
-    Entity *dec = fetch(&scope, id);
-    bool already_existed = dec != nullptr;
-
-    if (dec == nullptr)
-        dec = declare(scope, EntityKind::Variable, id);
+    FILE *file = stdout;
+    string buffer;
 
-    if (dec->kind != EntityKind::Variable)
+    void flush()
     {
-        error(compiler, "Cannot assign to '" + id + "' as it is not a variable.");
-        return;
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        fflush(file);
+        buffer.clear();
     }
 
-    if (match(compiler, TokenKind::SquareL))
+    void write(string_view str)
     {
-        if (!already_existed)
-            dec->variable.type = TinyType::List;
-        else if (dec->variable.type != TinyType::List)
-            error(compiler, "Variable '" + id + "' cannot be redeclared as a list.");
-        eat(compiler, TokenKind::SquareR, "Expected ']'");
+        buffer.append(str.data(), str.size());
+        if (buffer.size() >= (1 << 16))
+            flush();
     }
+};
 
-    if (match(compiler, TokenKind::Assign))
-    {
-        *compiler.out << dec->c_identity << "=";
-        compile_expression(compiler, scope, dec->variable.type);
-    }
+// Each memoized function has a direct-mapped table of entries laid out as
+// [state, args..., result], where an entry is pending until its call returns
+const uint32_t vm_memo_size = 256;
+enum VmMemoState : int { memo_empty, memo_pending, memo_done };
 
-    if (dec->variable.type == TinyType::Unspecified)
-        dec->variable.type = TinyType::Value;
+uint32_t vm_memo_entry(const int *args, size_t count)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < count; i++)
+        hash = (hash ^ (uint32_t)args[i]) * 16777619u;
+    return (hash ^ (hash >> 16)) & (vm_memo_size - 1);
 }
 
-void compile_ltr_insert_stmt(Compiler &compiler, Scope &scope)
+int vm_error(VmOutput &output, const char *msg)
 {
-    // FIXME: Supply type hints to compile_expression calls
-
-    compiler.insert_stmt = true;
-    compiler.inserting_ltr = true;
-    compiler.inserting_chars = false;
-    compile_expression(compiler, scope);
-
-    eat(compiler, TokenKind::InsertR, "Expected >> operator.");
-    *compiler.out << ">>";
-
-    compile_expression(compiler, scope);
-
-    while (match(compiler, TokenKind::InsertR))
-    {
-        *compiler.out << ">>";
-        compile_expression(compiler, scope);
-    }
-
-    compiler.insert_stmt = false;
+    output.flush();
+    cout << "Runtime error: " << msg << endl;
+    return 1;
 }
 
-void compile_rtl_insert_stmt(Compiler &compiler, Scope &scope)
+// Runs the program's main function, returning the process exit code
+int run_bytecode(const BytecodeProgram &program, const VmOptions &options = VmOptions())
 {
-    compiler.insert_stmt = true;
-    compiler.inserting_ltr = false;
-    compiler.inserting_chars = false;
-
-    TinyType target_type = compile_expression(compiler, scope, TinyType::List);
-    TinyType operand_hint = target_type == TinyType::Value ? TinyType::List : TinyType::Unspecified;
-
-    eat(compiler, TokenKind::InsertL, "Expected << operator.");
-    *compiler.out << "<<";
+    const size_t max_frames = 1 << 20;
 
-    compile_expression(compiler, scope, operand_hint);
+    vector<int> values;
+    vector<VmList> lists;
+    vector<VmFrame> frames;
+    VmOutput output;
+    output.file = options.output;
+
+    vector<vector<int>> memo(program.functions.size());
+    for (size_t i = 0; i < program.functions.size(); i++)
+        if (program.functions[i].memoized)
+            memo[i].assign(vm_memo_size * (program.functions[i].params.size() + 2), memo_empty);
+    vector<int> memo_args;
+
+#if defined(TINY_JIT)
+    Jit jit;
+    jit.enabled = options.jit;
+    jit.compiled = options.functions_jitted;
+    if (jit.enabled)
+        prepare_jit(jit, program);
+#endif
+
+    auto enter = [&](uint32_t function, const Instr *return_pc, uint32_t result)
+    {
+        const BytecodeFunction &fn = program.functions[function];
+        VmFrame frame;
+        frame.function = function;
+        frame.return_pc = return_pc;
+        frame.value_base = (uint32_t)values.size();
+        frame.list_base = (uint32_t)lists.size();
+        frame.result = result;
+        frame.memo = no_register;
+        values.resize(values.size() + fn.value_count);
+        lists.resize(lists.size() + fn.list_count);
+        frames.push_back(frame);
+    };
+
+    enter(program.main, nullptr, no_register);
+    const Instr *pc = program.functions[program.main].code.data();
+    int *v = values.data();
+    VmList *l = lists.data();
+
+#if defined(__GNUC__)
+    // Dispatch by jumping straight from one handler to the next through a table of label addresses
+    static void *const labels[] = {
+        &&op_MoveValue, &&op_MoveList, &&op_LoadList, &&op_LoadValue, &&op_Call, &&op_ArgValue, &&op_ArgList,
+        &&op_ReturnValue, &&op_ReturnList, &&op_Return, &&op_PrintValue, &&op_PrintList,
+        &&op_ReadValue, &&op_ReadList, &&op_PushBack, &&op_PopFront, &&op_AppendAll,
+        &&op_PushFront, &&op_PopBack, &&op_PrependAll, &&op_Jump, &&op_TakeList, &&op_ClearList};
+#define VM_CASE(name) op_##name:
+#define VM_NEXT() goto *labels[(int)pc->op]
+    VM_NEXT();
+#else
+#define VM_CASE(name) case Op::name:
+#define VM_NEXT() continue
+    while (true)
+        switch (pc->op)
+#endif
+    {
+        VM_CASE(MoveValue)
+        {
+            v[pc->a] = v[pc->b];
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(MoveList)
+        {
+            l[pc->a] = l[pc->b];
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(LoadList)
+        {
+            l[pc->a] = program.constants[pc->b];
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(LoadValue)
+        {
+            v[pc->a] = (int)pc->b;
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(Call)
+        {
+            const Instr *call = pc;
+            const BytecodeFunction &callee = program.functions[call->a];
+            const Instr *args = call + 1;
+
+#if defined(TINY_JIT)
+            if (jit.enabled && jit.eligible[call->a])
+            {
+                JitFunction native = jit.functions[call->a];
+                if (native == nullptr && ++jit.calls[call->a] >= jit_threshold)
+                    native = jit_compile(jit, program, call->a);
+
+                if (native != nullptr)
+                {
+                    for (size_t i = 0; i < callee.params.size(); i++)
+                        jit.args[i] = v[args[i].a];
+
+                    int result = 0;
+                    if (!jit_call(native, jit.args.data(), result))
+                        return vm_error(output, "stack overflow");
+                    if (call->b != no_register)
+                        v[call->b] = result;
+                    pc = args + callee.params.size();
+                    VM_NEXT();
+                }
+            }
+#endif
+
+            // Memoized functions only take values, so the arguments can be looked up directly
+            uint32_t memo_entry = no_register;
+            if (callee.memoized)
+            {
+                size_t arity = callee.params.size();
+                memo_args.resize(arity);
+                for (size_t i = 0; i < arity; i++)
+                    memo_args[i] = v[args[i].a];
+
+                memo_entry = vm_memo_entry(memo_args.data(), arity);
+                int *entry = &memo[call->a][memo_entry * (arity + 2)];
+                if (entry[0] == memo_done && std::equal(memo_args.begin(), memo_args.end(), entry + 1))
+                {
+                    if (call->b != no_register)
+                        v[call->b] = entry[arity + 1];
+                    pc = args + arity;
+                    VM_NEXT();
+                }
+                entry[0] = memo_pending;
+                std::copy(memo_args.begin(), memo_args.end(), entry + 1);
+            }
+
+            if (frames.size() >= max_frames)
+                return vm_error(output, "stack overflow");
+            const VmFrame &caller = frames.back();
+            uint32_t caller_values = caller.value_base;
+            uint32_t caller_lists = caller.list_base;
+
+            enter(call->a, args + callee.params.size(), call->b);
+            frames.back().memo = memo_entry;
+            const VmFrame &frame = frames.back();
+            v = values.data() + caller_values;
+            l = lists.data() + caller_lists;
+
+            uint32_t value_param = 0;
+            uint32_t list_param = 0;
+            for (size_t i = 0; i < callee.params.size(); i++)
+            {
+                if (args[i].op == Op::ArgList)
+                    lists[frame.list_base + list_param++] = l[args[i].a];
+                else
+                    values[frame.value_base + value_param++] = v[args[i].a];
+            }
+
+            pc = callee.code.data();
+            v = values.data() + frame.value_base;
+            l = lists.data() + frame.list_base;
+            VM_NEXT();
+        }
+        VM_CASE(ArgValue)
+        VM_CASE(ArgList)
+        {
+            // Arguments are consumed by the call that precedes them
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(ReturnValue)
+        VM_CASE(ReturnList)
+        VM_CASE(Return)
+        {
+            VmFrame frame = frames.back();
+            frames.pop_back();
+            if (frames.empty())
+            {
+                output.flush();
+                return 0;
+            }
+
+            // A colliding call made while this one ran will have completed the entry instead
+            if (frame.memo != no_register)
+            {
+                size_t arity = program.functions[frame.function].params.size();
+                int *entry = &memo[frame.function][frame.memo * (arity + 2)];
+                if (entry[0] == memo_pending && pc->op == Op::ReturnValue)
+                {
+                    entry[0] = memo_done;
+                    entry[arity + 1] = v[pc->a];
+                }
+                else if (entry[0] == memo_pending)
+                    entry[0] = memo_empty;
+            }
+
+            const VmFrame &caller = frames.back();
+            if (frame.result != no_register)
+            {
+                if (pc->op == Op::ReturnValue)
+                    values[caller.value_base + frame.result] = v[pc->a];
+                else if (pc->op == Op::ReturnList)
+                    lists[caller.list_base + frame.result] = std::move(l[pc->a]);
+            }
+
+            values.resize(frame.value_base);
+            lists.resize(frame.list_base);
+            pc = frame.return_pc;
+            v = values.data() + caller.value_base;
+            l = lists.data() + caller.list_base;
+            VM_NEXT();
+        }
+        VM_CASE(PrintValue)
+        {
+            char digits[16];
+            char *end = std::to_chars(digits, digits + sizeof(digits), v[pc->a]).ptr;
+            output.write(string_view(digits, end - digits));
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PrintList)
+        {
+            // Each contiguous run of the list is narrowed to characters in one go
+            const VmList &list = l[pc->a];
+            for (size_t start = 0, length; start < list.size(); start += length)
+            {
+                const int *values = list.run(start, length);
+                size_t used = output.buffer.size();
+                output.buffer.resize(used + length);
+                tiny::simd::narrow(&output.buffer[used], values, length);
+            }
+            output.write("");
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(ReadValue)
+        {
+            output.flush();
+            int n = 0;
+            if (scanf("%d", &n) != 1)
+                n = 0;
+            v[pc->a] = n;
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(ReadList)
+        {
+            // Reads one word, which is added to the front of the list
+            output.flush();
+            VmList word;
+            int c = getchar();
+            while (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+                c = getchar();
+            while (c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+            {
+                word.push_back(c);
+                c = getchar();
+            }
+            l[pc->a].prepend(word);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PushBack)
+        {
+            l[pc->a].push_back(v[pc->b]);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PopFront)
+        {
+            VmList &list = l[pc->b];
+            if (list.empty())
+                return vm_error(output, "cannot pop from an empty list");
+            v[pc->a] = list.pop_front();
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(AppendAll)
+        {
+            l[pc->a].append(l[pc->b]);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PushFront)
+        {
+            l[pc->b].push_front(v[pc->a]);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PopBack)
+        {
+            VmList &list = l[pc->a];
+            if (list.empty())
+                return vm_error(output, "cannot pop from an empty list");
+            v[pc->b] = list.pop_back();
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(PrependAll)
+        {
+            l[pc->b].prepend(l[pc->a]);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(Jump)
+        {
+            pc = program.functions[frames.back().function].code.data() + pc->a;
+            VM_NEXT();
+        }
+        VM_CASE(TakeList)
+        {
+            l[pc->a] = std::move(l[pc->b]);
+            pc++;
+            VM_NEXT();
+        }
+        VM_CASE(ClearList)
+        {
+            l[pc->a].clear();
+            pc++;
+            VM_NEXT();
+        }
+    }
+#undef VM_CASE
+#undef VM_NEXT
+
+    return 0;
+}
+
+// CORPUS GENERATOR //
+
+// Generates synthetic programs for benchmarking the compiler. Each shape stresses
+// a different part of the front end, and the scale controls how large it gets.
+
+enum class CorpusShape
+{
+    Functions,
+    Lines,
+    Blocks,
+    Strings,
+    Calls,
+};
+
+struct CorpusShapeInfo
+{
+    const char *name;
+    CorpusShape shape;
+    size_t default_scale;
+    const char *description;
+};
+
+const CorpusShapeInfo corpus_shapes[] = {
+    {"functions", CorpusShape::Functions, 20000, "many small functions (scale = function count)"},
+    {"lines", CorpusShape::Lines, 200000, "one very long insert statement (scale = operand count)"},
+    {"blocks", CorpusShape::Blocks, 200000, "one very long statement block (scale = statement count)"},
+    {"strings", CorpusShape::Strings, 1 << 24, "huge string literals (scale = total characters)"},
+    {"calls", CorpusShape::Calls, 20, "a binary tree of calls between value functions (scale = depth)"},
+};
+
+const CorpusShapeInfo *find_corpus_shape(string_view name)
+{
+    for (const CorpusShapeInfo &info : corpus_shapes)
+        if (name == info.name)
+            return &info;
+    return nullptr;
+}
+
+// Identifiers can only contain letters and underscores, so numbers are written in base 26
+void append_corpus_name(string &out, const char *prefix, size_t n)
+{
+    out += prefix;
+    do
+    {
+        out += (char)('a' + n % 26);
+        n /= 26;
+    } while (n > 0);
+}
+
+string generate_corpus(CorpusShape shape, size_t scale)
+{
+    string out;
+
+    switch (shape)
+    {
+    case CorpusShape::Functions:
+        for (size_t i = 0; i < scale; i++)
+        {
+            string name;
+            append_corpus_name(name, "fn_", i);
+            out += name + "(a, b[]) {\n";
+            out += "    c[] = b\n";
+            out += "    c << a\n";
+            out += "    console << \"" + name + "\"\n";
+            out += "    return c\n";
+            out += "}\n\n";
+        }
+        out += "main() {\n    console << \"done\"\n}\n";
+        break;
+
+    case CorpusShape::Lines:
+        out += "main() {\n    console";
+        for (size_t i = 0; i < scale; i++)
+        {
+            out += " << ";
+            if (i % 2 == 0)
+                out += "\"text\"";
+            else
+                append_corpus_name(out, "v_", i % 1024);
+        }
+        out += "\n}\n";
+        break;
+
+    case CorpusShape::Blocks:
+        out += "main() {\n    all[]\n    n\n    console >> n\n";
+        for (size_t i = 0; i < scale; i++)
+        {
+            string name;
+            append_corpus_name(name, "v_", i);
+            out += "    " + name + " = n\n";
+            out += "    all << " + name + "\n";
+        }
+        out += "    console << all\n}\n";
+        break;
+
+    case CorpusShape::Strings:
+    {
+        const size_t literal_length = 1 << 20;
+        const char text[] = "the quick brown fox jumps over the lazy dog ";
+        out += "main() {\n";
+        for (size_t written = 0; written < scale;)
+        {
+            size_t length = std::min(literal_length, scale - written);
+            out += "    console << \"";
+            for (size_t i = 0; i < length; i++)
+                out += text[i % (sizeof(text) - 1)];
+            out += "\"\n";
+            written += length;
+        }
+        out += "}\n";
+        break;
+    }
+
+    case CorpusShape::Calls:
+        // Each function calls the one before it twice, so running main makes 2^scale calls
+        out += "f_a(a, b) {\n    return a\n}\n\n";
+        for (size_t i = 1; i <= scale; i++)
+        {
+            string callee;
+            append_corpus_name(callee, "f_", i - 1);
+            append_corpus_name(out, "f_", i);
+            out += "(a, b) {\n";
+            out += "    x = " + callee + "(a, b)\n";
+            out += "    y = " + callee + "(b, x)\n";
+            out += "    return y\n";
+            out += "}\n\n";
+        }
+        out += "main() {\n    v\n    r = ";
+        append_corpus_name(out, "f_", scale);
+        out += "(v, v)\n    console << r << \"\\n\"\n}\n";
+        break;
+    }
+
+    return out;
+}
+
+// BENCHMARK //
+
+// Discards everything written to it, so that diagnostics and traces are not part of the measurement
+struct NullBuffer : std::streambuf
+{
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+};
+
+struct PhaseTimes
+{
+    double lexing = 0;
+    double compiling = 0;
+    double writing = 0;
+
+    bool failed = false;
+
+    double total() const { return lexing + compiling + writing; }
+};
+
+PhaseTimes benchmark_once(const string &src, size_t &token_count)
+{
+    PhaseTimes times;
+
+    Interner interner;
+    auto start = std::chrono::steady_clock::now();
+    Lexer lexer(&src, &interner);
+    while (!lexer.finished)
+        next_token(lexer);
+    times.lexing = seconds_since(start);
+    token_count = lexer.tokens.size();
+
+    start = std::chrono::steady_clock::now();
+    Compiler compiler(&lexer);
+    Emitter program;
+    compile_program(compiler, program);
+    times.compiling = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    write_program(compiler, program, "local/output.cpp");
+    times.writing = seconds_since(start);
+    times.failed = has_errors(compiler);
+
+    return times;
+}
+
+void benchmark(const string &name, const string &src, size_t runs)
+{
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = cout.rdbuf(&null_buffer);
+
+    size_t token_count = 0;
+    bool failed = benchmark_once(src, token_count).failed; // Warm up
+
+    PhaseTimes mean;
+    for (size_t i = 0; i < runs; i++)
+    {
+        PhaseTimes times = benchmark_once(src, token_count);
+        mean.lexing += times.lexing / runs;
+        mean.compiling += times.compiling / runs;
+        mean.writing += times.writing / runs;
+    }
+
+    cout.rdbuf(cout_buffer);
+
+    const double mb = src.size() / 1e6;
+    cout
+        << std::fixed << std::setprecision(3)
+        << name << (failed ? " (compile error)" : "") << "\n"
+        << "  source     " << mb << " MB, " << token_count << " tokens, " << runs << " runs\n"
+        << "  lexing     " << mean.lexing * 1e3 << " ms  "
+        << mb / mean.lexing << " MB/s  " << token_count / mean.lexing / 1e6 << " Mtokens/s\n"
+        << "  compiling  " << mean.compiling * 1e3 << " ms  "
+        << mb / mean.compiling << " MB/s  " << token_count / mean.compiling / 1e6 << " Mtokens/s\n"
+        << "  writing    " << mean.writing * 1e3 << " ms\n"
+        << "  total      " << mean.total() * 1e3 << " ms  "
+        << mb / mean.total() << " MB/s  " << token_count / mean.total() / 1e6 << " Mtokens/s\n";
+    cout.unsetf(std::ios::fixed);
+}
+
+// Hashes every field of every token, so the streams different kernels give can be compared
+size_t hash_tokens(const TokenStream &tokens)
+{
+    size_t hash = 14695981039346656037ull;
+    auto add = [&](size_t field)
+    { hash = (hash ^ field) * 1099511628211ull; };
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        add((size_t)tokens.kinds[i]);
+        add(tokens.offsets[i]);
+        add(tokens.lengths[i]);
+        add(tokens.lines[i]);
+        add(tokens.symbols[i]);
+    }
+    return hash;
+}
+
+// Times the lexer on its own, with each set of string kernels the CPU supports. Returns
+// false if any of them gives different tokens to the scalar kernel.
+bool benchmark_lexer(const string &name, const string &src, size_t runs)
+{
+    vector<const LexerKernels *> kernels = {&lexer_kernels_scalar};
+#ifdef TINY_LEXER_SSE2
+    kernels.push_back(&lexer_kernels_sse2);
+#endif
+#ifdef TINY_LEXER_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(&lexer_kernels_avx2);
+#endif
+
+    const double mb = src.size() / 1e6;
+    cout << std::fixed << std::setprecision(3) << name << "\n"
+         << "  source  " << mb << " MB, " << runs << " runs\n";
+    bool same = true;
+    size_t expected = 0;
+    for (const LexerKernels *kernel : kernels)
+    {
+        size_t token_count = 0;
+        size_t hash = 0;
+        double mean = 0;
+        double fastest = 0;
+        for (size_t i = 0; i <= runs; i++) // The first run warms up
+        {
+            Interner interner;
+            auto start = std::chrono::steady_clock::now();
+            Lexer lexer(&src, &interner);
+            lexer.kernels = kernel;
+            lexer.diagnostics.echo = nullptr;
+            while (!lexer.finished)
+                next_token(lexer);
+            double time = seconds_since(start);
+            if (i > 0)
+            {
+                mean += time / runs;
+                fastest = i == 1 ? time : std::min(fastest, time);
+            }
+            token_count = lexer.tokens.size();
+            if (i == 0)
+                hash = hash_tokens(lexer.tokens);
+        }
+        if (kernel == kernels[0])
+            expected = hash;
+        cout << "  " << std::left << std::setw(7) << kernel->name << std::right << " " << mean * 1e3 << " ms  "
+             << mb / mean << " MB/s  " << token_count / mean / 1e6 << " Mtokens/s  (fastest "
+             << mb / fastest << " MB/s)" << (hash != expected ? "  different tokens!" : "") << "\n";
+        same = same && hash == expected;
+    }
+    cout.unsetf(std::ios::fixed);
+    return same;
+}
+
+// How the generated C++ is built: with the system compiler ($CXX), against the
+// runtime library, which is built into local/ when a benchmark starts
+const char *const runtime_sources[] = {"error", "list", "console"};
+
+string cxx_command()
+{
+    const char *cxx = getenv("CXX");
+    return string(cxx != nullptr ? cxx : "c++") + " -std=c++17 -O2";
+}
+
+// Builds local/libtiny.a from the runtime sources, and with `pch` a precompiled
+// tiny/list.h in local/pch. Returns false if either could not be built.
+bool build_runtime_library(bool pch)
+{
+    string objects;
+    for (const char *name : runtime_sources)
+    {
+        string object = string("local/tiny_") + name + ".o";
+        string command = cxx_command() + " -c ../runtime/tiny/" + name + ".cpp -o " + object + " 2>/dev/null";
+        if (std::system(command.c_str()) != 0)
+            return false;
+        objects += " " + object;
+    }
+    if (std::system(("rm -f local/libtiny.a && ar rcs local/libtiny.a" + objects).c_str()) != 0)
+        return false;
+
+    if (!pch)
+        return true;
+    string command = "mkdir -p local/pch/tiny && " + cxx_command() + " -x c++-header ../runtime/tiny/list.h -o local/pch/tiny/list.h.gch 2>/dev/null";
+    return std::system(command.c_str()) == 0;
+}
+
+// Times the generated C++ for a program, or returns false if it did not build
+bool benchmark_cpp(const string &src, bool memoize, size_t runs, double &build, double &run)
+{
+    Interner interner;
+    Lexer lexer(&src, &interner);
+    while (!lexer.finished)
+        next_token(lexer);
+    Compiler compiler(&lexer);
+    compiler.memoize = memoize;
+    Emitter program;
+    compile_program(compiler, program);
+    write_program(compiler, program, "local/output.cpp");
+
+    string command = cxx_command() + " -I ../runtime -o local/output local/output.cpp local/libtiny.a 2>/dev/null";
+    auto start = std::chrono::steady_clock::now();
+    if (std::system(command.c_str()) != 0)
+        return false;
+    build = seconds_since(start);
+
+    run = 0;
+    for (size_t i = 0; i < runs; i++)
+    {
+        start = std::chrono::steady_clock::now();
+        std::system("./local/output > /dev/null < /dev/null");
+        run += seconds_since(start) / runs;
+    }
+    return true;
+}
+
+// Times running a program in the interpreter with and without the JIT, and
+// building and running the generated C++
+void benchmark_run(const string &name, const string &src, size_t runs)
+{
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = cout.rdbuf(&null_buffer);
+
+    Interner interner;
+    Lexer lexer(&src, &interner);
+    while (!lexer.finished)
+        next_token(lexer);
+    Compiler compiler(&lexer);
+    compile_bytecode(compiler);
+    bool failed = has_errors(compiler);
+
+    // The same program again, with pure functions memoized
+    Lexer memo_lexer(&src, &interner);
+    while (!memo_lexer.finished)
+        next_token(memo_lexer);
+    Compiler memo_compiler(&memo_lexer);
+    memo_compiler.memoize = true;
+    if (!failed)
+        compile_bytecode(memo_compiler);
+
+    double interpreter = 0;
+    double jit = 0;
+    double memoized = 0;
+    FILE *null_file = fopen("/dev/null", "w");
+    if (!failed && null_file != nullptr)
+    {
+        VmOptions options;
+        options.output = null_file;
+        for (size_t i = 0; i < runs; i++)
+        {
+            options.jit = false;
+            auto start = std::chrono::steady_clock::now();
+            run_bytecode(compiler.bytecode, options);
+            interpreter += seconds_since(start) / runs;
+
+            start = std::chrono::steady_clock::now();
+            run_bytecode(memo_compiler.bytecode, options);
+            memoized += seconds_since(start) / runs;
+
+            options.jit = true;
+            start = std::chrono::steady_clock::now();
+            run_bytecode(compiler.bytecode, options);
+            jit += seconds_since(start) / runs;
+        }
+    }
+    if (null_file != nullptr)
+        fclose(null_file);
+
+    double build = 0, run = 0;
+    double memo_build = 0, memo_run = 0;
+    bool library = !failed && build_runtime_library(false);
+    bool built = library && benchmark_cpp(src, false, runs, build, run);
+    bool memo_built = library && benchmark_cpp(src, true, runs, memo_build, memo_run);
+
+    cout.rdbuf(cout_buffer);
+
+    cout << std::fixed << std::setprecision(3) << name << (failed ? " (compile error)" : "");
+    if (!failed && compiler.stats.calls_shared > 0)
+        cout << " (" << compiler.stats.calls_shared << " repeated calls shared)";
+    cout << "\n";
+    if (!failed)
+    {
+        cout
+            << "  interpreter  " << interpreter * 1e3 << " ms\n"
+            << "  memoized     " << memoized * 1e3 << " ms\n"
+            << "  jit          " << jit * 1e3 << " ms\n";
+        if (built)
+            cout << "  c++          " << run * 1e3 << " ms (+ " << build * 1e3 << " ms to build)\n";
+        else
+            cout << "  c++          generated code did not build\n";
+        if (memo_built)
+            cout << "  c++ memoized " << memo_run * 1e3 << " ms (+ " << memo_build * 1e3 << " ms to build)\n";
+        else
+            cout << "  c++ memoized generated code did not build\n";
+    }
+    cout.unsetf(std::ios::fixed);
+}
+
+// Times getting from a program's source to an executable: generating its C++, then
+// building that with the runtime compiled alongside it, against the runtime library,
+// and against the library with a precompiled tiny/list.h
+void benchmark_build(const string &name, const string &src, size_t runs)
+{
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = cout.rdbuf(&null_buffer);
+
+    double generate = 0;
+    bool failed = false;
+    for (size_t i = 0; i < runs && !failed; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        Interner interner;
+        Lexer lexer(&src, &interner);
+        while (!lexer.finished)
+            next_token(lexer);
+        Compiler compiler(&lexer);
+        Emitter program;
+        compile_program(compiler, program);
+        write_program(compiler, program, "local/output.cpp");
+        generate += seconds_since(start) / runs;
+        failed = has_errors(compiler);
+    }
+    cout.rdbuf(cout_buffer);
+
+    cout << std::fixed << std::setprecision(1) << name << (failed ? " (compile error)" : "") << "\n";
+    if (failed)
+        return;
+    cout << "  tiny                  " << generate * 1e3 << " ms\n";
+
+    string sources;
+    for (const char *source : runtime_sources)
+        sources += string(" ../runtime/tiny/") + source + ".cpp";
+    const std::pair<const char *, string> builds[] = {
+        {"runtime sources", "-I ../runtime" + sources},
+        {"libtiny.a", "-I ../runtime local/libtiny.a"},
+        {"libtiny.a + pch", "-I local/pch -I ../runtime local/libtiny.a"},
+    };
+    for (const auto &build : builds)
+    {
+        string command = cxx_command() + " -o local/output local/output.cpp " + build.second + " 2>/dev/null";
+        double seconds = 0;
+        bool built = true;
+        for (size_t i = 0; i < runs && built; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            built = std::system(command.c_str()) == 0;
+            seconds += seconds_since(start) / runs;
+        }
+
+        cout << "  c++ " << std::left << std::setw(18) << build.first << std::right;
+        if (built)
+            cout << seconds * 1e3 << " ms (source to executable " << (generate + seconds) * 1e3 << " ms)\n";
+        else
+            cout << "generated code did not build\n";
+    }
+    cout.unsetf(std::ios::fixed);
+}
+
+// Times one of the conversions between list values and characters, in microseconds per run
+template <typename Out, typename In>
+double time_kernel(void (*kernel)(Out *, const In *, size_t), Out *out, const In *in, size_t count, size_t runs)
+{
+    kernel(out, in, count);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; i++)
+        kernel(out, in, count);
+    return seconds_since(start) / runs * 1e6;
+}
+
+// Times the conversions with each kernel the CPU supports. Returns false if any of them
+// converts differently to the plain loops.
+bool benchmark_kernels(size_t count, size_t runs)
+{
+    // Values outside 0 to 255, and characters above 127, so that masking and sign are tested
+    vector<int> values(count), widened(count), expected_widened;
+    vector<char> chars(count), narrowed(count), expected_narrowed;
+    for (size_t i = 0; i < count; i++)
+    {
+        values[i] = (int)(i * 7 % 600) - 300;
+        chars[i] = (char)(i * 11);
+    }
+
+    struct Kernel
+    {
+        const char *name;
+        void (*narrow)(char *, const int *, size_t);
+        void (*widen)(int *, const char *, size_t);
+    };
+    vector<Kernel> kernels = {{"scalar", tiny::simd::narrow_scalar, tiny::simd::widen_scalar}};
+#if defined(TINY_SIMD_X86)
+    kernels.push_back({"sse2", tiny::simd::narrow_sse2, tiny::simd::widen_sse2});
+    if (tiny::simd::has_avx2())
+        kernels.push_back({"avx2", tiny::simd::narrow_avx2, tiny::simd::widen_avx2});
+#endif
+
+    bool same = true;
+    cout << std::fixed << std::setprecision(3) << count << " values, " << runs << " runs\n";
+    for (const Kernel &kernel : kernels)
+    {
+        double narrow = time_kernel(kernel.narrow, narrowed.data(), values.data(), count, runs);
+        double widen = time_kernel(kernel.widen, widened.data(), chars.data(), count, runs);
+        if (kernel.name == kernels[0].name)
+        {
+            expected_narrowed = narrowed;
+            expected_widened = widened;
+        }
+        bool kernel_same = narrowed == expected_narrowed && widened == expected_widened;
+        cout << "  " << std::left << std::setw(8) << kernel.name << std::right
+             << " narrow " << narrow << " us   widen " << widen << " us"
+             << (kernel_same ? "" : "  different results!") << "\n";
+        same = same && kernel_same;
+    }
+    cout.unsetf(std::ios::fixed);
+    return same;
+}
+
+// OPTIONS //
+
+// Reads a whole argument as a count, failing on anything else, including a sign
+bool parse_count(string_view text, size_t &count)
+{
+    const char *end = text.data() + text.size();
+    std::from_chars_result result = std::from_chars(text.data(), end, count);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+// Reads argv[i] as a count, or takes `fallback` if there are fewer arguments. Returns
+// false, after reporting it, if the argument is not a count.
+bool count_argument(int argc, char *argv[], int i, size_t fallback, size_t &count)
+{
+    count = fallback;
+    if (i >= argc || parse_count(argv[i], count))
+        return true;
+    cout << "Expected a number, not " << argv[i] << endl;
+    return false;
+}
+
+// The options for compiling a file, which `tiny build` and `tiny run` share
+struct Options
+{
+    string src_path = "../samples/compiler-test.tiny";
+    vector<string> disabled_passes;
+    bool trace_tokens = false;
+    bool run = false;
+    bool memoize = false;
+    bool verbose = false;
+    size_t jobs = 1; // Threads generating C++, or compiling files in a batch
+    VmOptions vm_options;
+    bool report_stats = false;
+    string stats_path;
+};
+
+// Reads the options from argv[first] on. Returns false if the compiler should stop
+// straight away, with `exit_code` set, after an invalid option or --list-passes.
+bool parse_options(int argc, char *argv[], int first, Options &options, int &exit_code)
+{
+    for (int i = first; i < argc; i++)
+    {
+        string_view arg = argv[i];
+        if (arg == "--trace-tokens")
+        {
+            options.trace_tokens = true;
+        }
+        else if (arg == "--run")
+        {
+            options.run = true;
+        }
+        else if (arg == "--no-jit")
+        {
+            options.vm_options.jit = false;
+        }
+        else if (arg == "--memoize")
+        {
+            options.memoize = true;
+        }
+        else if (arg == "--verbose")
+        {
+            options.verbose = true;
+        }
+        else if (arg == "--jobs")
+        {
+            options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+        else if (arg.substr(0, 7) == "--jobs=")
+        {
+            if (!parse_count(arg.substr(7), options.jobs) || options.jobs == 0)
+            {
+                cout << "Invalid option " << arg << " (the number of jobs must be a positive whole number)" << endl;
+                exit_code = 1;
+                return false;
+            }
+        }
+        else if (arg == "--stats" || arg == "--time-passes")
+        {
+            options.report_stats = true;
+        }
+        else if (arg.substr(0, 8) == "--stats=" || arg.substr(0, 14) == "--time-passes=")
+        {
+            options.report_stats = true;
+            options.stats_path = string(arg.substr(arg.find('=') + 1));
+        }
+        else if (arg.substr(0, 15) == "--disable-pass=")
+        {
+            const Pass *pass = find_pass(arg.substr(15));
+            if (pass == nullptr || !pass->optional)
+            {
+                cout << "Cannot disable pass " << arg.substr(15) << " (see --list-passes)" << endl;
+                exit_code = 1;
+                return false;
+            }
+            options.disabled_passes.push_back(pass->name);
+        }
+        else if (arg == "--list-passes")
+        {
+            for (size_t i = 0; i < pass_count; i++)
+                cout << passes[i].name << (passes[i].optional ? " (optional)" : "") << " - " << passes[i].description << "\n";
+            cout << lower_pass.name << " - " << lower_pass.description << "\n";
+            exit_code = 0;
+            return false;
+        }
+        else if (arg.substr(0, 2) == "--")
+        {
+            cout << "Unknown option " << arg << endl;
+            exit_code = 1;
+            return false;
+        }
+        else
+        {
+            options.src_path = "../" + string(arg);
+        }
+    }
+    return true;
+}
+
+void configure(Compiler &compiler, const Options &options)
+{
+    compiler.disabled_passes = options.disabled_passes;
+    compiler.memoize = options.memoize;
+    compiler.verbose = options.verbose;
+    compiler.threads = options.jobs;
+}
+
+// BUILD CACHE //
+
+// `tiny build` and `tiny run` keep the generated C++ and the executable built from it
+// in a cache directory (local/cache, or $TINY_CACHE_DIR). Both are named by a hash of
+// everything that goes into them: the source, the compiler's executable, the options
+// that change the generated code, the C++ compiler command and the runtime's sources.
+// The system compiler only runs on a miss. Every file is written under a temporary
+// name and then renamed into place, so a concurrent build of the same program never
+// sees a partial file, and whichever build finishes last replaces an identical result.
+// Once the cache holds more than cache_max_bytes, the least recently used programs
+// are evicted.
+
+constexpr uint64_t cache_max_bytes = 256ull << 20;
+
+// Two independent 64-bit hashes, for a 128-bit key
+struct CacheKey
+{
+    uint64_t a = 14695981039346656037ull;
+    uint64_t b = 0x9e3779b97f4a7c15ull;
+};
+
+// Each part is preceded by its length, so that different lists of parts hash differently
+void hash_part(CacheKey &key, string_view part)
+{
+    auto add = [&](uint8_t byte)
+    {
+        key.a = (key.a ^ byte) * 1099511628211ull; // FNV-1a
+        key.b = ((key.b << 5 | key.b >> 59) ^ byte) * 0x9e3779b97f4a7c15ull;
+    };
+    for (size_t i = 0, length = part.size(); i < sizeof(length); i++)
+        add((uint8_t)(length >> (i * 8)));
+    for (char c : part)
+        add((uint8_t)c);
+}
+
+string key_name(const CacheKey &key)
+{
+    char name[33];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long)key.a, (unsigned long long)key.b);
+    return name;
+}
+
+string cache_directory()
+{
+    const char *dir = getenv("TINY_CACHE_DIR");
+    return dir != nullptr ? dir : "local/cache";
+}
+
+// A name for a file that will be renamed to `path`, unique to this process
+string temporary_path(const string &path)
+{
+#ifdef TINY_POSIX_IO
+    return path + ".tmp" + std::to_string(getpid());
+#else
+    return path + ".tmp";
+#endif
+}
+
+// Moves a finished file into place, replacing any copy another build put there first
+bool commit_file(const string &temporary, const string &path)
+{
+    std::error_code failed;
+    std::filesystem::rename(temporary, path, failed);
+    if (failed)
+        std::filesystem::remove(temporary, failed);
+    return !failed;
+}
+
+// Hashes the name and contents of every file in a directory, in name order
+bool hash_directory(CacheKey &key, const string &dir)
+{
+    vector<std::filesystem::path> files;
+    std::error_code failed;
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(dir, failed))
+        files.push_back(entry.path());
+    if (failed)
+        return false;
+    std::sort(files.begin(), files.end());
+
+    for (const std::filesystem::path &file : files)
+    {
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        hash_part(key, file.filename().string());
+        hash_part(key, contents);
+    }
+    return true;
+}
 
-    while (match(compiler, TokenKind::InsertL))
+// Any change to the compiler may change the code it generates, so this hashes the
+// running executable, or where the system cannot name it, the compiler's sources
+bool hash_compiler(CacheKey &key)
+{
+    std::ifstream in("/proc/self/exe", std::ios::in | std::ios::binary);
+    if (!in)
+        return hash_directory(key, "../compiler");
+    string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    hash_part(key, contents);
+    return true;
+}
+
+// Builds the runtime library at `path`, from objects kept under temporary names
+bool build_cached_library(const string &path)
+{
+    string objects;
+    bool built = true;
+    for (const char *name : runtime_sources)
+    {
+        string object = temporary_path(path + "." + name + ".o");
+        string command = cxx_command() + " -c ../runtime/tiny/" + name + ".cpp -o " + object;
+        built = built && std::system(command.c_str()) == 0;
+        objects += " " + object;
+    }
+
+    string library = temporary_path(path);
+    built = built && std::system(("ar rcs " + library + objects).c_str()) == 0;
+    std::system(("rm -f" + objects).c_str());
+    if (!built)
+    {
+        cout << "Could not build the runtime library with " << cxx_command() << endl;
+        return false;
+    }
+    return commit_file(library, path);
+}
+
+// Removes the least recently used programs until the cache fits in cache_max_bytes.
+// The runtime libraries are small and shared by every program, so they are kept.
+void evict_cache(const string &dir, const string &keep)
+{
+    struct CacheEntry
+    {
+        string name;
+        std::filesystem::file_time_type used;
+        uint64_t bytes = 0;
+    };
+    std::unordered_map<string, CacheEntry> entries;
+    uint64_t total = 0;
+
+    std::error_code failed;
+    for (const std::filesystem::directory_entry &file : std::filesystem::directory_iterator(dir, failed))
+    {
+        string name = file.path().filename().string();
+        uint64_t bytes = file.file_size(failed);
+        if (failed)
+            continue;
+        total += bytes;
+
+        // A temporary file left for an hour belongs to a build that never finished,
+        // whether of a program or of a runtime library and its objects
+        if (name.find(".tmp") != string::npos)
+        {
+            if (std::filesystem::file_time_type::clock::now() - file.last_write_time(failed) > std::chrono::hours(1))
+                std::filesystem::remove(file.path(), failed);
+            continue;
+        }
+        if (name.compare(0, 7, "libtiny") == 0)
+            continue;
+
+        // A program's C++ and its executable share the name of their key
+        CacheEntry &entry = entries[name.substr(0, name.find('.'))];
+        entry.name = name.substr(0, name.find('.'));
+        entry.used = std::max(entry.used, file.last_write_time(failed));
+        entry.bytes += bytes;
+    }
+
+    vector<CacheEntry> oldest;
+    for (auto &entry : entries)
+        if (entry.first != keep)
+            oldest.push_back(entry.second);
+    std::sort(oldest.begin(), oldest.end(), [](const CacheEntry &x, const CacheEntry &y)
+              { return x.used < y.used; });
+
+    for (size_t i = 0; i < oldest.size() && total > cache_max_bytes; i++)
+    {
+        std::filesystem::remove(dir + "/" + oldest[i].name, failed);
+        std::filesystem::remove(dir + "/" + oldest[i].name + ".cpp", failed);
+        total -= oldest[i].bytes;
+    }
+}
+
+// Finds the cached executable for a program, building it first on a miss. Returns false,
+// after reporting why, if the program could not be compiled or its C++ did not build.
+bool cached_executable(const string &src, const Options &options, string &path, bool &hit)
+{
+    string dir = cache_directory();
+    std::error_code failed;
+    std::filesystem::create_directories(dir, failed);
+
+    CacheKey runtime;
+    hash_part(runtime, cxx_command());
+    if (!hash_directory(runtime, "../runtime/tiny"))
+    {
+        cout << "Could not read the runtime in ../runtime/tiny" << endl;
+        return false;
+    }
+
+    CacheKey key = runtime;
+    if (!hash_compiler(key))
+    {
+        cout << "Could not read the compiler, or its sources in ../compiler" << endl;
+        return false;
+    }
+    hash_part(key, src);
+    hash_part(key, options.memoize ? "--memoize" : "");
+    for (const string &pass : options.disabled_passes)
+        hash_part(key, pass);
+
+    string name = key_name(key);
+    path = dir + "/" + name;
+    hit = std::filesystem::exists(path, failed);
+    if (hit)
+    {
+        // The time an executable was last written to is the time it was last used
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), failed);
+        return true;
+    }
+
+    string library = dir + "/libtiny-" + key_name(runtime) + ".a";
+    if (!std::filesystem::exists(library, failed) && !build_cached_library(library))
+        return false;
+
+    Interner interner;
+    Lexer lexer(&src, &interner);
+    while (!lexer.finished)
+        next_token(lexer);
+    Compiler compiler(&lexer);
+    configure(compiler, options);
+    Emitter program;
+    compile_program(compiler, program);
+    if (has_errors(compiler))
+        return false;
+
+    string source = temporary_path(path + ".cpp");
+    write_program(compiler, program, source);
+    if (has_errors(compiler) || !commit_file(source, path + ".cpp"))
+        return false;
+
+    string executable = temporary_path(path);
+    string command = cxx_command() + " -I ../runtime -o " + executable + " " + path + ".cpp " + library;
+    if (std::system(command.c_str()) != 0)
+    {
+        std::filesystem::remove(executable, failed);
+        cout << "The generated C++ in " << path << ".cpp did not build" << endl;
+        return false;
+    }
+    if (!commit_file(executable, path))
+        return false;
+
+    evict_cache(dir, name);
+    return true;
+}
+
+// WATCH MODE //
+
+// `tiny watch` keeps a program's C++ up to date while its source is edited. The source
+// is kept split into one chunk of text per function, along with each function's C++.
+// A function's C++ only depends on its own text, on the functions it calls, and on
+// whether it is called exactly once (which lets a larger body be inlined into it). So
+// after an edit only the chunks around it are split up again, and only the functions
+// whose text changed, and those that call them directly or not, are compiled again,
+// each in a program made of just it and the functions it calls, with the call counts
+// of the whole program. Edits the chunks cannot follow, such as adding, removing or
+// renaming a function, or an edit with an error in it, compile the whole program.
+//
+// The calls in a function's text decide which functions it depends on, but only the
+// calls the compiler counts, which leave out any after a return, decide how often a
+// function is called. Those are only known once a function is compiled, so a function
+// whose text changed is compiled first with the call counts as they were, and again
+// later only if the counts of the functions it calls turned out to change.
+
+constexpr int watch_poll_ms = 2; // How often the source is checked for changes
+
+struct WatchedFunction
+{
+    size_t start = 0;  // Where the function's text begins in the source
+    size_t length = 0; // Up to where the next function's begins
+    size_t name_length = 0;
+    vector<uint32_t> calls;   // The functions its text calls, by index, once for each call
+    vector<uint32_t> counted; // The same for the calls the compiler counted
+    CacheKey text;          // Hash of its text
+    CacheKey interface;     // Hash of its text, whether it is called once and the interfaces of its callees
+    string code;            // Its C++
+    size_t offset = 0;      // Where its C++ begins in the output
+    uint8_t headers = 0;    // RuntimeHeader bits for the runtime headers its C++ needs
+};
+
+struct Watch
+{
+    Options options;
+    Interner interner; // Shared by every compile, whole or of some functions, so symbols stay the same
+    string src;
+    size_t head = 0; // Length of the text before the first function
+    vector<WatchedFunction> functions;
+    std::unordered_map<string, uint32_t> indices; // Function name -> index
+    vector<uint32_t> call_sites;                  // Calls to each function in the whole program
+    bool split = false;                           // Whether the functions describe the last successful compile of src
+    string prelude;                               // The prelude last written to the output
+    bool written = false;                         // Whether the output holds the C++ of the functions, at their offsets
+
+    vector<uint8_t> dirty;  // Per function, whether its interface changed in this rebuild
+    vector<uint32_t> marks; // Per function, the last slice it was added to
+    uint32_t mark = 0;
+};
+
+bool same_key(const CacheKey &x, const CacheKey &y)
+{
+    return x.a == y.a && x.b == y.b;
+}
+
+string_view function_text(const string &src, const WatchedFunction &fun)
+{
+    return string_view(src).substr(fun.start, fun.length);
+}
+
+string_view function_name(const string &src, const WatchedFunction &fun)
+{
+    return string_view(src).substr(fun.start, fun.name_length);
+}
+
+// Splits src[from, to) into the texts of functions, each beginning at a line that starts
+// with a name outside of any braces and strings, and sets `head` to where the first one
+// begins. Returns false if `to` could not be the start of a function or the end of the
+// source, as the split would not line up with the functions after it.
+bool split_functions(const string &src, size_t from, size_t to, size_t &head, vector<WatchedFunction> &functions)
+{
+    size_t first = functions.size();
+    head = to;
+    int depth = 0;
+    bool in_string = false;
+    for (size_t i = from; i < to; i++)
+    {
+        char c = src[i];
+        if (in_string)
+        {
+            in_string = c != '"';
+        }
+        else if (c == '"')
+        {
+            in_string = true;
+        }
+        else if (c == '{' || c == '}')
+        {
+            depth += c == '{' ? 1 : -1;
+        }
+        else if (depth == 0 && (i == 0 || src[i - 1] == '\n') && char_class(c) == CharClass::Name)
+        {
+            if (functions.size() > first)
+                functions.back().length = i - functions.back().start;
+            else
+                head = i;
+
+            WatchedFunction fun;
+            fun.start = i;
+            while (i + 1 < to && char_class(src[i + 1]) == CharClass::Name)
+                i++;
+            fun.name_length = i + 1 - fun.start;
+            functions.push_back(std::move(fun));
+        }
+    }
+    if (functions.size() > first)
+        functions.back().length = to - functions.back().start;
+
+    if (depth != 0 || in_string)
+        return false;
+    return to == src.size() || ((to == 0 || src[to - 1] == '\n') && char_class(src[to]) == CharClass::Name);
+}
+
+// Finds every call in a function's text to itself or a function before it
+void find_calls(const Watch &watch, uint32_t index, WatchedFunction &fun)
+{
+    fun.calls.clear();
+    string_view text = function_text(watch.src, fun);
+    bool in_string = false;
+    for (size_t i = fun.name_length; i < text.size(); i++)
     {
-        *compiler.out << "<<";
-        compile_expression(compiler, scope, operand_hint);
+        if (in_string || text[i] == '"')
+        {
+            in_string = in_string ? text[i] != '"' : true;
+            continue;
+        }
+        if (char_class(text[i]) != CharClass::Name || char_class(text[i - 1]) == CharClass::Name)
+            continue;
+
+        size_t end = i;
+        while (end < text.size() && char_class(text[end]) == CharClass::Name)
+            end++;
+        size_t paren = end;
+        while (paren < text.size() && (text[paren] == ' ' || text[paren] == '\t' || text[paren] == '\r'))
+            paren++;
+        if (paren < text.size() && text[paren] == '(')
+        {
+            auto callee = watch.indices.find(string(text.substr(i, end - i)));
+            if (callee != watch.indices.end() && callee->second <= index)
+                fun.calls.push_back(callee->second);
+        }
+        i = end - 1;
     }
+}
 
-    compiler.insert_stmt = false;
+CacheKey function_interface(const Watch &watch, uint32_t index)
+{
+    const WatchedFunction &fun = watch.functions[index];
+    CacheKey key;
+    hash_part(key, string_view((const char *)&fun.text, sizeof(fun.text)));
+    hash_part(key, watch.call_sites[index] == 1 ? "once" : "");
+    for (uint32_t callee : fun.calls)
+        if (callee != index)
+            hash_part(key, string_view((const char *)&watch.functions[callee].interface, sizeof(CacheKey)));
+    return key;
 }
 
-void compile_return_stmt(Compiler &compiler, Scope &scope)
+// Updates the interfaces of the functions from `first` on, given which are already
+// known to have changed, and marks those whose interfaces changed as dirty
+void update_interfaces(Watch &watch, size_t first)
 {
-    eat(compiler, TokenKind::Return, "Expected 'return'");
-    *compiler.out << "return";
-    TinyType return_type = TinyType::None;
-    if (peek_expression(compiler))
+    for (size_t i = first; i < watch.functions.size(); i++)
     {
-        *compiler.out << " ";
-        return_type = compile_expression(compiler, scope, compiler.in_function->function.return_type);
+        WatchedFunction &fun = watch.functions[i];
+        for (size_t j = 0; j < fun.calls.size() && !watch.dirty[i]; j++)
+            watch.dirty[i] = fun.calls[j] != i && watch.dirty[fun.calls[j]];
+        if (!watch.dirty[i])
+            continue;
+
+        CacheKey interface = function_interface(watch, (uint32_t)i);
+        watch.dirty[i] = !same_key(interface, fun.interface);
+        fun.interface = interface;
     }
+}
 
-    if (compiler.in_function->function.return_type == TinyType::Unspecified)
-        compiler.in_function->function.return_type = return_type;
-    else if (compiler.in_function->function.return_type != return_type)
-        error(compiler, "Incorrect return type");
+// The function and everything it calls, directly or not, in program order
+void function_slice(Watch &watch, uint32_t index, vector<uint32_t> &slice)
+{
+    watch.mark++;
+    slice.assign(1, index);
+    watch.marks[index] = watch.mark;
+    for (size_t next = 0; next < slice.size(); next++)
+    {
+        for (uint32_t callee : watch.functions[slice[next]].calls)
+        {
+            if (watch.marks[callee] != watch.mark)
+            {
+                watch.marks[callee] = watch.mark;
+                slice.push_back(callee);
+            }
+        }
+    }
+    std::sort(slice.begin(), slice.end());
 }
 
-void compile_statement(Compiler &compiler, Scope &scope, bool semi_colon = true)
+// Checks that a program was split into the same functions its syntax tree has, each
+// emitted as a piece of its own
+bool matches_split(const Compiler &compiler, const Emitter &program, const vector<size_t> &starts)
 {
-    skip_lines(compiler);
+    const Ast &ast = compiler.ast;
+    if (ast.nodes[ast.root].count != starts.size() || program.pieces.size() != starts.size())
+        return false;
+    for (size_t i = 0; i < starts.size(); i++)
+        if (compiler.lexer->tokens.offsets[ast.nodes[child(ast, ast.root, i)].token] != starts[i])
+            return false;
+    return true;
+}
 
-    stringstream *parent_stream = compiler.out;
-    stringstream statement;
-    compiler.out = &statement;
+// Compiles a function again, in a program made of it and everything it calls, with the
+// call counts in `call_sites`. Returns false if that program does not compile or does
+// not split up as the source did.
+bool recompile_function(Watch &watch, uint32_t index, vector<uint32_t> &slice, vector<uint32_t> &call_sites)
+{
+    function_slice(watch, index, slice);
 
-    if (peek_assign_stmt(compiler))
-        compile_assign_stmt(compiler, scope);
-    else if (peek_ltr_insert_stmt(compiler))
-        compile_ltr_insert_stmt(compiler, scope);
-    else if (peek_rtl_insert_stmt(compiler))
-        compile_rtl_insert_stmt(compiler, scope);
-    else if (peek_return_stmt(compiler))
-        compile_return_stmt(compiler, scope);
-    else
-        compile_expression(compiler, scope);
+    string src;
+    vector<size_t> starts;
+    call_sites.clear();
+    for (uint32_t i : slice)
+    {
+        starts.push_back(src.size());
+        src += function_text(watch.src, watch.functions[i]);
+        if (src.back() != '\n')
+            src += '\n';
+        call_sites.push_back(watch.call_sites[i]);
+    }
 
-    eat(compiler, TokenKind::Line, "Expected newline to terminate statement");
+    // Errors are left for the compile of the whole program to report, at the right lines
+    Lexer lexer(&src, &watch.interner);
+    lexer.diagnostics.echo = nullptr;
+    while (!lexer.finished)
+        next_token(lexer);
+    Compiler compiler(&lexer);
+    configure(compiler, watch.options);
+    compiler.threads = 1;
+    compiler.call_sites = &call_sites;
+    Emitter program;
+    compile_program(compiler, program);
+    if (has_errors(compiler) || !matches_split(compiler, program, starts))
+        return false;
 
-    compiler.out = parent_stream;
-    if (statement.rdbuf()->in_avail())
-        *compiler.out << statement.rdbuf() << (semi_colon ? ";" : " ");
+    WatchedFunction &fun = watch.functions[index];
+    const EmitterPiece &piece = program.pieces.back();
+    fun.code.assign(piece.buffer->data() + piece.offset, piece.length);
+    fun.headers = compiler.function_headers.back();
+    fun.counted.clear();
+    if (!compiler.function_calls.empty())
+        for (uint32_t callee : compiler.function_calls.back())
+            fun.counted.push_back(slice[callee]);
+    return true;
 }
 
-void compile_statement_block(Compiler &compiler, Scope &scope)
+// Compiles the whole program, writing its C++ to `out_path`, and splits it up into
+// functions again. Errors are reported as usual.
+bool rebuild_all(Watch &watch, const string &out_path)
 {
-    eat(compiler, TokenKind::CurlyL, "Expected '{' to open block.");
-    *compiler.out << '{';
+    watch.split = false;
+    Lexer lexer(&watch.src, &watch.interner);
+    while (!lexer.finished)
+        next_token(lexer);
+    Compiler compiler(&lexer);
+    configure(compiler, watch.options);
+    Emitter program;
+    compile_program(compiler, program);
+    if (has_errors(compiler))
+        return false;
+    write_program(compiler, program, out_path);
+    if (has_errors(compiler))
+        return false;
+    watch.prelude = program_prelude(compiler.runtime_headers);
+
+    // A source that does not split up where the parser found its functions is still
+    // compiled, but only ever as a whole
+    vector<WatchedFunction> &functions = watch.functions;
+    functions.clear();
+    vector<size_t> starts;
+    bool split = split_functions(watch.src, 0, watch.src.size(), watch.head, functions);
+    for (const WatchedFunction &fun : functions)
+        starts.push_back(fun.start);
+    if (!split || !matches_split(compiler, program, starts))
+        return true;
+
+    size_t count = functions.size();
+    watch.indices.clear();
+    for (uint32_t i = 0; i < count; i++)
+        watch.indices[string(function_name(watch.src, functions[i]))] = i;
+    watch.call_sites.assign(count, 0);
+    size_t offset = watch.prelude.size();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        WatchedFunction &fun = functions[i];
+        const EmitterPiece &piece = program.pieces[i];
+        fun.code.assign(piece.buffer->data() + piece.offset, piece.length);
+        fun.offset = offset;
+        offset += piece.length;
+        fun.headers = compiler.function_headers[i];
+        fun.text = CacheKey();
+        hash_part(fun.text, function_text(watch.src, fun));
+        find_calls(watch, i, fun);
+        fun.counted.clear();
+        if (!compiler.function_calls.empty())
+            fun.counted = std::move(compiler.function_calls[i]);
+        for (uint32_t callee : fun.counted)
+            watch.call_sites[callee]++;
+    }
 
-    skip_lines(compiler);
+    watch.dirty.assign(count, 1);
+    watch.marks.assign(count, 0);
+    update_interfaces(watch, 0);
+    watch.dirty.assign(count, 0);
+    watch.split = true;
+    watch.written = true;
+    return true;
+}
 
-    Scope block_scope = Scope(&scope);
+size_t common_prefix(string_view a, string_view b)
+{
+    constexpr size_t block = 4096;
+    size_t length = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i + block <= length && memcmp(a.data() + i, b.data() + i, block) == 0)
+        i += block;
+    while (i < length && a[i] == b[i])
+        i++;
+    return i;
+}
 
-    stringstream *parent_stream = compiler.out;
-    stringstream block_body;
-    stringstream block_declarations;
-    compiler.out = &block_body;
+size_t common_suffix(string_view a, string_view b, size_t limit)
+{
+    constexpr size_t block = 4096;
+    size_t i = 0;
+    while (i + block <= limit && memcmp(a.data() + a.size() - i - block, b.data() + b.size() - i - block, block) == 0)
+        i += block;
+    while (i < limit && a[a.size() - i - 1] == b[b.size() - i - 1])
+        i++;
+    return i;
+}
 
-    while (peek_statement(compiler))
-        compile_statement(compiler, block_scope);
+// Brings the functions up to date with the edited source in watch.src, compiling as few
+// of them as it can, and sets `first_compiled` to the first one compiled. Returns false
+// if the whole program has to be compiled instead.
+bool rebuild_changed(Watch &watch, const string &old, size_t &recompiled, size_t &first_compiled)
+{
+    vector<WatchedFunction> &functions = watch.functions;
+    const string &src = watch.src;
+    if (!watch.split || functions.empty())
+        return false;
 
-    if (compiler.in_main)
-        *compiler.out << "return 0;";
+    // The edit lies between the text both versions start with and the text they end with
+    size_t prefix = common_prefix(old, src);
+    size_t suffix = common_suffix(old, src, std::min(old.size(), src.size()) - prefix);
+    size_t old_end = std::max(prefix, old.size() - suffix);
+    if (prefix < watch.head)
+        return false;
 
-    compiler.out = parent_stream;
+    // The functions the edit touches, and the one before when the edit begins where a
+    // function does, as it may have been added to the end of that one
+    auto function_at = [&](size_t offset)
+    {
+        auto after = std::upper_bound(functions.begin(), functions.end(), offset,
+                                      [](size_t offset, const WatchedFunction &fun) { return offset < fun.start; });
+        return (size_t)(after - functions.begin()) - 1;
+    };
+    size_t first = function_at(prefix);
+    if (first > 0 && functions[first].start == prefix)
+        first--;
+    size_t last = function_at(old_end > prefix ? old_end - 1 : prefix);
+
+    // Splits the edited functions up again, as far as the first function the edit left alone
+    ptrdiff_t shift = (ptrdiff_t)src.size() - (ptrdiff_t)old.size();
+    size_t from = functions[first].start;
+    size_t to = last + 1 < functions.size() ? functions[last + 1].start + shift : src.size();
+    vector<WatchedFunction> edited;
+    size_t head;
+    if (!split_functions(src, from, to, head, edited) || head != from || edited.size() != last - first + 1)
+        return false;
+    for (size_t i = first; i <= last; i++)
+        if (function_name(old, functions[i]) != function_name(src, edited[i - first]))
+            return false;
 
-    for (auto &it : block_scope.entities)
+    vector<uint32_t> changed;
+    for (size_t i = first; i <= last; i++)
     {
-        Entity *var = &it.second;
-        if (var->kind != EntityKind::Variable)
+        if (function_text(old, functions[i]) != function_text(src, edited[i - first]))
+            changed.push_back((uint32_t)i);
+        functions[i].start = edited[i - first].start;
+        functions[i].length = edited[i - first].length;
+    }
+    for (size_t i = last + 1; i < functions.size(); i++)
+        functions[i].start += shift;
+
+    // The functions the edited ones call may now be called once where they were not, or
+    // the other way round, which compiling the edited ones finds out
+    vector<vector<uint32_t>> old_counted;
+    vector<vector<uint32_t>> slices(changed.size());
+    vector<vector<uint32_t>> compiled_with(changed.size());
+    vector<std::pair<uint32_t, bool>> once;
+    for (size_t k = 0; k < changed.size(); k++)
+    {
+        WatchedFunction &fun = functions[changed[k]];
+        fun.text = CacheKey();
+        hash_part(fun.text, function_text(src, fun));
+        find_calls(watch, changed[k], fun);
+        old_counted.push_back(std::move(fun.counted));
+        if (!recompile_function(watch, changed[k], slices[k], compiled_with[k]))
+            return false;
+        for (uint32_t callee : old_counted.back())
+            once.push_back({callee, watch.call_sites[callee] == 1});
+        for (uint32_t callee : fun.counted)
+            once.push_back({callee, watch.call_sites[callee] == 1});
+    }
+    size_t start = first;
+    for (size_t k = 0; k < changed.size(); k++)
+    {
+        for (uint32_t callee : old_counted[k])
+            watch.call_sites[callee]--;
+        for (uint32_t callee : functions[changed[k]].counted)
+            watch.call_sites[callee]++;
+        watch.dirty[changed[k]] = 1;
+    }
+    for (auto [callee, was_once] : once)
+    {
+        if ((watch.call_sites[callee] == 1) != was_once)
+        {
+            watch.dirty[callee] = 1;
+            start = std::min<size_t>(start, callee);
+        }
+    }
+
+    update_interfaces(watch, start);
+    vector<uint32_t> dirty;
+    for (size_t i = start; i < functions.size(); i++)
+        if (watch.dirty[i])
+            dirty.push_back((uint32_t)i);
+    std::fill(watch.dirty.begin() + start, watch.dirty.end(), 0);
+
+    // Once the functions to compile again add up to more than the program, it is quicker
+    // to compile the program
+    vector<uint32_t> slice;
+    size_t total = 0;
+    for (uint32_t i : dirty)
+    {
+        function_slice(watch, i, slice);
+        total += slice.size();
+        if (total > functions.size())
+            return false;
+    }
+
+    // An edited function compiled above stands unless the counts it was compiled with changed
+    auto up_to_date = [&](uint32_t index)
+    {
+        size_t k = std::find(changed.begin(), changed.end(), index) - changed.begin();
+        if (k == changed.size())
+            return false;
+        for (size_t j = 0; j < slices[k].size(); j++)
+            if (compiled_with[k][j] != watch.call_sites[slices[k][j]])
+                return false;
+        return true;
+    };
+    bool compiled = true;
+    vector<uint32_t> call_sites;
+    for (size_t k = 0; k < dirty.size() && compiled; k++)
+        if (!up_to_date(dirty[k]))
+            compiled = recompile_function(watch, dirty[k], slice, call_sites);
+
+    recompiled = dirty.size();
+    first_compiled = dirty.empty() ? functions.size() : dirty[0];
+    return compiled;
+}
+
+// Writes the C++ of every function, as a compile of the whole program would. Only the
+// output from the first function compiled again on is written, unless the prelude changed.
+bool write_functions(Watch &watch, const string &out_path, size_t first)
+{
+    vector<WatchedFunction> &functions = watch.functions;
+    uint8_t headers = 0;
+    for (const WatchedFunction &fun : functions)
+        headers |= fun.headers;
+    string prelude = program_prelude(headers);
+    if (!watch.written || prelude != watch.prelude)
+        first = 0;
+    else if (first == functions.size())
+        return true;
+
+    Emitter program;
+    size_t start = first > 0 ? functions[first].offset : 0;
+    size_t offset = first > 0 ? start : prelude.size();
+    for (size_t i = first; i < functions.size(); i++)
+    {
+        functions[i].offset = offset;
+        offset += functions[i].code.size();
+        program.pieces.push_back({&functions[i].code, 0, functions[i].code.size()});
+    }
+    watch.prelude = prelude;
+    watch.written = write_emitter(program, first > 0 ? string_view() : string_view(prelude), out_path, start);
+    return watch.written;
+}
+
+// BATCH //
+
+// `tiny batch` compiles many programs in one process, each to a file of its own. The
+// files are dealt out largest first to one queue per thread. Each thread works through
+// its own queue from the front, and once that is empty steals from the back of the
+// others', so a thread given a few large files does not hold up the rest. Every thread
+// has an interner and an arena of its own, so threads never wait on each other while
+// compiling; the builtin names are interned up front as the same symbols in every
+// interner, and the arena is reset between files rather than freed. Sources are
+// mapped into memory rather than read.
+
+// A source file mapped into memory. The lexer needs a null character after the source,
+// which the zeroed rest of the last page provides. A file that ends exactly on a page
+// boundary has no rest, so it is read into `copy` instead, as are files where mapping
+// is not available.
+struct MappedSource
+{
+    string_view text;
+    string copy;
+    void *mapping = nullptr;
+
+    MappedSource() {}
+    MappedSource(const MappedSource &) = delete;
+    MappedSource &operator=(const MappedSource &) = delete;
+
+    ~MappedSource()
+    {
+#ifdef TINY_POSIX_IO
+        if (mapping != nullptr)
+            munmap(mapping, text.size());
+#endif
+    }
+};
+
+bool map_source(MappedSource &source, const string &path)
+{
+#ifdef TINY_POSIX_IO
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (size_t)info.st_size;
+    if (size % page_size != 0)
+    {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE; // The lexer reads every page, so fault them all in at once
+#endif
+        void *mapping = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            close(fd);
+            source.mapping = mapping;
+            source.text = string_view((const char *)mapping, size);
+            return true;
+        }
+    }
+
+    source.copy.resize(size);
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t got = read(fd, source.copy.data() + done, size - done);
+        if (got < 0 && errno == EINTR)
             continue;
+        if (got <= 0)
+            break;
+        done += (size_t)got;
+    }
+    close(fd);
+    source.copy.resize(done);
+#else
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        return false;
+    source.copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+#endif
+    source.text = source.copy;
+    return true;
+}
+
+struct BatchFile
+{
+    string src_path;
+    string out_path;
+    uintmax_t size = 0;
+    bool loaded = false;
+    vector<Diagnostic> errors;
+};
+
+struct BatchQueue
+{
+    std::mutex mutex;
+    std::deque<size_t> files; // Indices into the batch's files
+};
 
-        if (var->variable.type == TinyType::Unspecified)
-            var->variable.type = TinyType::Value;
+struct BatchWorker
+{
+    Interner interner;
+    Arena arena;
+    size_t stolen = 0; // Files taken from other workers' queues
+};
 
-        *compiler.out
-            << tiny_type_as_c_type(var->variable.type)
-            << " "
-            << var->c_identity
-            << ";";
+// The next file for `worker` to compile, from the front of its own queue or the back
+// of another's. Returns false once every queue is empty, as no work is added later.
+bool next_batch_file(vector<BatchQueue> &queues, size_t worker, BatchWorker &state, size_t &file)
+{
+    {
+        BatchQueue &own = queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.files.empty())
+        {
+            file = own.files.front();
+            own.files.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        BatchQueue &victim = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.files.empty())
+        {
+            file = victim.files.back();
+            victim.files.pop_back();
+            state.stolen++;
+            return true;
+        }
     }
+    return false;
+}
 
-    *compiler.out << block_body.rdbuf();
+void compile_batch_file(BatchWorker &worker, BatchFile &file, const Options &options)
+{
+    MappedSource source;
+    file.loaded = map_source(source, file.src_path);
+    if (!file.loaded)
+        return;
+
+    Lexer lexer(source.text, &worker.interner);
+    lexer.diagnostics.echo = nullptr;
+    while (!lexer.finished)
+        next_token(lexer);
 
-    eat(compiler, TokenKind::CurlyR, "Expected '}' to close block.");
-    *compiler.out << '}';
+    worker.arena.reset();
+    Compiler compiler(&lexer, worker.arena);
+    configure(compiler, options);
+    compiler.threads = 1; // The batch's threads are already busy with other files
+    Emitter program;
+    compile_program(compiler, program);
+    if (!has_errors(compiler))
+        write_program(compiler, program, file.out_path);
+    file.errors = std::move(lexer.diagnostics.errors);
 }
 
-void compile_parameter(Compiler &compiler, Scope &scope)
+// Adds `arg`, a .tiny file or a directory searched for them, to the batch. Outputs go to
+// local/batch, at the path of their source with .cpp in place of .tiny.
+bool add_batch_sources(const string &arg, vector<BatchFile> &files)
 {
-    string id = eat(compiler, TokenKind::Identity, "Expected parameter name.").str;
-    Entity *param = declare(scope, EntityKind::Variable, id);
-    param->variable.type = TinyType::Value;
+    namespace fs = std::filesystem;
+    auto add = [&files](const fs::path &relative, uintmax_t size)
+    {
+        fs::path out = "local/batch";
+        for (const fs::path &part : relative.relative_path())
+            if (part != ".." && part != ".")
+                out /= part;
+        out.replace_extension(".cpp");
+        files.push_back({"../" + relative.generic_string(), out.generic_string(), size, false, {}});
+    };
 
-    if (match(compiler, TokenKind::SquareL))
+    std::error_code failed;
+    fs::path root = fs::path(arg).lexically_normal();
+    if (fs::is_directory("../" / root, failed))
     {
-        eat(compiler, TokenKind::SquareR, "Expected ']'");
-        param->variable.type = TinyType::List;
+        for (fs::recursive_directory_iterator it("../" / root, failed), end; !failed && it != end; it.increment(failed))
+            if (it->path().extension() == ".tiny" && it->is_regular_file(failed))
+                add(root / it->path().lexically_relative("../" / root), it->file_size(failed));
+        return !failed;
     }
 
-    compiler.in_function->function.params->push_back(param);
-    compiler.in_function->function.param_count++;
+    uintmax_t size = fs::file_size("../" / root, failed);
+    if (failed)
+        return false;
+    add(root, size);
+    return true;
+}
+
+// MAIN //
 
-    *compiler.out
-        << tiny_type_as_c_type(param->variable.type)
-        << " "
-        << param->c_identity;
+bool load_source(const string &src_path, string &src)
+{
+    std::ifstream src_file;
+    src_file.open(src_path, std::ios::in);
+    if (!src_file)
+    {
+        cout << "Source file " << src_path << " could not be loaded" << endl;
+        return false;
+    }
+    // Read in one go, as watch mode reads the whole source again after every edit
+    src_file.seekg(0, std::ios::end);
+    src.resize((size_t)src_file.tellg());
+    src_file.seekg(0, std::ios::beg);
+    src_file.read(src.data(), src.size());
+    src_file.close();
+    return true;
 }
 
-void compile_function(Compiler &compiler, Scope &scope)
+// tiny --generate <shape> [scale]
+int generate_main(int argc, char *argv[])
 {
-    stringstream *parent_stream = compiler.out;
-    stringstream function_body;
-    compiler.out = &function_body;
+    const CorpusShapeInfo *info = argc >= 3 ? find_corpus_shape(argv[2]) : nullptr;
+    if (info == nullptr)
+    {
+        cout << "Usage: tiny --generate <shape> [scale]\nShapes:\n";
+        for (const CorpusShapeInfo &shape : corpus_shapes)
+            cout << "  " << shape.name << " - " << shape.description << "\n";
+        return 1;
+    }
 
-    Scope function_scope;
+    size_t scale;
+    if (!count_argument(argc, argv, 3, info->default_scale, scale))
+        return 1;
+    cout << generate_corpus(info->shape, scale);
+    return 0;
+}
 
-    string identity = eat(compiler, TokenKind::Identity, "Expected function name.").str;
-    compiler.in_main = identity == "main";
+// tiny --bench [all | <shape> | <file>] [scale] [runs]
+int bench_main(int argc, char *argv[])
+{
+    string target = argc >= 3 ? argv[2] : "all";
+    size_t runs;
+    if (!count_argument(argc, argv, 4, 5, runs))
+        return 1;
+    if (runs == 0)
+        runs = 1;
+
+    if (target == "all")
+    {
+        for (const CorpusShapeInfo &info : corpus_shapes)
+            benchmark(info.name, generate_corpus(info.shape, info.default_scale), runs);
+        return 0;
+    }
 
-    Entity *fun = declare(scope, EntityKind::Function, identity);
-    fun->function.return_type = TinyType::Unspecified;
-    compiler.in_function = fun;
+    if (const CorpusShapeInfo *info = find_corpus_shape(target))
+    {
+        size_t scale;
+        if (!count_argument(argc, argv, 3, info->default_scale, scale))
+            return 1;
+        benchmark(info->name, generate_corpus(info->shape, scale), runs);
+        return 0;
+    }
 
-    *compiler.out << fun->c_identity << "(";
+    string src;
+    if (!load_source("../" + target, src))
+        return 1;
+    benchmark(target, src, runs);
+    return 0;
+}
 
-    eat(compiler, TokenKind::ParenL, "Expected '(' after function name.");
-    if (peek(compiler) == TokenKind::Identity)
+// tiny --bench-lex [all | <shape> | <file>] [scale] [runs]
+int bench_lex_main(int argc, char *argv[])
+{
+    string target = argc >= 3 ? argv[2] : "all";
+    size_t runs;
+    if (!count_argument(argc, argv, 4, 20, runs))
+        return 1;
+    if (runs == 0)
+        runs = 1;
+
+    if (target == "all")
     {
-        compile_parameter(compiler, function_scope);
-        while (match(compiler, TokenKind::Comma))
-        {
-            *compiler.out << ",";
-            compile_parameter(compiler, function_scope);
-        }
+        bool same = true;
+        for (const CorpusShapeInfo &info : corpus_shapes)
+            same = benchmark_lexer(info.name, generate_corpus(info.shape, info.default_scale), runs) && same;
+        return same ? 0 : 1;
     }
-    eat(compiler, TokenKind::ParenR, "Expected ')' at end of function parameters.");
 
-    *compiler.out << ")";
-    compile_statement_block(compiler, function_scope);
+    if (const CorpusShapeInfo *info = find_corpus_shape(target))
+    {
+        size_t scale;
+        if (!count_argument(argc, argv, 3, info->default_scale, scale))
+            return 1;
+        return benchmark_lexer(info->name, generate_corpus(info->shape, scale), runs) ? 0 : 1;
+    }
 
-    compiler.out = parent_stream;
+    string src;
+    if (!load_source("../" + target, src))
+        return 1;
+    return benchmark_lexer(target, src, runs) ? 0 : 1;
+}
 
-    if (fun->function.return_type == TinyType::Unspecified)
-        fun->function.return_type = TinyType::None;
+// tiny --bench-run [<shape> | <file>] [scale] [runs]
+int bench_run_main(int argc, char *argv[])
+{
+    string target = argc >= 3 ? argv[2] : "calls";
+    size_t runs;
+    if (!count_argument(argc, argv, 4, 5, runs))
+        return 1;
+    if (runs == 0)
+        runs = 1;
+
+    if (const CorpusShapeInfo *info = find_corpus_shape(target))
+    {
+        size_t scale;
+        if (!count_argument(argc, argv, 3, info->default_scale, scale))
+            return 1;
+        benchmark_run(info->name, generate_corpus(info->shape, scale), runs);
+        return 0;
+    }
 
-    // FIXME: Determine what the correct behaviour when generating the main function should actually be.
-    *compiler.out
-        << (compiler.in_main ? "int" : tiny_type_as_c_type(fun->function.return_type))
-        << " "
-        << function_body.rdbuf();
+    string src;
+    if (!load_source("../" + target, src))
+        return 1;
+    benchmark_run(target, src, runs);
+    return 0;
 }
 
-void compile_program(Compiler &compiler)
+// tiny --bench-build [all | <file>] [runs]
+int bench_build_main(int argc, char *argv[])
 {
-    stringstream program;
-    compiler.out = &program;
+    string target = argc >= 3 ? argv[2] : "all";
+    size_t runs;
+    if (!count_argument(argc, argv, 3, 3, runs))
+        return 1;
+    if (runs == 0)
+        runs = 1;
+
+    if (!build_runtime_library(true))
+    {
+        cout << "Could not build the runtime library with " << cxx_command() << endl;
+        return 1;
+    }
 
-    Scope program_scope;
+    vector<string> targets;
+    if (target == "all")
+    {
+        for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator("../samples"))
+            if (entry.path().extension() == ".tiny")
+                targets.push_back("samples/" + entry.path().filename().string());
+        std::sort(targets.begin(), targets.end());
+    }
+    else
+    {
+        targets.push_back(target);
+    }
 
-    skip_lines(compiler);
-    while (peek(compiler) == TokenKind::Identity)
+    for (const string &file : targets)
     {
-        compile_function(compiler, program_scope);
-        skip_lines(compiler);
+        string src;
+        if (!load_source("../" + file, src))
+            return 1;
+        benchmark_build(file, src, runs);
     }
-    eat(compiler, TokenKind::EndOfFile, "Expected end of file");
+    return 0;
+}
+
+// tiny --bench-kernels [count] [runs]
+int bench_kernels_main(int argc, char *argv[])
+{
+    size_t count, runs;
+    if (!count_argument(argc, argv, 2, 1 << 20, count) || !count_argument(argc, argv, 3, 100, runs))
+        return 1;
+    return benchmark_kernels(count, runs == 0 ? 1 : runs) ? 0 : 1;
+}
+
+// tiny build <file> [options]
+int build_main(int argc, char *argv[])
+{
+    Options options;
+    int exit_code = 1;
+    if (!parse_options(argc, argv, 2, options, exit_code))
+        return exit_code;
+
+    string src;
+    if (!load_source(options.src_path, src))
+        return 1;
+
+    string path;
+    bool hit;
+    if (!cached_executable(src, options, path, hit))
+        return 1;
+    cout << path << endl;
+    return 0;
+}
 
-    string out_path = "local/output.cpp";
-    std::ofstream out_file;
-    out_file.open(out_path, std::ios::out);
-    if (!out_file)
+// tiny run <file> [options] builds the program like tiny build, then runs it in place of the compiler
+int run_main(int argc, char *argv[])
+{
+    Options options;
+    int exit_code = 1;
+    if (!parse_options(argc, argv, 2, options, exit_code))
+        return exit_code;
+
+    string src;
+    if (!load_source(options.src_path, src))
+        return 1;
+
+    string path;
+    bool hit;
+    if (!cached_executable(src, options, path, hit))
+        return 1;
+
+    cout.flush();
+#ifdef TINY_POSIX_IO
+    char *program_argv[] = {(char *)path.c_str(), nullptr};
+    execv(path.c_str(), program_argv);
+
+    // Another build can evict the executable between finding it and running it, which
+    // is then a miss like any other, so it is built again
+    if (errno == ENOENT && hit && cached_executable(src, options, path, hit))
     {
-        error(compiler, "Output file " + out_path + " could not be loaded");
-        return;
+        cout.flush();
+        program_argv[0] = (char *)path.c_str();
+        execv(path.c_str(), program_argv);
     }
-    out_file
-        << "#include <iostream>\n"
-        << "#include <vector>\n"
-        << "using value = int;\n"
-        << "using list = std::vector<int>;\n"
-        << program.rdbuf();
-    out_file.close();
+    cout << "Could not run " << path << endl;
+    return 1;
+#else
+    return std::system(path.c_str());
+#endif
 }
 
-// MAIN //
+// tiny watch <file> [options] writes the C++ for a program, then again every time it changes
+int watch_main(int argc, char *argv[])
+{
+    Watch watch;
+    int exit_code = 1;
+    if (!parse_options(argc, argv, 2, watch.options, exit_code))
+        return exit_code;
+    if (watch.options.run)
+    {
+        cout << "tiny watch only writes C++, so cannot --run" << endl;
+        return 1;
+    }
 
-int main(int argc, char *argv[])
+    const string &src_path = watch.options.src_path;
+    const string out_path = "local/output.cpp";
+    std::filesystem::file_time_type modified;
+    uintmax_t size = 0;
+    bool first = true;
+    for (;;)
+    {
+        std::error_code failed;
+        std::filesystem::file_time_type now_modified = std::filesystem::last_write_time(src_path, failed);
+        uintmax_t now_size = std::filesystem::file_size(src_path, failed);
+        if (!first && (failed || (now_modified == modified && now_size == size)))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(watch_poll_ms));
+            continue;
+        }
+        modified = now_modified;
+        size = now_size;
+
+        auto start = std::chrono::steady_clock::now();
+        string src;
+        if (!load_source(src_path, src))
+        {
+            if (first)
+                return 1;
+            continue;
+        }
+        if (!first && src == watch.src)
+            continue;
+
+        string old = std::move(watch.src);
+        watch.src = std::move(src);
+        size_t recompiled = 0, first_compiled = 0;
+        bool incremental = !first && rebuild_changed(watch, old, recompiled, first_compiled);
+        if (incremental)
+            incremental = write_functions(watch, out_path, first_compiled);
+        if (incremental)
+        {
+            cout << "Recompiled " << recompiled << " of " << watch.functions.size() << " functions in "
+                 << std::fixed << std::setprecision(2) << seconds_since(start) * 1000 << " ms" << endl;
+        }
+        else if (rebuild_all(watch, out_path))
+        {
+            cout << "Compiled the whole program in "
+                 << std::fixed << std::setprecision(2) << seconds_since(start) * 1000 << " ms" << endl;
+        }
+        first = false;
+    }
+}
+
+// tiny batch <file or directory>... [options] compiles every program given, on one thread per
+// core (or --jobs=N)
+int batch_main(int argc, char *argv[])
 {
-    string src_path = (argc == 2) ? ("../" + (string)argv[1]) : "../samples/compiler-test.tiny";
+    Options options;
+    options.jobs = std::max(1u, std::thread::hardware_concurrency());
+    vector<char *> option_args;
+    vector<string> sources;
+    for (int i = 2; i < argc; i++)
+    {
+        if (string_view(argv[i]).substr(0, 2) == "--")
+            option_args.push_back(argv[i]);
+        else
+            sources.push_back(argv[i]);
+    }
+    int exit_code = 1;
+    if (!parse_options((int)option_args.size(), option_args.data(), 0, options, exit_code))
+        return exit_code;
+    if (options.run || sources.empty())
+    {
+        cout << "Usage: tiny batch <file or directory>... [options]" << endl;
+        return 1;
+    }
 
-    std::ifstream src_file;
-    src_file.open(src_path, std::ios::in);
-    if (!src_file)
+    auto start = std::chrono::steady_clock::now();
+    vector<BatchFile> files;
+    for (const string &source : sources)
     {
-        cout << "Source file " << src_path << " could not be loaded" << endl;
-        return 0;
+        if (!add_batch_sources(source, files))
+        {
+            cout << "Source " << source << " could not be loaded" << endl;
+            return 1;
+        }
     }
-    std::string src((std::istreambuf_iterator<char>(src_file)), std::istreambuf_iterator<char>());
-    src_file.close();
+    std::sort(files.begin(), files.end(), [](const BatchFile &a, const BatchFile &b)
+              { return a.out_path < b.out_path; });
+    files.erase(std::unique(files.begin(), files.end(), [](const BatchFile &a, const BatchFile &b)
+                            { return a.out_path == b.out_path; }),
+                files.end());
+
+    std::error_code failed;
+    for (const BatchFile &file : files)
+        std::filesystem::create_directories(std::filesystem::path(file.out_path).parent_path(), failed);
+
+    size_t thread_count = std::min(options.jobs, std::max<size_t>(1, files.size()));
+    vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&files](size_t a, size_t b)
+                     { return files[a].size > files[b].size; });
+    vector<BatchQueue> queues(thread_count);
+    for (size_t i = 0; i < order.size(); i++)
+        queues[i % thread_count].files.push_back(order[i]);
+
+    vector<std::unique_ptr<BatchWorker>> workers;
+    for (size_t i = 0; i < thread_count; i++)
+        workers.push_back(std::make_unique<BatchWorker>());
+    auto work = [&](size_t worker)
+    {
+        size_t file;
+        while (next_batch_file(queues, worker, *workers[worker], file))
+            compile_batch_file(*workers[worker], files[file], options);
+    };
+    vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++)
+        threads.emplace_back(work, i);
+    work(0);
+    for (std::thread &thread : threads)
+        thread.join();
+    double seconds = seconds_since(start);
+
+    size_t failures = 0, stolen = 0;
+    uintmax_t bytes = 0;
+    for (const BatchFile &file : files)
+    {
+        bytes += file.size;
+        if (!file.loaded)
+            cout << file.src_path << ": could not be loaded" << endl;
+        for (const Diagnostic &error : file.errors)
+            cout << file.src_path << ": Error on line " << error.line << ": " << error.message << endl;
+        failures += !file.loaded || !file.errors.empty();
+    }
+    for (const std::unique_ptr<BatchWorker> &worker : workers)
+        stolen += worker->stolen;
+
+    double megabytes = bytes / 1e6;
+    cout << "Compiled " << files.size() - failures << " of " << files.size() << " files ("
+         << std::fixed << std::setprecision(2) << megabytes << " MB) in " << seconds * 1000 << " ms on "
+         << thread_count << (thread_count == 1 ? " thread" : " threads") << ", " << stolen << " stolen: "
+         << std::setprecision(0) << files.size() / seconds << " files/s, "
+         << std::setprecision(1) << megabytes / seconds << " MB/s" << endl;
+    return failures > 0 ? 1 : 0;
+}
 
-    Lexer lexer(&src);
-    while (!lexer.finished)
-        next_token(lexer);
+// tiny [--run [--no-jit]] [--memoize] [--verbose] [--jobs[=N]] [--trace-tokens] [--stats[=<file>] | --time-passes[=<file>]] [--disable-pass=<pass>]... [<file>]
+int compiler_main(int argc, char *argv[])
+{
+    if (argc >= 2 && string(argv[1]) == "build")
+        return build_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "run")
+        return run_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "watch")
+        return watch_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "batch")
+        return batch_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--generate")
+        return generate_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--bench")
+        return bench_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--bench-lex")
+        return bench_lex_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--bench-run")
+        return bench_run_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--bench-build")
+        return bench_build_main(argc, argv);
+    if (argc >= 2 && string(argv[1]) == "--bench-kernels")
+        return bench_kernels_main(argc, argv);
+
+    Options options;
+    int exit_code = 0;
+    if (!parse_options(argc, argv, 1, options, exit_code))
+        return exit_code;
+    const string &src_path = options.src_path;
+
+    CompileStats stats;
+    string src;
+    {
+        PhaseTimer timer(stats, "read");
+        if (!load_source(src_path, src))
+            return 0;
+    }
+    stats.source_bytes = src.size();
+
+    Lexer lexer(&src, &global_interner());
+    lexer.trace = options.trace_tokens;
+    {
+        PhaseTimer timer(stats, "lex");
+        while (!lexer.finished)
+            next_token(lexer);
+    }
+    stats.tokens = lexer.tokens.size();
 
     Compiler compiler(&lexer);
-    compile_program(compiler);
+    compiler.stats = stats;
+    configure(compiler, options);
+    Emitter program;
+    if (options.run)
+        compile_bytecode(compiler);
+    else
+        compile_program(compiler, program);
 
-    cout << "FINISH" << endl;
+    if (options.run)
+    {
+        if (has_errors(compiler))
+            return 1;
 
-    return 0;
-}
\ No newline at end of file
+        PhaseTimer timer(compiler.stats, "run");
+        VmOptions vm_options = options.vm_options;
+        vm_options.functions_jitted = &compiler.stats.functions_jitted;
+        exit_code = run_bytecode(compiler.bytecode, vm_options);
+    }
+    else
+    {
+        {
+            PhaseTimer timer(compiler.stats, "write");
+            write_program(compiler, program, "local/output.cpp");
+        }
+
+        cout << "FINISH" << endl;
+    }
+
+    if (options.report_stats)
+    {
+        if (options.stats_path.empty())
+        {
+            write_stats_json(std::cerr, compiler.stats, src_path, !has_errors(compiler));
+        }
+        else
+        {
+            std::ofstream stats_file(options.stats_path);
+            write_stats_json(stats_file, compiler.stats, src_path, !has_errors(compiler));
+        }
+    }
+
+    return exit_code;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    return tinyc::compiler_main(argc, argv);
+}
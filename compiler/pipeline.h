@@ -0,0 +1,863 @@
+#pragma once
+
+// The compiler's data structures, and the parts of its pipeline that the command line
+// drives directly. compiler/tinyc.cpp compiles a program from source to C++ (with the
+// library's API, in tinyc.h), and compiler/main.cpp adds the command line, the bytecode
+// interpreter and everything else built on top of it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#define TINY_POSIX_IO
+#endif
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define TINY_LEXER_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define TINY_LEXER_AVX2
+#include <immintrin.h>
+#endif
+#endif
+using std::cout;
+using std::endl;
+using std::string;
+using std::string_view;
+using std::vector;
+
+#include "../runtime/tiny/list.h"
+#include "tinyc.h"
+
+namespace tinyc
+{
+
+// ERROR HANDLING //
+
+// Each compilation collects its errors in diagnostics of its own, so that compilations
+// on different threads share nothing. Only the first error is kept, as the syntax tree
+// may be incomplete after it. The command line compiler also prints each error as it is
+// found, while the library leaves them for the caller (see LIBRARY).
+
+struct Diagnostics
+{
+    vector<Diagnostic> errors;
+    std::ostream *echo = &cout; // Where errors are printed as they are found, if anywhere
+
+    bool failed() const { return !errors.empty(); }
+};
+
+void report_error(Diagnostics &diagnostics, size_t line, const string &message);
+
+// STATISTICS //
+
+double seconds_since(std::chrono::steady_clock::time_point start);
+
+struct PhaseTime
+{
+    const char *name;
+    double seconds;
+};
+
+struct CompileStats
+{
+    vector<PhaseTime> phases;
+    size_t source_bytes = 0;
+    size_t tokens = 0;
+    size_t scopes = 0;
+    size_t entities = 0;
+    size_t bytes_emitted = 0;
+    size_t calls_shared = 0;     // Calls replaced by common subexpression elimination
+    size_t calls_inlined = 0;    // Calls replaced by the body of the function
+    size_t tail_calls = 0;       // Self tail calls turned into loops
+    size_t functions_jitted = 0; // Functions compiled to machine code while running with --run
+};
+
+// Times a phase of compilation for as long as it is in scope
+struct PhaseTimer
+{
+    CompileStats &stats;
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+
+    PhaseTimer(CompileStats &stats, const char *name) : stats(stats),
+                                                         name(name),
+                                                         start(std::chrono::steady_clock::now()) {}
+
+    ~PhaseTimer()
+    {
+        stats.phases.push_back({name, seconds_since(start)});
+    }
+};
+
+// ARENA //
+
+// A bump allocator for data that lives until the end of a compilation unit. Memory
+// is handed out from large chunks and only released when the arena is destroyed or
+// reset, so nothing allocated from it is ever destructed.
+struct Arena
+{
+    struct Chunk
+    {
+        Chunk *previous;
+        size_t size;
+    };
+
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    Chunk *chunks = nullptr;
+    Chunk *spare = nullptr; // Chunks freed by reset(), handed out again before allocating more
+    char *cursor = nullptr;
+    char *end = nullptr;
+
+    Arena() {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        reset();
+        while (spare != nullptr)
+        {
+            Chunk *previous = spare->previous;
+            ::operator delete(spare);
+            spare = previous;
+        }
+    }
+
+    // Frees everything allocated so far while keeping the chunks, so that one arena can
+    // serve compilation after compilation without going back to the heap
+    void reset()
+    {
+        while (chunks != nullptr)
+        {
+            Chunk *previous = chunks->previous;
+            chunks->previous = spare;
+            spare = chunks;
+            chunks = previous;
+        }
+        cursor = nullptr;
+        end = nullptr;
+    }
+
+    void *allocate(size_t size, size_t align)
+    {
+        uintptr_t aligned = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+        if (cursor == nullptr || aligned + size > (uintptr_t)end)
+        {
+            size_t data_size = std::max(chunk_size, size + align);
+            Chunk *chunk = spare;
+            if (chunk != nullptr && chunk->size >= data_size)
+            {
+                spare = chunk->previous;
+            }
+            else
+            {
+                chunk = (Chunk *)::operator new(sizeof(Chunk) + data_size);
+                chunk->size = data_size;
+            }
+            chunk->previous = chunks;
+            chunks = chunk;
+            cursor = (char *)(chunk + 1);
+            end = cursor + chunk->size;
+            aligned = ((uintptr_t)cursor + align - 1) & ~(uintptr_t)(align - 1);
+        }
+        cursor = (char *)(aligned + size);
+        return (void *)aligned;
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    T *make_array(size_t count)
+    {
+        return (T *)allocate(sizeof(T) * count, alignof(T));
+    }
+};
+
+// INTERNING //
+
+// Identifiers are interned into 32 bit symbols so that names can be compared and
+// hashed as integers. Each lexer is given the interner to use, which may be shared
+// by several compilations, even on different threads: the command line uses one for
+// the whole process, while each library context and batch worker has its own. Each
+// lexer keeps its own cache in front of it, so the lock is only taken the first
+// time a lexer sees a name.
+
+using Symbol = uint32_t;
+
+// Builtin names are interned up front, in this order, so their symbols are known constants
+enum BuiltinSymbol : Symbol
+{
+    symbol_none,
+    symbol_console,
+    symbol_main,
+};
+
+struct NameSlot
+{
+    size_t hash = 0;
+    string_view name;
+    Symbol symbol = symbol_none;
+};
+
+// An open addressing map from names to symbols
+struct NameTable
+{
+    vector<NameSlot> slots;
+    size_t used = 0;
+
+    NameTable() : slots(64) {}
+};
+
+struct Interner
+{
+    std::mutex mutex;
+    Arena arena;
+    NameTable table;
+    vector<string_view> names;
+
+    Interner();
+};
+
+// The command line's interner. Everything else is handed an interner by its caller.
+Interner &global_interner();
+
+// TOKENS //
+
+enum class TokenKind
+{
+    Null,
+
+    Comma,
+    Assign,
+    Line,
+
+    ParenL,
+    ParenR,
+    CurlyL,
+    CurlyR,
+    SquareL,
+    SquareR,
+
+    InsertL,
+    InsertR,
+
+    LessThan,
+    LessThanEqual,
+    GreaterThan,
+    GreaterThanEqual,
+
+    Return,
+
+    String,
+    Identity,
+
+    EndOfFile,
+};
+
+// A token is a lightweight view into the source buffer. It does not own its text,
+// so the source must outlive every token that refers to it.
+struct Token
+{
+    TokenKind kind;
+    string_view str;
+    size_t line;
+    Symbol symbol;
+
+    Token() : kind(TokenKind::Null),
+              str(),
+              line(0),
+              symbol(symbol_none) {}
+
+    Token(TokenKind kind, string_view str, size_t line, Symbol symbol) : kind(kind),
+                                                                         str(str),
+                                                                         line(line),
+                                                                         symbol(symbol) {}
+};
+
+// Tokens are stored as a structure of arrays, with each token's text kept as an
+// offset and length into the source buffer. This keeps the stream compact and
+// means lexing does not allocate per token. Identity tokens also carry their
+// interned symbol. The arrays share one capacity, so pushing a token checks for
+// room once rather than once per array.
+struct TokenStream
+{
+    const char *src = nullptr;
+    std::unique_ptr<TokenKind[]> kinds;
+    std::unique_ptr<uint32_t[]> offsets;
+    std::unique_ptr<uint32_t[]> lengths;
+    std::unique_ptr<uint32_t[]> lines;
+    std::unique_ptr<Symbol[]> symbols;
+    size_t count = 0;
+    size_t capacity = 0;
+
+    size_t size() const { return count; }
+
+    void reserve(size_t amt)
+    {
+        if (amt <= capacity)
+            return;
+        grow(kinds, amt);
+        grow(offsets, amt);
+        grow(lengths, amt);
+        grow(lines, amt);
+        grow(symbols, amt);
+        capacity = amt;
+    }
+
+    void push(TokenKind kind, size_t offset, size_t length, size_t line, Symbol symbol)
+    {
+        if (count == capacity)
+            reserve(capacity * 2 + 64);
+        kinds[count] = kind;
+        offsets[count] = (uint32_t)offset;
+        lengths[count] = (uint32_t)length;
+        lines[count] = (uint32_t)line;
+        symbols[count] = symbol;
+        count++;
+    }
+
+    // Moves the tokens pushed so far into a larger array, leaving the rest uninitialised
+    template <typename T>
+    void grow(std::unique_ptr<T[]> &array, size_t amt)
+    {
+        std::unique_ptr<T[]> grown(new T[amt]);
+        std::copy(array.get(), array.get() + count, grown.get());
+        array = std::move(grown);
+    }
+
+    string_view str(size_t i) const
+    {
+        return string_view(src + offsets[i], lengths[i]);
+    }
+
+    Token at(size_t i) const
+    {
+        return Token(kinds[i], str(i), lines[i], symbols[i]);
+    }
+};
+
+// CHARACTER CLASSES //
+
+enum class CharClass : uint8_t
+{
+    Invalid,
+    End,
+    Blank,
+    Newline,
+    Single,
+    Angle,
+    Quote,
+    Name,
+};
+
+struct CharTables
+{
+    CharClass classes[256] = {};
+    TokenKind single_kinds[256] = {};
+};
+
+constexpr CharTables build_char_tables()
+{
+    CharTables t;
+
+    t.classes[(uint8_t)'\0'] = CharClass::End;
+    t.classes[(uint8_t)' '] = CharClass::Blank;
+    t.classes[(uint8_t)'\t'] = CharClass::Blank;
+    t.classes[(uint8_t)'\n'] = CharClass::Newline;
+    t.classes[(uint8_t)'<'] = CharClass::Angle;
+    t.classes[(uint8_t)'>'] = CharClass::Angle;
+    t.classes[(uint8_t)'"'] = CharClass::Quote;
+
+    for (int c = 'a'; c <= 'z'; c++)
+        t.classes[c] = CharClass::Name;
+    for (int c = 'A'; c <= 'Z'; c++)
+        t.classes[c] = CharClass::Name;
+    t.classes[(uint8_t)'_'] = CharClass::Name;
+
+    const struct
+    {
+        char c;
+        TokenKind kind;
+    } singles[] = {
+        {',', TokenKind::Comma},
+        {'=', TokenKind::Assign},
+        {'(', TokenKind::ParenL},
+        {')', TokenKind::ParenR},
+        {'{', TokenKind::CurlyL},
+        {'}', TokenKind::CurlyR},
+        {'[', TokenKind::SquareL},
+        {']', TokenKind::SquareR},
+    };
+    for (const auto &single : singles)
+    {
+        t.classes[(uint8_t)single.c] = CharClass::Single;
+        t.single_kinds[(uint8_t)single.c] = single.kind;
+    }
+
+    return t;
+}
+
+constexpr CharTables char_tables = build_char_tables();
+
+inline CharClass char_class(const char c)
+{
+    return char_tables.classes[(uint8_t)c];
+}
+
+// LEXER KERNELS //
+
+struct LexerKernels
+{
+    const char *name;
+    size_t (*scan_string)(const char *src, size_t pos, size_t size, size_t &lines);
+};
+
+extern const LexerKernels lexer_kernels_scalar;
+#ifdef TINY_LEXER_SSE2
+extern const LexerKernels lexer_kernels_sse2;
+#endif
+#ifdef TINY_LEXER_AVX2
+extern const LexerKernels lexer_kernels_avx2;
+#endif
+
+const LexerKernels *select_lexer_kernels();
+
+// LEXER //
+
+struct Lexer
+{
+    const char *data;
+    size_t size;
+    const LexerKernels *kernels;
+    TokenStream tokens;
+
+    Interner *interner;
+    NameTable symbol_cache;
+    Diagnostics diagnostics; // Errors found while compiling the source, by the lexer or later
+
+    bool trace = false;
+    bool finished = false;
+    size_t position = 0;
+    size_t line = 0;
+    size_t token_position = 0;
+
+    // The source must be followed by a null character, and outlive the lexer's tokens
+    Lexer(string_view src, Interner *interner) : data(src.data()),
+                                                 size(src.size()),
+                                                 interner(interner)
+    {
+        static const LexerKernels *selected = select_lexer_kernels();
+        kernels = selected;
+
+        tokens.src = data;
+        // Most tokens are a few characters long, so this avoids regrowing the stream for typical sources
+        tokens.reserve(size / 4 + 1);
+    }
+
+    Lexer(const string *src, Interner *interner) : Lexer(string_view(*src), interner) {}
+};
+
+void next_token(Lexer &lexer);
+
+// PROGRAM MODEL //
+
+enum class TinyType : uint8_t
+{
+    Unspecified,
+    Value,
+    List,
+    Console,
+    None,
+};
+
+const char *type_name(TinyType type);
+
+enum class EntityKind
+{
+    Null,
+    Variable,
+    Function,
+};
+
+// Entities are allocated from the compiler's arena and live until the end of the
+// compilation unit, so they must stay trivially destructible. Their names are
+// views into the source buffer.
+struct Entity
+{
+    EntityKind kind = EntityKind::Null;
+    Symbol symbol = symbol_none;
+    string_view identity = "";
+    string_view c_identity = "_ERROR_NULL_ENTITY";
+
+    size_t depth = 0;
+    Entity *shadowed = nullptr;      // The entity with the same name in an enclosing scope, if any
+    Entity *next_in_scope = nullptr; // The next entity declared in the same scope
+
+    union
+    {
+        struct
+        {
+            TinyType type;
+            uint32_t reg;       // Register index when lowered to bytecode
+            uint32_t last_read;      // Statement that last reads the variable, during last use analysis
+            uint32_t known_constant; // Constant the variable holds, during constant evaluation
+        } variable;
+        struct
+        {
+            TinyType return_type;
+            uint32_t node;
+            uint32_t index; // Position in the program
+            bool pure;      // Never touches the console, see analyse_purity
+            Entity **params;
+            size_t param_count;
+            size_t param_capacity;
+        } function;
+    };
+
+    Entity(){};
+
+    Entity(EntityKind kind, Symbol symbol, string_view identity) : kind(kind), symbol(symbol), identity(identity)
+    {
+        if (kind == EntityKind::Variable)
+        {
+            variable.type = TinyType::Unspecified;
+            variable.reg = 0;
+            variable.last_read = 0;
+            variable.known_constant = UINT32_MAX;
+        }
+        else if (kind == EntityKind::Function)
+        {
+            function.return_type = TinyType::Unspecified;
+            function.node = 0;
+            function.index = 0;
+            function.pure = false;
+            function.params = nullptr;
+            function.param_count = 0;
+            function.param_capacity = 0;
+        }
+    }
+};
+
+static_assert(std::is_trivially_destructible<Entity>::value, "Entities are never destroyed by the arena");
+
+// SYMBOL TABLE //
+
+// All scopes share one open addressing hash table, keyed on symbol. Each slot holds
+// the innermost visible entity with that symbol, and the entities it shadows are
+// chained through Entity::shadowed. Resolving a name is a single probe sequence
+// regardless of how deeply scopes are nested. When a scope closes, its entities
+// are unlinked from their slots, revealing the entities they shadowed.
+
+struct SymbolSlot
+{
+    Symbol symbol = symbol_none;
+    Entity *entity = nullptr;
+};
+
+struct SymbolTable
+{
+    Arena *arena;
+    vector<SymbolSlot> slots;
+    size_t used = 0;
+
+    SymbolTable(Arena *arena) : arena(arena), slots(64) {}
+};
+
+SymbolSlot &find_slot(SymbolTable &table, Symbol symbol);
+
+struct Scope
+{
+    SymbolTable *table;
+    Scope *parent = nullptr;
+    size_t depth = 0;
+
+    Entity *first_entity = nullptr;
+    Entity *last_entity = nullptr;
+    size_t entity_count = 0;
+
+    Scope(SymbolTable &table) : table(&table){};
+    Scope(Scope *parent) : table(parent->table), parent(parent), depth(parent->depth + 1){};
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope()
+    {
+        for (Entity *ent = first_entity; ent != nullptr; ent = ent->next_in_scope)
+            find_slot(*table, ent->symbol).entity = ent->shadowed;
+    }
+};
+
+// EMITTER //
+
+// Generated code is appended to one growable buffer. The output is kept as a list
+// of pieces of buffers in program order, and is written out with a single gathering
+// write, so no text is ever copied between buffers. The buffers of other emitters
+// can be spliced in, and are kept alive by the emitter they were spliced into.
+
+struct EmitterPiece
+{
+    const string *buffer;
+    size_t offset;
+    size_t length;
+};
+
+struct Emitter
+{
+    string buffer;
+    vector<EmitterPiece> pieces;
+    size_t run_start = 0;       // Where the text appended since the last piece was closed begins
+    std::deque<string> adopted; // Buffers taken over from spliced emitters, which never move
+};
+
+// Writes the prelude followed by every piece of the emitter, `start` bytes into the file,
+// keeping whatever comes before. Returns false if the file could not be opened.
+bool write_emitter(Emitter &emitter, string_view prelude, const string &path, size_t start = 0);
+
+// SYNTAX TREE //
+
+// The syntax tree is stored as a flat array of fixed size nodes. Nodes refer to
+// their children by index, through a range of the shared `children` array, and
+// to their source by token index. Information added by later passes is kept in
+// arrays parallel to the nodes.
+
+using NodeIndex = uint32_t;
+
+enum class NodeKind : uint8_t
+{
+    Invalid,
+
+    Program,  // Children are functions
+    Function, // Children are parameters, followed by the body block
+    Param,
+    Block, // Children are statements
+
+    AssignStmt,    // Child is the assigned expression, if any
+    LtrInsertStmt, // Children are the operands
+    RtlInsertStmt, // Children are the operands
+    ReturnStmt,    // Child is the returned expression, if any
+    ExprStmt,      // Child is the expression
+
+    Call, // Children are the arguments
+    Identity,
+    String,
+    Constant, // A value known at compile time, `first` is its index in the compiler's constants
+};
+
+enum NodeFlags : uint8_t
+{
+    node_declares = 1 << 0,     // The node is the first use of an implicitly declared variable
+    node_list = 1 << 1,         // The node was marked as a list with `[]`
+    node_move = 1 << 2,         // The variable is read for the last time, so can be moved from
+    node_by_reference = 1 << 3, // The list parameter is only read, so is passed by const reference
+    node_tail_call = 1 << 4,    // The return statement's call to its own function loops instead, as does the function
+};
+
+struct Node
+{
+    NodeKind kind = NodeKind::Invalid;
+    uint8_t flags = 0;
+    TinyType type = TinyType::Unspecified;
+    uint32_t token = 0;
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+static_assert(sizeof(Node) == 16, "Nodes should stay compact");
+
+struct ConstantValue
+{
+    TinyType type = TinyType::None;
+    int value = 0;
+    tiny::list list;
+};
+
+constexpr uint32_t no_constant = UINT32_MAX;
+
+struct Ast
+{
+    vector<Node> nodes;
+    vector<NodeIndex> children;
+
+    // The entity each node refers to. For blocks, this is the first entity declared
+    // in the block, with the rest chained through Entity::next_in_scope.
+    vector<Entity *> bindings;
+
+    NodeIndex root = 0;
+};
+
+NodeIndex child(const Ast &ast, NodeIndex node, size_t i);
+
+// BYTECODE //
+
+// Programs can also be lowered to a compact register based bytecode and run
+// directly by the virtual machine, without going through a C++ compiler. Each
+// function has two register files, one of values and one of lists, and every
+// instruction knows statically which file each of its operands lives in.
+
+enum class Op : uint8_t
+{
+    MoveValue,   // v[a] = v[b]
+    MoveList,    // l[a] = l[b]
+    LoadList,    // l[a] = constants[b]
+    LoadValue,   // v[a] = b
+    Call,        // Call functions[a], storing the result in register b. Followed by one Arg per parameter.
+    ArgValue,    // Pass v[a]
+    ArgList,     // Pass l[a]
+    ReturnValue, // Return v[a]
+    ReturnList,  // Return l[a]
+    Return,
+    PrintValue,  // console << v[a]
+    PrintList,   // console << l[a]
+    ReadValue,   // console >> v[a]
+    ReadList,    // console >> l[a]
+    PushBack,    // l[a] << v[b]
+    PopFront,    // v[a] << l[b]
+    AppendAll,   // l[a] << l[b]
+    PushFront,   // v[a] >> l[b]
+    PopBack,     // l[a] >> v[b]
+    PrependAll,  // l[a] >> l[b]
+    Jump,        // Continue at instruction a of the current function
+    TakeList,    // l[a] = l[b], leaving l[b] empty
+    ClearList,   // l[a] = []
+};
+
+struct Instr
+{
+    Op op;
+    uint32_t a = 0;
+    uint32_t b = 0;
+};
+
+constexpr uint32_t no_register = UINT32_MAX;
+
+struct BytecodeFunction
+{
+    string_view name;
+    vector<Instr> code;
+    uint32_t value_count = 0;
+    uint32_t list_count = 0;
+    vector<TinyType> params; // Parameters are the first registers of their file, in order
+    TinyType return_type = TinyType::None;
+    bool memoized = false; // Results are cached by argument (--memoize)
+};
+
+struct BytecodeProgram
+{
+    vector<BytecodeFunction> functions;
+    vector<tiny::list> constants;
+    uint32_t main = 0;
+};
+
+// COMPILER //
+
+struct Compiler
+{
+    Lexer *lexer;
+    size_t current_token = 0;
+
+    Ast ast;
+    vector<NodeIndex> scratch; // Children of the nodes currently being parsed
+
+    Emitter *out = nullptr;
+
+    Entity *in_function = nullptr;
+
+    BytecodeProgram bytecode;
+
+    vector<ConstantValue> constants;
+    std::unordered_map<string_view, uint32_t> string_constants; // Literal text -> constant index + 1
+
+    CompileStats stats;
+    vector<string> disabled_passes;
+    bool memoize = false; // Cache the results of memoizable functions (--memoize)
+    bool verbose = false; // Report the decisions optimisations make (--verbose)
+    size_t threads = 1;   // Threads emitting C++ (--jobs)
+    uint8_t runtime_headers = 0;      // RuntimeHeader bits for the runtime headers the emitted C++ needs
+    vector<uint8_t> function_headers; // The same for each function on its own
+
+    // Calls to each function in the whole program, when this is only part of it (see WATCH MODE)
+    const vector<uint32_t> *call_sites = nullptr;
+    // The functions each function calls, by index, once for each call the inliner counted
+    vector<vector<uint32_t>> function_calls;
+
+    Arena own_arena;
+    Arena &arena; // own_arena, unless the compiler was given one that outlives it
+    SymbolTable symbols;
+
+    Compiler(Lexer *lexer) : lexer(lexer), arena(own_arena), symbols(&arena) {}
+    Compiler(Lexer *lexer, Arena &arena) : lexer(lexer), arena(arena), symbols(&arena) {}
+};
+
+// Reports an error found by a pass after parsing, at the token the node was parsed from
+void error_at(const Compiler &compiler, NodeIndex node, const string msg);
+
+bool has_errors(const Compiler &compiler);
+
+// CONSTANT EVALUATION //
+
+// The values of a string literal, without its quotes and with its escapes decoded. Constant
+// evaluation, code generation and bytecode lowering all take literals from here, so a
+// literal means the same whichever backend runs it and whether or not it became a constant.
+tiny::list string_literal(const Compiler &compiler, NodeIndex node);
+
+// PURITY ANALYSIS //
+
+// Pure functions that map values to a value can have their results cached with --memoize
+bool memoizable(const Entity *fun);
+
+// TAIL CALLS //
+
+// Whether a tail call's argument is just the parameter it is passed to, which then needs no update
+bool passes_through(const Ast &ast, NodeIndex call, size_t i, const Entity *fun);
+
+// PASS MANAGER //
+
+// Which kind of output a pass contributes to, as a bit set
+enum Target : uint8_t
+{
+    target_cpp = 1,
+    target_bytecode = 2,
+    target_all = target_cpp | target_bytecode,
+};
+
+struct Pass
+{
+    const char *name;
+    void (*run)(Compiler &compiler);
+    bool optional;
+    uint8_t targets;
+    const char *description;
+};
+
+// The passes that take a program to C++, in the order they run. Those for bytecode end
+// with lowering it, which the command line adds (see BYTECODE LOWERING).
+extern const Pass passes[];
+extern const size_t pass_count;
+
+const Pass *find_pass(string_view name);
+
+void compile_program(Compiler &compiler, Emitter &program, Target target = target_cpp);
+
+// The lines every generated file starts with, including the runtime headers it needs
+string program_prelude(uint8_t runtime_headers);
+
+void write_program(Compiler &compiler, Emitter &program, const string &out_path);
+
+}
@@ -0,0 +1,3434 @@
+#include "pipeline.h"
+
+#include <atomic>
+#include <charconv>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#ifdef TINY_POSIX_IO
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace tinyc
+{
+
+// ERROR HANDLING //
+
+void report_error(Diagnostics &diagnostics, size_t line, const string &message)
+{
+    if (diagnostics.failed())
+        return;
+    diagnostics.errors.push_back({line, message});
+    if (diagnostics.echo != nullptr)
+        *diagnostics.echo << "Error on line " << line << ": " << message << endl;
+}
+
+// STATISTICS //
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// INTERNING //
+
+const string_view builtin_symbol_names[] = {"", "console", "main"};
+
+size_t hash_name(string_view name)
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037ull;
+    for (char c : name)
+    {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+NameSlot &find_name_slot(NameTable &table, string_view name, size_t hash)
+{
+    size_t mask = table.slots.size() - 1;
+    size_t i = hash & mask;
+    while (true)
+    {
+        NameSlot &slot = table.slots[i];
+        if (slot.symbol == symbol_none || (slot.hash == hash && slot.name == name))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+void insert_name(NameTable &table, string_view name, size_t hash, Symbol symbol)
+{
+    // Keep the load factor below one half so probe sequences stay short
+    if ((table.used + 1) * 2 > table.slots.size())
+    {
+        vector<NameSlot> old_slots(table.slots.size() * 2);
+        old_slots.swap(table.slots);
+        for (const NameSlot &slot : old_slots)
+            if (slot.symbol != symbol_none)
+                find_name_slot(table, slot.name, slot.hash) = slot;
+    }
+
+    NameSlot &slot = find_name_slot(table, name, hash);
+    if (slot.symbol == symbol_none)
+        table.used++;
+    slot = {hash, name, symbol};
+}
+
+Symbol intern(Interner &interner, string_view name, size_t hash)
+{
+    std::lock_guard<std::mutex> lock(interner.mutex);
+
+    NameSlot &slot = find_name_slot(interner.table, name, hash);
+    if (slot.symbol != symbol_none)
+        return slot.symbol;
+
+    char *chars = interner.arena.make_array<char>(name.length());
+    memcpy(chars, name.data(), name.length());
+    string_view stored(chars, name.length());
+
+    Symbol symbol = (Symbol)interner.names.size();
+    interner.names.push_back(stored);
+    insert_name(interner.table, stored, hash, symbol);
+    return symbol;
+}
+
+Symbol intern(Interner &interner, string_view name)
+{
+    return intern(interner, name, hash_name(name));
+}
+
+string_view symbol_name(Interner &interner, Symbol symbol)
+{
+    std::lock_guard<std::mutex> lock(interner.mutex);
+    return interner.names[symbol];
+}
+
+Interner::Interner()
+{
+    names.push_back(builtin_symbol_names[symbol_none]);
+    for (size_t i = symbol_none + 1; i < std::size(builtin_symbol_names); i++)
+        intern(*this, builtin_symbol_names[i]);
+}
+
+Interner &global_interner()
+{
+    static Interner interner;
+    return interner;
+}
+
+// KEYWORDS //
+
+// Keywords are recognised with a DFA over the characters of an identifier once
+// the whole identifier has been scanned. State 0 is the dead state and state 1
+// is the start state.
+
+struct Keyword
+{
+    string_view word;
+    TokenKind kind;
+};
+
+constexpr Keyword keywords[] = {
+    {"return", TokenKind::Return},
+};
+
+constexpr size_t keyword_dfa_size()
+{
+    size_t states = 2;
+    for (const Keyword &keyword : keywords)
+        states += keyword.word.length();
+    return states;
+}
+
+struct KeywordDfa
+{
+    uint8_t transitions[keyword_dfa_size()][128] = {};
+    TokenKind accepts[keyword_dfa_size()] = {};
+};
+
+constexpr KeywordDfa build_keyword_dfa()
+{
+    KeywordDfa dfa;
+    size_t state_count = 2;
+    for (const Keyword &keyword : keywords)
+    {
+        size_t state = 1;
+        for (char c : keyword.word)
+        {
+            if (dfa.transitions[state][(uint8_t)c] == 0)
+                dfa.transitions[state][(uint8_t)c] = (uint8_t)state_count++;
+            state = dfa.transitions[state][(uint8_t)c];
+        }
+        dfa.accepts[state] = keyword.kind;
+    }
+    return dfa;
+}
+
+constexpr KeywordDfa keyword_dfa = build_keyword_dfa();
+
+TokenKind identity_kind(string_view word)
+{
+    size_t state = 1;
+    for (char c : word)
+    {
+        state = keyword_dfa.transitions[state][(uint8_t)c & 0x7F];
+        if (state == 0)
+            return TokenKind::Identity;
+    }
+    TokenKind kind = keyword_dfa.accepts[state];
+    return kind != TokenKind::Null ? kind : TokenKind::Identity;
+}
+
+// LEXER KERNELS //
+
+// Blanks and names in code are a few characters long, shorter than it takes to load
+// and mask a vector, so they are scanned one character at a time through the
+// character table. String contents are the only runs long enough for SIMD to pay
+// off, so they are scanned by a kernel selected once based on what the CPU supports.
+// Each kernel returns the position of the first character that is not part of the
+// run. The SIMD kernels never read past `size`, and hand the tail of the buffer over
+// to the scalar kernel.
+
+inline size_t skip_blanks(const char *src, size_t pos, size_t size)
+{
+    while (pos < size && char_class(src[pos]) == CharClass::Blank)
+        pos++;
+    return pos;
+}
+
+inline size_t scan_name(const char *src, size_t pos, size_t size)
+{
+    while (pos < size && char_class(src[pos]) == CharClass::Name)
+        pos++;
+    return pos;
+}
+
+// Stops on the closing quote or a null character, counting the new lines passed on the way
+size_t scan_string_scalar(const char *src, size_t pos, size_t size, size_t &lines)
+{
+    while (pos < size && src[pos] != '"' && src[pos] != '\0')
+    {
+        if (src[pos] == '\n')
+            lines++;
+        pos++;
+    }
+    return pos;
+}
+
+#if defined(__GNUC__)
+inline unsigned count_trailing_zeros(uint32_t x) { return __builtin_ctz(x); }
+inline unsigned count_ones(uint32_t x) { return __builtin_popcount(x); }
+#elif defined(_MSC_VER)
+#include <intrin.h>
+inline unsigned count_trailing_zeros(uint32_t x)
+{
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return i;
+}
+inline unsigned count_ones(uint32_t x) { return __popcnt(x); }
+#endif
+
+#ifdef TINY_LEXER_SSE2
+
+size_t scan_string_sse2(const char *src, size_t pos, size_t size, size_t &lines)
+{
+    while (pos + 16 <= size)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + pos));
+        uint32_t stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('"')),
+                                                       _mm_cmpeq_epi8(c, _mm_setzero_si128())));
+        uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')));
+        if (stop)
+        {
+            unsigned i = count_trailing_zeros(stop);
+            lines += count_ones(newlines & ((1u << i) - 1));
+            return pos + i;
+        }
+        lines += count_ones(newlines);
+        pos += 16;
+    }
+    return scan_string_scalar(src, pos, size, lines);
+}
+
+#endif
+
+#ifdef TINY_LEXER_AVX2
+
+__attribute__((target("avx2"))) size_t scan_string_avx2(const char *src, size_t pos, size_t size, size_t &lines)
+{
+    while (pos + 32 <= size)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + pos));
+        uint32_t stop = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('"')),
+                                                                       _mm256_cmpeq_epi8(c, _mm256_setzero_si256())));
+        uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')));
+        if (stop)
+        {
+            unsigned i = count_trailing_zeros(stop);
+            lines += count_ones(newlines & ((1ull << i) - 1));
+            return pos + i;
+        }
+        lines += count_ones(newlines);
+        pos += 32;
+    }
+    return scan_string_sse2(src, pos, size, lines);
+}
+
+#endif
+
+const LexerKernels lexer_kernels_scalar = {"scalar", scan_string_scalar};
+#ifdef TINY_LEXER_SSE2
+const LexerKernels lexer_kernels_sse2 = {"sse2", scan_string_sse2};
+#endif
+#ifdef TINY_LEXER_AVX2
+const LexerKernels lexer_kernels_avx2 = {"avx2", scan_string_avx2};
+#endif
+
+const LexerKernels *select_lexer_kernels()
+{
+#ifdef TINY_LEXER_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return &lexer_kernels_avx2;
+#endif
+#ifdef TINY_LEXER_SSE2
+    return &lexer_kernels_sse2;
+#else
+    return &lexer_kernels_scalar;
+#endif
+}
+
+// LEXER //
+
+void error(Lexer &lexer, const string msg)
+{
+    report_error(lexer.diagnostics, lexer.line, msg);
+}
+
+// The source string is always null terminated, so peeking at the end of the source yields '\0'
+char peek(const Lexer &lexer)
+{
+    return lexer.data[lexer.position];
+}
+
+char next(Lexer &lexer)
+{
+    char c = peek(lexer);
+    lexer.position++;
+    if (c == '\n')
+        lexer.line++;
+    return c;
+}
+
+bool match(Lexer &lexer, const char c)
+{
+    if (peek(lexer) != c)
+        return false;
+    next(lexer);
+    return true;
+}
+
+Symbol intern(Lexer &lexer, string_view name)
+{
+    size_t hash = hash_name(name);
+    NameSlot &slot = find_name_slot(lexer.symbol_cache, name, hash);
+    if (slot.symbol != symbol_none)
+        return slot.symbol;
+
+    Symbol symbol = intern(*lexer.interner, name, hash);
+    insert_name(lexer.symbol_cache, name, hash, symbol);
+    return symbol;
+}
+
+void make_token(Lexer &lexer, const TokenKind kind, Symbol symbol = symbol_none)
+{
+    size_t length = (lexer.position - lexer.token_position);
+    size_t line = kind != TokenKind::Line ? lexer.line : lexer.line - 1;
+    lexer.tokens.push(kind, lexer.token_position, length, line, symbol);
+
+    if (lexer.trace)
+        cout
+            << std::setfill('0') << std::setw(2) << (int)kind << " "
+            << ((kind == TokenKind::Line)
+                    ? "new line"
+                    : lexer.tokens.str(lexer.tokens.size() - 1))
+            << "\n";
+}
+
+void next_token(Lexer &lexer)
+{
+    if (lexer.finished)
+        return;
+
+    lexer.position = skip_blanks(lexer.data, lexer.position, lexer.size);
+    lexer.token_position = lexer.position;
+
+    char c = peek(lexer);
+    switch (char_class(c))
+    {
+    case CharClass::End:
+        make_token(lexer, TokenKind::EndOfFile);
+        lexer.finished = true;
+        return;
+
+    case CharClass::Newline:
+        next(lexer);
+        make_token(lexer, TokenKind::Line);
+        return;
+
+    case CharClass::Single:
+        lexer.position++;
+        make_token(lexer, char_tables.single_kinds[(uint8_t)c]);
+        return;
+
+    case CharClass::Angle:
+    {
+        lexer.position++;
+        bool left = c == '<';
+        if (match(lexer, c))
+            make_token(lexer, left ? TokenKind::InsertL : TokenKind::InsertR);
+        else if (match(lexer, '='))
+            make_token(lexer, left ? TokenKind::LessThanEqual : TokenKind::GreaterThanEqual);
+        else
+            make_token(lexer, left ? TokenKind::LessThan : TokenKind::GreaterThan);
+        return;
+    }
+
+    case CharClass::Quote:
+    {
+        size_t lines = 0;
+        lexer.position = lexer.kernels->scan_string(lexer.data, lexer.position + 1, lexer.size, lines);
+        lexer.line += lines;
+        if (!match(lexer, '"'))
+            error(lexer, "Unterminated string at end of file");
+        make_token(lexer, TokenKind::String);
+        return;
+    }
+
+    case CharClass::Name:
+    {
+        lexer.position = scan_name(lexer.data, lexer.position + 1, lexer.size);
+        string_view word(lexer.data + lexer.token_position, lexer.position - lexer.token_position);
+        TokenKind kind = identity_kind(word);
+        make_token(lexer, kind, kind == TokenKind::Identity ? intern(lexer, word) : symbol_none);
+        return;
+    }
+
+    default:
+        next(lexer);
+        error(lexer, "Unable to parse character '" + string(1, c) + "'");
+        return;
+    }
+}
+
+// PROGRAM MODEL //
+
+string tiny_type_as_c_type(TinyType type)
+{
+    switch (type)
+    {
+    case TinyType::Unspecified:
+        return "_ERROR_UNSPECIFIED_TYPE";
+    case TinyType::Value:
+        return "value";
+    case TinyType::List:
+        return "list";
+    case TinyType::Console:
+        return "_ERROR_CONSOLE_TYPE";
+    case TinyType::None:
+        return "void";
+    }
+    return "_ERROR_TINY_TYPE_AS_C_TYPE";
+}
+
+const char *type_name(TinyType type)
+{
+    switch (type)
+    {
+    case TinyType::Value:
+        return "a value";
+    case TinyType::List:
+        return "a list";
+    case TinyType::Console:
+        return "the console";
+    case TinyType::None:
+        return "nothing";
+    default:
+        return "an unknown type";
+    }
+}
+
+void add_param(Arena &arena, Entity *funct, Entity *param)
+{
+    if (funct->function.param_count == funct->function.param_capacity)
+    {
+        size_t capacity = std::max<size_t>(4, funct->function.param_capacity * 2);
+        Entity **params = arena.make_array<Entity *>(capacity);
+        std::copy(funct->function.params, funct->function.params + funct->function.param_count, params);
+        funct->function.params = params;
+        funct->function.param_capacity = capacity;
+    }
+    funct->function.params[funct->function.param_count++] = param;
+}
+
+// SYMBOL TABLE //
+
+SymbolSlot &find_slot(SymbolTable &table, Symbol symbol)
+{
+    size_t mask = table.slots.size() - 1;
+    size_t i = (symbol * 0x9E3779B1u) & mask;
+    while (true)
+    {
+        SymbolSlot &slot = table.slots[i];
+        if (slot.symbol == symbol || slot.symbol == symbol_none)
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+SymbolSlot &bind_slot(SymbolTable &table, Symbol symbol)
+{
+    // Keep the load factor below one half so probe sequences stay short
+    if ((table.used + 1) * 2 > table.slots.size())
+    {
+        vector<SymbolSlot> old_slots(table.slots.size() * 2);
+        old_slots.swap(table.slots);
+        for (const SymbolSlot &slot : old_slots)
+            if (slot.symbol != symbol_none)
+                find_slot(table, slot.symbol) = slot;
+    }
+
+    SymbolSlot &slot = find_slot(table, symbol);
+    if (slot.symbol == symbol_none)
+    {
+        slot.symbol = symbol;
+        table.used++;
+    }
+    return slot;
+}
+
+Entity *lookup(SymbolTable &table, Symbol symbol)
+{
+    return find_slot(table, symbol).entity;
+}
+
+Entity *fetch(Scope *scope, Symbol symbol)
+{
+    if (symbol == symbol_none)
+        return nullptr;
+    return lookup(*scope->table, symbol);
+}
+
+// After a syntax error the name may not be an identity. An entity is still
+// created so that compilation can continue, but it is not bound to any name.
+Entity *declare(Scope &scope, EntityKind kind, const Token &name)
+{
+    string_view id = name.str;
+    Arena &arena = *scope.table->arena;
+
+    if (name.symbol == symbol_none)
+        return arena.make<Entity>(kind, symbol_none, id);
+
+    SymbolSlot &slot = bind_slot(*scope.table, name.symbol);
+    if (slot.entity != nullptr && slot.entity->depth == scope.depth)
+        return slot.entity;
+
+    Entity *ent = arena.make<Entity>(kind, name.symbol, id);
+    ent->depth = scope.depth;
+    ent->shadowed = slot.entity;
+    slot.entity = ent;
+
+    if (scope.last_entity != nullptr)
+        scope.last_entity->next_in_scope = ent;
+    else
+        scope.first_entity = ent;
+    scope.last_entity = ent;
+    scope.entity_count++;
+
+    // FIXME: Find a proper policy for generating the C++ identifiers that won't clash
+    if (name.symbol == symbol_main)
+    {
+        ent->c_identity = ent->identity;
+    }
+    else
+    {
+        char *c_identity = arena.make_array<char>(id.length() + 1);
+        memcpy(c_identity, id.data(), id.length());
+        c_identity[id.length()] = '_';
+        ent->c_identity = string_view(c_identity, id.length() + 1);
+    }
+
+    return ent;
+}
+
+// EMITTER //
+
+void close_run(Emitter &emitter)
+{
+    if (emitter.buffer.size() > emitter.run_start)
+        emitter.pieces.push_back({&emitter.buffer, emitter.run_start, emitter.buffer.size() - emitter.run_start});
+    emitter.run_start = emitter.buffer.size();
+}
+
+// Closes the final run, after which the pieces describe the whole output
+size_t finish(Emitter &emitter)
+{
+    close_run(emitter);
+    size_t length = 0;
+    for (const EmitterPiece &piece : emitter.pieces)
+        length += piece.length;
+    return length;
+}
+
+// Adds everything emitted into `from` so far to the end of `emitter`, taking over its buffers
+void splice(Emitter &emitter, Emitter &from)
+{
+    close_run(emitter);
+    close_run(from);
+
+    emitter.adopted.push_back(std::move(from.buffer));
+    for (string &buffer : from.adopted)
+        emitter.adopted.push_back(std::move(buffer));
+
+    // The pieces keep pointing at the same text, which now lives in this emitter's adopted buffers
+    const string *adopted = &emitter.adopted[emitter.adopted.size() - from.adopted.size() - 1];
+    for (EmitterPiece piece : from.pieces)
+    {
+        if (piece.buffer == &from.buffer)
+            piece.buffer = adopted;
+        else
+            for (size_t i = 0; i < from.adopted.size(); i++)
+                if (piece.buffer == &from.adopted[i])
+                    piece.buffer = &emitter.adopted[emitter.adopted.size() - from.adopted.size() + i];
+        emitter.pieces.push_back(piece);
+    }
+
+    from.buffer.clear();
+    from.pieces.clear();
+    from.adopted.clear();
+    from.run_start = 0;
+}
+
+Emitter &operator<<(Emitter &emitter, string_view str)
+{
+    emitter.buffer.append(str.data(), str.length());
+    return emitter;
+}
+
+Emitter &operator<<(Emitter &emitter, const char *str)
+{
+    return emitter << string_view(str);
+}
+
+Emitter &operator<<(Emitter &emitter, const string &str)
+{
+    return emitter << string_view(str);
+}
+
+Emitter &operator<<(Emitter &emitter, char c)
+{
+    emitter.buffer.push_back(c);
+    return emitter;
+}
+
+Emitter &operator<<(Emitter &emitter, int n)
+{
+    char digits[16];
+    char *end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    emitter.buffer.append(digits, end - digits);
+    return emitter;
+}
+
+bool write_emitter(Emitter &emitter, string_view prelude, const string &path, size_t start)
+{
+#ifdef TINY_POSIX_IO
+    // An existing file is written over and then cut to length, rather than truncated
+    // first, as ext4 flushes a file truncated to nothing to disk when it is closed
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    if (lseek(fd, (off_t)start, SEEK_SET) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    vector<iovec> iovecs;
+    iovecs.reserve(emitter.pieces.size() + 1);
+    iovecs.push_back({(void *)prelude.data(), prelude.length()});
+    off_t length = (off_t)(start + prelude.length());
+    for (const EmitterPiece &piece : emitter.pieces)
+    {
+        if (piece.length > 0)
+            iovecs.push_back({(void *)(piece.buffer->data() + piece.offset), piece.length});
+        length += piece.length;
+    }
+
+    bool ok = true;
+    size_t next = 0;
+    while (ok && next < iovecs.size())
+    {
+        int count = (int)std::min<size_t>(iovecs.size() - next, IOV_MAX);
+        ssize_t written = writev(fd, &iovecs[next], count);
+        if (written < 0)
+        {
+            ok = errno == EINTR;
+            continue;
+        }
+
+        // Skip past whatever was written, which may end part way through an iovec
+        while (next < iovecs.size() && (size_t)written >= iovecs[next].iov_len)
+            written -= iovecs[next++].iov_len;
+        if (written > 0)
+        {
+            iovecs[next].iov_base = (char *)iovecs[next].iov_base + written;
+            iovecs[next].iov_len -= written;
+        }
+    }
+
+    ok = ok && ftruncate(fd, length) == 0;
+    close(fd);
+    return ok;
+#else
+    std::fstream out_file(path, std::ios::out | std::ios::binary | (start > 0 ? std::ios::in : std::ios::trunc));
+    if (!out_file)
+        return false;
+    size_t length = start + prelude.length();
+    out_file.seekp(start);
+    out_file.write(prelude.data(), prelude.length());
+    for (const EmitterPiece &piece : emitter.pieces)
+    {
+        out_file.write(piece.buffer->data() + piece.offset, piece.length);
+        length += piece.length;
+    }
+    out_file.close();
+    std::error_code failed;
+    std::filesystem::resize_file(path, length, failed);
+    return !out_file.fail() && !failed;
+#endif
+}
+
+// SYNTAX TREE //
+
+NodeIndex child(const Ast &ast, NodeIndex node, size_t i)
+{
+    return ast.children[ast.nodes[node].first + i];
+}
+
+// COMPILER //
+
+void record_scope(Compiler &compiler, const Scope &scope)
+{
+    compiler.stats.scopes++;
+    compiler.stats.entities += scope.entity_count;
+}
+
+Token current_token(const Compiler &compiler)
+{
+    size_t i = std::min(compiler.current_token, compiler.lexer->tokens.size() - 1);
+    return compiler.lexer->tokens.at(i);
+}
+
+TokenKind peek(const Compiler &compiler)
+{
+    const TokenStream &tokens = compiler.lexer->tokens;
+    return tokens.kinds[std::min(compiler.current_token, tokens.size() - 1)];
+}
+
+TokenKind peek_ahead(const Compiler &compiler, size_t amt)
+{
+    const TokenStream &tokens = compiler.lexer->tokens;
+    return tokens.kinds[std::min(compiler.current_token + amt, tokens.size() - 1)];
+}
+
+void error(const Compiler &compiler, const string msg)
+{
+    Token current = current_token(compiler);
+    if (current.kind == TokenKind::Line)
+    {
+        report_error(compiler.lexer->diagnostics, current.line, msg + " (got new line)");
+        return;
+    }
+    char kind[16];
+    snprintf(kind, sizeof(kind), "%02d", (int)current.kind);
+    report_error(compiler.lexer->diagnostics, current.line, msg + " (got " + kind + " " + string(current.str) + ")");
+}
+
+void error_at(const Compiler &compiler, NodeIndex node, const string msg)
+{
+    Token token = compiler.lexer->tokens.at(compiler.ast.nodes[node].token);
+    report_error(compiler.lexer->diagnostics, token.line, msg);
+}
+
+bool has_errors(const Compiler &compiler)
+{
+    return compiler.lexer->diagnostics.failed();
+}
+
+Token node_token(const Compiler &compiler, NodeIndex node)
+{
+    return compiler.lexer->tokens.at(compiler.ast.nodes[node].token);
+}
+
+bool match(Compiler &compiler, TokenKind kind)
+{
+    if (peek(compiler) != kind)
+        return false;
+    next_token(*compiler.lexer);
+    compiler.current_token++;
+    return true;
+}
+
+void skip_lines(Compiler &compiler)
+{
+    while (match(compiler, TokenKind::Line))
+        ;
+}
+
+// Returns the index of the token that was expected
+uint32_t eat(Compiler &compiler, TokenKind kind, const char *msg)
+{
+    if (kind != TokenKind::Line)
+    {
+        skip_lines(compiler);
+    }
+
+    size_t t = std::min(compiler.current_token, compiler.lexer->tokens.size() - 1);
+    if (!match(compiler, kind))
+        error(compiler, msg);
+    return (uint32_t)t;
+}
+
+bool peek_call(const Compiler &compiler)
+{
+    return peek(compiler) == TokenKind::Identity && peek_ahead(compiler, 1) == TokenKind::ParenL;
+}
+
+bool peek_expression(const Compiler &compiler)
+{
+    return peek_call(compiler) ||
+           peek(compiler) == TokenKind::String ||
+           peek(compiler) == TokenKind::Identity;
+}
+
+bool peek_token_in_statement(const Compiler &compiler, TokenKind kind)
+{
+    TokenKind t;
+    size_t i = 0;
+    do
+    {
+        t = peek_ahead(compiler, i);
+        if (t == TokenKind::Line || t == TokenKind::EndOfFile)
+            return false;
+        i++;
+    } while (t != kind);
+    return true;
+}
+
+bool peek_assign_stmt(const Compiler &compiler)
+{
+    return peek(compiler) == TokenKind::Identity && (peek_ahead(compiler, 1) == TokenKind::SquareL ||
+                                                     peek_ahead(compiler, 1) == TokenKind::Assign);
+}
+
+bool peek_ltr_insert_stmt(const Compiler &compiler)
+{
+    return peek_token_in_statement(compiler, TokenKind::InsertR);
+}
+
+bool peek_rtl_insert_stmt(const Compiler &compiler)
+{
+    return peek_token_in_statement(compiler, TokenKind::InsertL);
+}
+
+bool peek_return_stmt(const Compiler &compiler)
+{
+    return peek(compiler) == TokenKind::Return;
+}
+
+bool peek_statement(const Compiler &compiler)
+{
+    return peek_expression(compiler) ||
+           peek_return_stmt(compiler);
+}
+
+// PARSER //
+
+NodeIndex add_node(Compiler &compiler, NodeKind kind, uint32_t token)
+{
+    Node node;
+    node.kind = kind;
+    node.token = token;
+    compiler.ast.nodes.push_back(node);
+    compiler.ast.bindings.push_back(nullptr);
+    return (NodeIndex)(compiler.ast.nodes.size() - 1);
+}
+
+// Moves the children parsed since `base` was taken from the scratch stack onto the node
+void set_children(Compiler &compiler, NodeIndex node, size_t base)
+{
+    Ast &ast = compiler.ast;
+    ast.nodes[node].first = (uint32_t)ast.children.size();
+    ast.nodes[node].count = (uint32_t)(compiler.scratch.size() - base);
+    ast.children.insert(ast.children.end(), compiler.scratch.begin() + base, compiler.scratch.end());
+    compiler.scratch.resize(base);
+}
+
+NodeIndex parse_expression(Compiler &compiler);
+
+NodeIndex parse_identity(Compiler &compiler)
+{
+    return add_node(compiler, NodeKind::Identity, eat(compiler, TokenKind::Identity, "Expected identity."));
+}
+
+NodeIndex parse_call(Compiler &compiler)
+{
+    NodeIndex call = add_node(compiler, NodeKind::Call, eat(compiler, TokenKind::Identity, "Expected function name."));
+    size_t base = compiler.scratch.size();
+
+    eat(compiler, TokenKind::ParenL, "Expected '(' after function name.");
+    if (peek_expression(compiler))
+    {
+        compiler.scratch.push_back(parse_expression(compiler));
+        while (match(compiler, TokenKind::Comma))
+            compiler.scratch.push_back(parse_expression(compiler));
+    }
+    eat(compiler, TokenKind::ParenR, "Expected ')' after function arguments.");
+
+    set_children(compiler, call, base);
+    return call;
+}
+
+NodeIndex parse_list_literal(Compiler &compiler)
+{
+    // TODO: Parse array literals
+    return add_node(compiler, NodeKind::String, eat(compiler, TokenKind::String, "Expected string."));
+}
+
+NodeIndex parse_expression(Compiler &compiler)
+{
+    if (peek_call(compiler))
+        return parse_call(compiler);
+    else if (peek(compiler) == TokenKind::String)
+        return parse_list_literal(compiler);
+    else if (peek(compiler) == TokenKind::Identity)
+        return parse_identity(compiler);
+
+    error(compiler, "Expected expression");
+    return add_node(compiler, NodeKind::Invalid, (uint32_t)compiler.current_token);
+}
+
+NodeIndex parse_assign_stmt(Compiler &compiler)
+{
+    NodeIndex stmt = add_node(compiler, NodeKind::AssignStmt, eat(compiler, TokenKind::Identity, "Expected variable name."));
+    size_t base = compiler.scratch.size();
+
+    if (match(compiler, TokenKind::SquareL))
+    {
+        compiler.ast.nodes[stmt].flags |= node_list;
+        eat(compiler, TokenKind::SquareR, "Expected ']'");
+    }
+
+    if (match(compiler, TokenKind::Assign))
+        compiler.scratch.push_back(parse_expression(compiler));
+
+    set_children(compiler, stmt, base);
+    return stmt;
+}
+
+NodeIndex parse_insert_stmt(Compiler &compiler, NodeKind kind, TokenKind op, const char *msg)
+{
+    NodeIndex stmt = add_node(compiler, kind, (uint32_t)compiler.current_token);
+    size_t base = compiler.scratch.size();
+
+    compiler.scratch.push_back(parse_expression(compiler));
+    eat(compiler, op, msg);
+    compiler.scratch.push_back(parse_expression(compiler));
+    while (match(compiler, op))
+        compiler.scratch.push_back(parse_expression(compiler));
+
+    set_children(compiler, stmt, base);
+    return stmt;
+}
+
+NodeIndex parse_return_stmt(Compiler &compiler)
+{
+    NodeIndex stmt = add_node(compiler, NodeKind::ReturnStmt, eat(compiler, TokenKind::Return, "Expected 'return'"));
+    size_t base = compiler.scratch.size();
+
+    if (peek_expression(compiler))
+        compiler.scratch.push_back(parse_expression(compiler));
+
+    set_children(compiler, stmt, base);
+    return stmt;
+}
+
+NodeIndex parse_statement(Compiler &compiler)
+{
+    skip_lines(compiler);
+
+    NodeIndex stmt;
+    if (peek_assign_stmt(compiler))
+    {
+        stmt = parse_assign_stmt(compiler);
+    }
+    else if (peek_ltr_insert_stmt(compiler))
+    {
+        stmt = parse_insert_stmt(compiler, NodeKind::LtrInsertStmt, TokenKind::InsertR, "Expected >> operator.");
+    }
+    else if (peek_rtl_insert_stmt(compiler))
+    {
+        stmt = parse_insert_stmt(compiler, NodeKind::RtlInsertStmt, TokenKind::InsertL, "Expected << operator.");
+    }
+    else if (peek_return_stmt(compiler))
+    {
+        stmt = parse_return_stmt(compiler);
+    }
+    else
+    {
+        stmt = add_node(compiler, NodeKind::ExprStmt, (uint32_t)compiler.current_token);
+        size_t base = compiler.scratch.size();
+        compiler.scratch.push_back(parse_expression(compiler));
+        set_children(compiler, stmt, base);
+    }
+
+    eat(compiler, TokenKind::Line, "Expected newline to terminate statement");
+    return stmt;
+}
+
+NodeIndex parse_statement_block(Compiler &compiler)
+{
+    NodeIndex block = add_node(compiler, NodeKind::Block, eat(compiler, TokenKind::CurlyL, "Expected '{' to open block."));
+    size_t base = compiler.scratch.size();
+
+    skip_lines(compiler);
+    while (peek_statement(compiler))
+        compiler.scratch.push_back(parse_statement(compiler));
+
+    eat(compiler, TokenKind::CurlyR, "Expected '}' to close block.");
+
+    set_children(compiler, block, base);
+    return block;
+}
+
+// `f(x) = expr` is shorthand for a body that only returns `expr`
+NodeIndex parse_expression_body(Compiler &compiler)
+{
+    uint32_t token = eat(compiler, TokenKind::Assign, "Expected '='.");
+    NodeIndex block = add_node(compiler, NodeKind::Block, token);
+    NodeIndex stmt = add_node(compiler, NodeKind::ReturnStmt, token);
+
+    size_t base = compiler.scratch.size();
+    compiler.scratch.push_back(parse_expression(compiler));
+    set_children(compiler, stmt, base);
+
+    compiler.scratch.push_back(stmt);
+    set_children(compiler, block, base);
+    return block;
+}
+
+NodeIndex parse_parameter(Compiler &compiler)
+{
+    NodeIndex param = add_node(compiler, NodeKind::Param, eat(compiler, TokenKind::Identity, "Expected parameter name."));
+
+    if (match(compiler, TokenKind::SquareL))
+    {
+        eat(compiler, TokenKind::SquareR, "Expected ']'");
+        compiler.ast.nodes[param].flags |= node_list;
+    }
+
+    return param;
+}
+
+NodeIndex parse_function(Compiler &compiler)
+{
+    NodeIndex function = add_node(compiler, NodeKind::Function, eat(compiler, TokenKind::Identity, "Expected function name."));
+    size_t base = compiler.scratch.size();
+
+    eat(compiler, TokenKind::ParenL, "Expected '(' after function name.");
+    if (peek(compiler) == TokenKind::Identity)
+    {
+        compiler.scratch.push_back(parse_parameter(compiler));
+        while (match(compiler, TokenKind::Comma))
+            compiler.scratch.push_back(parse_parameter(compiler));
+    }
+    eat(compiler, TokenKind::ParenR, "Expected ')' at end of function parameters.");
+
+    if (peek(compiler) == TokenKind::Assign)
+        compiler.scratch.push_back(parse_expression_body(compiler));
+    else
+        compiler.scratch.push_back(parse_statement_block(compiler));
+
+    set_children(compiler, function, base);
+    return function;
+}
+
+void parse_program(Compiler &compiler)
+{
+    // Nodes are roughly one per two tokens
+    compiler.ast.nodes.reserve(compiler.lexer->tokens.size() / 2 + 1);
+    compiler.ast.bindings.reserve(compiler.lexer->tokens.size() / 2 + 1);
+    compiler.ast.children.reserve(compiler.lexer->tokens.size() / 2 + 1);
+
+    NodeIndex program = add_node(compiler, NodeKind::Program, (uint32_t)compiler.current_token);
+    size_t base = compiler.scratch.size();
+
+    skip_lines(compiler);
+    while (peek(compiler) == TokenKind::Identity)
+    {
+        compiler.scratch.push_back(parse_function(compiler));
+        skip_lines(compiler);
+    }
+    eat(compiler, TokenKind::EndOfFile, "Expected end of file");
+
+    set_children(compiler, program, base);
+    compiler.ast.root = program;
+}
+
+// NAME RESOLUTION //
+
+// Binds every identity, call, parameter and function to its entity. Variables are
+// declared implicitly by their first use, in the innermost scope.
+
+Symbol node_symbol(const Compiler &compiler, NodeIndex node)
+{
+    return compiler.lexer->tokens.symbols[compiler.ast.nodes[node].token];
+}
+
+void resolve_expression(Compiler &compiler, Scope &scope, NodeIndex node)
+{
+    Ast &ast = compiler.ast;
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::Identity:
+    {
+        Symbol symbol = node_symbol(compiler, node);
+        // FIXME: Have a console variable declared in the global scope
+        if (symbol == symbol_console)
+            return;
+
+        Entity *dec = fetch(&scope, symbol);
+        if (dec == nullptr)
+        {
+            dec = declare(scope, EntityKind::Variable, node_token(compiler, node));
+            ast.nodes[node].flags |= node_declares;
+        }
+        else if (dec->kind == EntityKind::Function)
+        {
+            error_at(compiler, node, "Cannot use function as an expression.");
+        }
+        ast.bindings[node] = dec;
+        return;
+    }
+
+    case NodeKind::Call:
+    {
+        Entity *funct = fetch(&scope, node_symbol(compiler, node));
+        string_view id = node_token(compiler, node).str;
+
+        if (funct == nullptr)
+        {
+            error_at(compiler, node, "Function '" + string(id) + "' does not exist.");
+        }
+        else if (funct->kind != EntityKind::Function)
+        {
+            error_at(compiler, node, "'" + string(id) + "' is not a function.");
+            funct = nullptr;
+        }
+        ast.bindings[node] = funct;
+
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+            resolve_expression(compiler, scope, child(ast, node, i));
+        return;
+    }
+
+    default:
+        return;
+    }
+}
+
+void resolve_statement(Compiler &compiler, Scope &scope, NodeIndex stmt)
+{
+    Ast &ast = compiler.ast;
+    if (ast.nodes[stmt].kind == NodeKind::AssignStmt)
+    {
+        Entity *dec = fetch(&scope, node_symbol(compiler, stmt));
+        if (dec == nullptr)
+        {
+            dec = declare(scope, EntityKind::Variable, node_token(compiler, stmt));
+            ast.nodes[stmt].flags |= node_declares;
+        }
+        ast.bindings[stmt] = dec;
+
+        if (dec->kind != EntityKind::Variable)
+        {
+            error_at(compiler, stmt, "Cannot assign to '" + string(node_token(compiler, stmt).str) + "' as it is not a variable.");
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < ast.nodes[stmt].count; i++)
+        resolve_expression(compiler, scope, child(ast, stmt, i));
+}
+
+void resolve_block(Compiler &compiler, Scope &scope, NodeIndex block)
+{
+    Ast &ast = compiler.ast;
+    Scope block_scope(&scope);
+
+    for (size_t i = 0; i < ast.nodes[block].count; i++)
+        resolve_statement(compiler, block_scope, child(ast, block, i));
+
+    ast.bindings[block] = block_scope.first_entity;
+    record_scope(compiler, block_scope);
+}
+
+void resolve_function(Compiler &compiler, Scope &scope, NodeIndex function, uint32_t index)
+{
+    Ast &ast = compiler.ast;
+    Scope function_scope(&scope);
+
+    Entity *fun = declare(scope, EntityKind::Function, node_token(compiler, function));
+    fun->function.node = function;
+    fun->function.index = index;
+    ast.bindings[function] = fun;
+
+    size_t param_count = ast.nodes[function].count - 1;
+    for (size_t i = 0; i < param_count; i++)
+    {
+        NodeIndex param_node = child(ast, function, i);
+        Entity *param = declare(function_scope, EntityKind::Variable, node_token(compiler, param_node));
+        param->variable.type = (ast.nodes[param_node].flags & node_list) ? TinyType::List : TinyType::Value;
+        add_param(compiler.arena, fun, param);
+        ast.bindings[param_node] = param;
+    }
+
+    resolve_block(compiler, function_scope, child(ast, function, param_count));
+    record_scope(compiler, function_scope);
+}
+
+void resolve_program(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    Scope program_scope(compiler.symbols);
+
+    for (size_t i = 0; i < ast.nodes[ast.root].count; i++)
+        resolve_function(compiler, program_scope, child(ast, ast.root, i), (uint32_t)i);
+
+    record_scope(compiler, program_scope);
+}
+
+// TYPE INFERENCE //
+
+// Types flow forwards through the program. A variable takes its type from the
+// context of its first use, and a function's return type from its first return
+// statement, so nodes are visited in source order.
+
+TinyType infer_expression(Compiler &compiler, NodeIndex node, TinyType type_hint = TinyType::Unspecified)
+{
+    Ast &ast = compiler.ast;
+    TinyType type = TinyType::Unspecified;
+
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::Identity:
+    {
+        Entity *dec = ast.bindings[node];
+        if (dec == nullptr)
+        {
+            type = TinyType::Console;
+        }
+        else if (dec->kind == EntityKind::Variable)
+        {
+            if (ast.nodes[node].flags & node_declares)
+                dec->variable.type = type_hint;
+            type = dec->variable.type;
+        }
+        break;
+    }
+
+    case NodeKind::Call:
+    {
+        Entity *funct = ast.bindings[node];
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+        {
+            TinyType param_type = funct != nullptr && funct->function.param_count > i
+                                      ? funct->function.params[i]->variable.type
+                                      : TinyType::Unspecified;
+            infer_expression(compiler, child(ast, node, i), param_type);
+        }
+        if (funct != nullptr)
+            type = funct->function.return_type;
+        break;
+    }
+
+    case NodeKind::String:
+        type = TinyType::List;
+        break;
+
+    default:
+        break;
+    }
+
+    ast.nodes[node].type = type;
+    return type;
+}
+
+void infer_statement(Compiler &compiler, NodeIndex stmt)
+{
+    Ast &ast = compiler.ast;
+    const Node &node = ast.nodes[stmt];
+
+    switch (node.kind)
+    {
+    case NodeKind::AssignStmt:
+    {
+        Entity *dec = ast.bindings[stmt];
+        if (dec == nullptr || dec->kind != EntityKind::Variable)
+            return;
+
+        if (node.flags & node_list)
+        {
+            if (node.flags & node_declares)
+                dec->variable.type = TinyType::List;
+            else if (dec->variable.type != TinyType::List)
+                error_at(compiler, stmt, "Variable '" + string(node_token(compiler, stmt).str) + "' cannot be redeclared as a list.");
+        }
+
+        if (node.count > 0)
+            infer_expression(compiler, child(ast, stmt, 0), dec->variable.type);
+
+        if (dec->variable.type == TinyType::Unspecified)
+            dec->variable.type = TinyType::Value;
+        return;
+    }
+
+    case NodeKind::LtrInsertStmt:
+        // FIXME: Supply type hints to the operands
+        for (size_t i = 0; i < node.count; i++)
+            infer_expression(compiler, child(ast, stmt, i));
+        return;
+
+    case NodeKind::RtlInsertStmt:
+    {
+        TinyType target_type = infer_expression(compiler, child(ast, stmt, 0), TinyType::List);
+        TinyType operand_hint = target_type == TinyType::Value ? TinyType::List : TinyType::Unspecified;
+        for (size_t i = 1; i < ast.nodes[stmt].count; i++)
+            infer_expression(compiler, child(ast, stmt, i), operand_hint);
+        return;
+    }
+
+    case NodeKind::ReturnStmt:
+    {
+        Entity *fun = compiler.in_function;
+        TinyType return_type = node.count > 0
+                                   ? infer_expression(compiler, child(ast, stmt, 0), fun->function.return_type)
+                                   : TinyType::None;
+
+        if (fun->function.return_type == TinyType::Unspecified)
+            fun->function.return_type = return_type;
+        else if (fun->function.return_type != return_type)
+            error_at(compiler, stmt, "Incorrect return type");
+        return;
+    }
+
+    case NodeKind::ExprStmt:
+        infer_expression(compiler, child(ast, stmt, 0));
+        return;
+
+    default:
+        return;
+    }
+}
+
+void infer_types(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        Entity *fun = ast.bindings[function];
+        fun->function.return_type = TinyType::Unspecified;
+        compiler.in_function = fun;
+
+        NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+        for (size_t i = 0; i < ast.nodes[block].count; i++)
+            infer_statement(compiler, child(ast, block, i));
+
+        for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+            if (var->kind == EntityKind::Variable && var->variable.type == TinyType::Unspecified)
+                var->variable.type = TinyType::Value;
+
+        if (fun->function.return_type == TinyType::Unspecified)
+            fun->function.return_type = TinyType::None;
+    }
+}
+
+// The type of an expression after inference. An identity visited before its variable's
+// type was settled still has to be looked up through the variable.
+TinyType expression_type(Compiler &compiler, NodeIndex node)
+{
+    const Node &expr = compiler.ast.nodes[node];
+    if (expr.kind != NodeKind::Identity)
+        return expr.type;
+
+    Entity *dec = compiler.ast.bindings[node];
+    if (dec == nullptr)
+        return TinyType::Console;
+    return dec->kind == EntityKind::Variable ? dec->variable.type : TinyType::Unspecified;
+}
+
+// OPTIMISATION //
+
+// Calls `remove` on each statement of every block, dropping the statements it returns true for
+template <typename Predicate>
+void filter_statements(Compiler &compiler, Predicate remove)
+{
+    Ast &ast = compiler.ast;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        Node &block = ast.nodes[child(ast, function, ast.nodes[function].count - 1)];
+
+        NodeIndex *stmts = &ast.children[block.first];
+        size_t kept = 0;
+        bool keep_rest = true;
+        for (size_t i = 0; i < block.count; i++)
+        {
+            if (keep_rest && !remove(stmts[i], keep_rest))
+                stmts[kept++] = stmts[i];
+        }
+        block.count = (uint32_t)kept;
+    }
+}
+
+// Statements that follow a return statement can never run
+void remove_unreachable_statements(Compiler &compiler)
+{
+    filter_statements(compiler, [&](NodeIndex stmt, bool &keep_rest)
+                      {
+                          if (compiler.ast.nodes[stmt].kind == NodeKind::ReturnStmt)
+                              keep_rest = false;
+                          return false; });
+}
+
+// A statement that only names a variable, console, a literal or a constant has no effect
+void remove_pure_statements(Compiler &compiler)
+{
+    filter_statements(compiler, [&](NodeIndex stmt, bool &)
+                      {
+                          const Ast &ast = compiler.ast;
+                          if (ast.nodes[stmt].kind != NodeKind::ExprStmt)
+                              return false;
+                          NodeKind kind = ast.nodes[child(ast, stmt, 0)].kind;
+                          return kind == NodeKind::Identity || kind == NodeKind::String || kind == NodeKind::Constant; });
+}
+
+// CONSTANT EVALUATION //
+
+// Calls whose arguments are all known at compile time are evaluated by
+// interpreting the syntax tree, and replaced by their result. A call that
+// touches the console, fails at runtime or runs out of steps is left alone.
+// String literals that are not written straight to the console also become
+// constants, so that they can be kept in static storage.
+
+constexpr size_t const_eval_steps = 1 << 16; // Statements and calls each evaluation may run
+constexpr size_t const_eval_depth = 256;     // Deepest call chain an evaluation may build
+
+// Escape sequences are decoded as C++ decodes them
+tiny::list string_constant(string_view chars)
+{
+    tiny::list values;
+    values.reserve(chars.size());
+    for (size_t i = 0; i < chars.size(); i++)
+    {
+        char c = chars[i];
+        if (c == '\\' && i + 1 < chars.size())
+        {
+            switch (chars[++i])
+            {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case '0':
+                c = '\0';
+                break;
+            default:
+                c = chars[i];
+                break;
+            }
+        }
+        values.push_back(c);
+    }
+    return values;
+}
+
+tiny::list string_literal(const Compiler &compiler, NodeIndex node)
+{
+    string_view str = node_token(compiler, node).str;
+    return string_constant(str.length() >= 2 ? str.substr(1, str.length() - 2) : string_view());
+}
+
+uint32_t add_constant(Compiler &compiler, ConstantValue value)
+{
+    compiler.constants.push_back(std::move(value));
+    return (uint32_t)(compiler.constants.size() - 1);
+}
+
+void make_constant(Compiler &compiler, NodeIndex node, uint32_t constant)
+{
+    Node &expr = compiler.ast.nodes[node];
+    expr.kind = NodeKind::Constant;
+    expr.type = compiler.constants[constant].type;
+    expr.first = constant;
+    expr.count = 0;
+}
+
+struct Evaluator
+{
+    Compiler &compiler;
+    size_t steps = 0;
+    size_t depth = 0;
+};
+
+// The variables of a function being evaluated
+using EvalFrame = vector<std::pair<Entity *, ConstantValue>>;
+
+ConstantValue *eval_variable(EvalFrame &frame, Entity *var)
+{
+    for (auto &slot : frame)
+        if (slot.first == var)
+            return &slot.second;
+    return nullptr;
+}
+
+bool eval_call(Evaluator &ev, Entity *funct, vector<ConstantValue> &args, ConstantValue &result);
+
+bool eval_expression(Evaluator &ev, EvalFrame &frame, NodeIndex node, ConstantValue &result)
+{
+    Compiler &compiler = ev.compiler;
+    Ast &ast = compiler.ast;
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::Identity:
+    {
+        ConstantValue *var = ast.bindings[node] != nullptr ? eval_variable(frame, ast.bindings[node]) : nullptr;
+        if (var == nullptr)
+            return false;
+        result = *var;
+        return true;
+    }
+
+    case NodeKind::String:
+    {
+        result.type = TinyType::List;
+        result.list = string_literal(compiler, node);
+        return true;
+    }
+
+    case NodeKind::Constant:
+        result = compiler.constants[ast.nodes[node].first];
+        return true;
+
+    case NodeKind::Call:
+    {
+        Entity *funct = ast.bindings[node];
+        if (funct == nullptr || funct->kind != EntityKind::Function)
+            return false;
+
+        vector<ConstantValue> args(ast.nodes[node].count);
+        for (size_t i = 0; i < args.size(); i++)
+            if (!eval_expression(ev, frame, child(ast, node, i), args[i]))
+                return false;
+        return eval_call(ev, funct, args, result);
+    }
+
+    default:
+        return false;
+    }
+}
+
+// Applies `a << b` (or `a >> b` when `ltr` is set) following the insertion table in documentation.md
+bool eval_insertion(ConstantValue &a, ConstantValue &b, bool ltr)
+{
+    const TinyType V = TinyType::Value, L = TinyType::List;
+    if (a.type == L && b.type == V)
+    {
+        if (!ltr)
+            a.list.push_back(b.value);
+        else if (a.list.empty())
+            return false;
+        else
+            b.value = a.list.pop_back();
+    }
+    else if (a.type == V && b.type == L)
+    {
+        if (ltr)
+            b.list.push_front(a.value);
+        else if (b.list.empty())
+            return false;
+        else
+            a.value = b.list.pop_front();
+    }
+    else if (a.type == L && b.type == L)
+    {
+        if (ltr)
+            b.list.prepend(a.list);
+        else
+            a.list.append(b.list);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Evaluates an expression that may be written to, binding to the variable itself if it is one
+ConstantValue *eval_operand(Evaluator &ev, EvalFrame &frame, NodeIndex node, ConstantValue &temporary)
+{
+    if (ev.compiler.ast.nodes[node].kind == NodeKind::Identity)
+        return ev.compiler.ast.bindings[node] != nullptr ? eval_variable(frame, ev.compiler.ast.bindings[node]) : nullptr;
+    return eval_expression(ev, frame, node, temporary) ? &temporary : nullptr;
+}
+
+// Runs a statement, returning false if evaluation has to give up
+bool eval_statement(Evaluator &ev, EvalFrame &frame, NodeIndex stmt, bool &returned, ConstantValue &result)
+{
+    Ast &ast = ev.compiler.ast;
+    const Node &node = ast.nodes[stmt];
+    if (ev.steps == 0)
+        return false;
+    ev.steps--;
+
+    switch (node.kind)
+    {
+    case NodeKind::AssignStmt:
+    {
+        if (node.count == 0)
+            return true;
+        ConstantValue *var = eval_variable(frame, ast.bindings[stmt]);
+        ConstantValue value;
+        if (var == nullptr || !eval_expression(ev, frame, child(ast, stmt, 0), value) || value.type != var->type)
+            return false;
+        *var = std::move(value);
+        return true;
+    }
+
+    case NodeKind::LtrInsertStmt:
+    case NodeKind::RtlInsertStmt:
+    {
+        ConstantValue target_temporary;
+        ConstantValue *target = eval_operand(ev, frame, child(ast, stmt, 0), target_temporary);
+        if (target == nullptr)
+            return false;
+
+        for (size_t i = 1; i < node.count; i++)
+        {
+            ConstantValue operand_temporary;
+            ConstantValue *operand = eval_operand(ev, frame, child(ast, stmt, i), operand_temporary);
+            if (operand == nullptr || !eval_insertion(*target, *operand, node.kind == NodeKind::LtrInsertStmt))
+                return false;
+        }
+        return true;
+    }
+
+    case NodeKind::ReturnStmt:
+        returned = true;
+        if (node.count == 0)
+        {
+            result.type = TinyType::None;
+            return true;
+        }
+        return eval_expression(ev, frame, child(ast, stmt, 0), result);
+
+    case NodeKind::ExprStmt:
+    {
+        ConstantValue unused;
+        return eval_expression(ev, frame, child(ast, stmt, 0), unused);
+    }
+
+    default:
+        return true;
+    }
+}
+
+bool eval_call(Evaluator &ev, Entity *funct, vector<ConstantValue> &args, ConstantValue &result)
+{
+    Ast &ast = ev.compiler.ast;
+    if (args.size() != funct->function.param_count || ev.depth >= const_eval_depth || ev.steps == 0)
+        return false;
+    ev.steps--;
+
+    NodeIndex function = funct->function.node;
+    NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+
+    // Every variable gets its slot up front, so pointers to slots stay valid
+    EvalFrame frame;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        Entity *param = funct->function.params[i];
+        if (args[i].type != param->variable.type)
+            return false;
+        frame.push_back({param, std::move(args[i])});
+    }
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+    {
+        if (var->kind != EntityKind::Variable)
+            continue;
+        ConstantValue initial;
+        initial.type = var->variable.type;
+        frame.push_back({var, std::move(initial)});
+    }
+
+    ev.depth++;
+    bool returned = false;
+    result.type = TinyType::None;
+    for (size_t i = 0; i < ast.nodes[block].count && !returned; i++)
+    {
+        if (!eval_statement(ev, frame, child(ast, block, i), returned, result))
+        {
+            ev.depth--;
+            return false;
+        }
+    }
+    ev.depth--;
+
+    // Falling off the end of a function that should return something is left for runtime
+    return result.type == funct->function.return_type;
+}
+
+// The constant an expression is known to hold, if any
+uint32_t known_constant(Compiler &compiler, NodeIndex node)
+{
+    const Node &expr = compiler.ast.nodes[node];
+    if (expr.kind == NodeKind::Constant)
+        return expr.first;
+    if (expr.kind == NodeKind::Identity)
+    {
+        Entity *dec = compiler.ast.bindings[node];
+        if (dec != nullptr && dec->kind == EntityKind::Variable)
+            return dec->variable.known_constant;
+    }
+    return no_constant;
+}
+
+// Folds what can be folded in an expression, returning whether its value is now known.
+// Strings that are written straight to the console are left as literals.
+bool fold_expression(Compiler &compiler, NodeIndex node, bool printed = false)
+{
+    Ast &ast = compiler.ast;
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::String:
+    {
+        if (printed)
+            return false;
+
+        string_view str = node_token(compiler, node).str;
+        uint32_t &constant = compiler.string_constants[str];
+        if (constant == 0)
+        {
+            ConstantValue value;
+            value.type = TinyType::List;
+            value.list = string_literal(compiler, node);
+            constant = add_constant(compiler, std::move(value)) + 1;
+        }
+        make_constant(compiler, node, constant - 1);
+        return true;
+    }
+
+    case NodeKind::Identity:
+    case NodeKind::Constant:
+        return known_constant(compiler, node) != no_constant;
+
+    case NodeKind::Call:
+    {
+        Entity *funct = ast.bindings[node];
+        bool known = funct != nullptr && funct->kind == EntityKind::Function;
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+            if (!fold_expression(compiler, child(ast, node, i)))
+                known = false;
+        if (!known)
+            return false;
+
+        vector<ConstantValue> args(ast.nodes[node].count);
+        for (size_t i = 0; i < args.size(); i++)
+            args[i] = compiler.constants[known_constant(compiler, child(ast, node, i))];
+
+        Evaluator ev{compiler, const_eval_steps, 0};
+        ConstantValue result;
+        if (!eval_call(ev, funct, args, result))
+            return false;
+
+        make_constant(compiler, node, add_constant(compiler, std::move(result)));
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+// Insertions may write to any variable they mention, apart from values written to the console
+void forget_operands(Compiler &compiler, NodeIndex stmt, size_t first)
+{
+    Ast &ast = compiler.ast;
+    for (size_t i = first; i < ast.nodes[stmt].count; i++)
+    {
+        NodeIndex operand = child(ast, stmt, i);
+        Entity *dec = ast.bindings[operand];
+        if (ast.nodes[operand].kind == NodeKind::Identity && dec != nullptr && dec->kind == EntityKind::Variable)
+            dec->variable.known_constant = no_constant;
+    }
+}
+
+void fold_statement(Compiler &compiler, NodeIndex stmt)
+{
+    Ast &ast = compiler.ast;
+    const Node &node = ast.nodes[stmt];
+
+    switch (node.kind)
+    {
+    case NodeKind::AssignStmt:
+    {
+        Entity *dec = ast.bindings[stmt];
+        if (dec == nullptr || dec->kind != EntityKind::Variable)
+            return;
+
+        // A variable assigned a known value holds it until something else writes to it
+        if (node.count > 0 && fold_expression(compiler, child(ast, stmt, 0)))
+            dec->variable.known_constant = known_constant(compiler, child(ast, stmt, 0));
+        else
+            dec->variable.known_constant = no_constant;
+        return;
+    }
+
+    case NodeKind::LtrInsertStmt:
+    case NodeKind::RtlInsertStmt:
+    {
+        NodeIndex target = child(ast, stmt, 0);
+        bool console = ast.nodes[target].kind == NodeKind::Identity && ast.bindings[target] == nullptr;
+        bool printing = console && node.kind == NodeKind::RtlInsertStmt;
+        for (size_t i = 0; i < node.count; i++)
+            fold_expression(compiler, child(ast, stmt, i), printing);
+        if (!printing)
+            forget_operands(compiler, stmt, console ? 1 : 0);
+        return;
+    }
+
+    case NodeKind::ReturnStmt:
+        if (node.count > 0)
+            fold_expression(compiler, child(ast, stmt, 0));
+        return;
+
+    case NodeKind::ExprStmt:
+        fold_expression(compiler, child(ast, stmt, 0));
+        return;
+
+    default:
+        return;
+    }
+}
+
+void evaluate_constants(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+        Entity *fun = ast.bindings[function];
+
+        for (size_t i = 0; i < fun->function.param_count; i++)
+            fun->function.params[i]->variable.known_constant = no_constant;
+        for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+            if (var->kind == EntityKind::Variable)
+                var->variable.known_constant = no_constant;
+
+        for (size_t i = 0; i < ast.nodes[block].count; i++)
+            fold_statement(compiler, child(ast, block, i));
+    }
+}
+
+// PURITY ANALYSIS //
+
+// A function is pure if it never touches the console, directly or through the
+// functions it calls. Calling a pure function again with the same arguments
+// gives the same result and has no other effect, so its calls can be shared or
+// cached. Functions can only call themselves and functions declared before
+// them, so one pass in program order is enough.
+
+bool touches_console(Compiler &compiler, NodeIndex node, const Entity *self)
+{
+    Ast &ast = compiler.ast;
+    const Node &expr = ast.nodes[node];
+    if (expr.kind == NodeKind::Identity && ast.bindings[node] == nullptr)
+        return true;
+    if (expr.kind == NodeKind::Call)
+    {
+        Entity *funct = ast.bindings[node];
+        if (funct == nullptr || (funct != self && !funct->function.pure))
+            return true;
+    }
+
+    if (expr.kind == NodeKind::Call || expr.kind == NodeKind::AssignStmt || expr.kind == NodeKind::LtrInsertStmt ||
+        expr.kind == NodeKind::RtlInsertStmt || expr.kind == NodeKind::ReturnStmt || expr.kind == NodeKind::ExprStmt)
+    {
+        for (size_t i = 0; i < expr.count; i++)
+            if (touches_console(compiler, child(ast, node, i), self))
+                return true;
+    }
+    return false;
+}
+
+void analyse_purity(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+        Entity *fun = ast.bindings[function];
+
+        fun->function.pure = fun->symbol != symbol_main;
+        for (size_t i = 0; i < ast.nodes[block].count && fun->function.pure; i++)
+            if (touches_console(compiler, child(ast, block, i), fun))
+                fun->function.pure = false;
+    }
+}
+
+bool memoizable(const Entity *fun)
+{
+    if (!fun->function.pure || fun->function.param_count == 0 || fun->function.return_type != TinyType::Value)
+        return false;
+    for (size_t i = 0; i < fun->function.param_count; i++)
+        if (fun->function.params[i]->variable.type != TinyType::Value)
+            return false;
+    return true;
+}
+
+// INLINING //
+
+// Calls to small functions are replaced by a copy of the function's body. The
+// callee's statements are placed just before the statement making the call, with
+// its parameters and variables renamed to fresh variables of the caller, and the
+// call itself becomes the returned expression. Functions can only call themselves
+// and functions declared before them, so visiting them in program order means
+// every callee has already had its own calls inlined.
+
+constexpr size_t inline_max_cost = 16;      // Largest body inlined at every call site
+constexpr size_t inline_max_cost_once = 64; // Largest body inlined into its only call site
+constexpr size_t inline_max_growth = 512;   // Most nodes inlining may add to one function
+
+struct Inliner
+{
+    Compiler &compiler;
+    Entity *caller = nullptr;
+    Entity *last_variable = nullptr; // End of the caller's chain of block variables
+    size_t growth = 0;
+    size_t variables = 0; // Fresh variables made so far in the caller, which number their names
+    vector<uint32_t> call_sites; // Calls to each function anywhere in the program
+    vector<bool> recursive;      // Whether each function calls itself
+
+    Inliner(Compiler &compiler) : compiler(compiler) {}
+};
+
+// The body of a function up to and including its first return statement, since nothing after it can run
+size_t inline_body_length(const Ast &ast, NodeIndex block)
+{
+    for (size_t i = 0; i < ast.nodes[block].count; i++)
+        if (ast.nodes[child(ast, block, i)].kind == NodeKind::ReturnStmt)
+            return i + 1;
+    return ast.nodes[block].count;
+}
+
+size_t node_cost(const Ast &ast, NodeIndex node)
+{
+    size_t cost = 1;
+    if (ast.nodes[node].kind != NodeKind::Function && ast.nodes[node].kind != NodeKind::Program)
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+            cost += node_cost(ast, child(ast, node, i));
+    return cost;
+}
+
+size_t inline_cost(const Ast &ast, const Entity *funct)
+{
+    NodeIndex block = child(ast, funct->function.node, ast.nodes[funct->function.node].count - 1);
+    size_t cost = 0;
+    for (size_t i = 0; i < inline_body_length(ast, block); i++)
+        cost += node_cost(ast, child(ast, block, i));
+    return cost;
+}
+
+bool is_atomic(const Ast &ast, NodeIndex node)
+{
+    NodeKind kind = ast.nodes[node].kind;
+    return (kind == NodeKind::Identity && ast.bindings[node] != nullptr) || kind == NodeKind::String || kind == NodeKind::Constant;
+}
+
+bool is_console(const Ast &ast, NodeIndex node)
+{
+    return ast.nodes[node].kind == NodeKind::Identity && ast.bindings[node] == nullptr;
+}
+
+void count_calls(Inliner &inliner, NodeIndex node, const Entity *fun, vector<uint32_t> &calls)
+{
+    Ast &ast = inliner.compiler.ast;
+    if (ast.nodes[node].kind == NodeKind::Call && ast.bindings[node] != nullptr)
+    {
+        Entity *funct = ast.bindings[node];
+        inliner.call_sites[funct->function.index]++;
+        calls.push_back((uint32_t)funct->function.index);
+        if (funct == fun)
+            inliner.recursive[funct->function.index] = true;
+    }
+    for (size_t i = 0; i < ast.nodes[node].count; i++)
+        count_calls(inliner, child(ast, node, i), fun, calls);
+}
+
+// Whether a variable is ever assigned or used as an operand that an insertion may write to
+bool written_in(const Ast &ast, NodeIndex block, size_t length, const Entity *var)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        NodeIndex stmt = child(ast, block, i);
+        const Node &node = ast.nodes[stmt];
+        if (node.kind == NodeKind::AssignStmt && ast.bindings[stmt] == var)
+            return true;
+        if (node.kind != NodeKind::LtrInsertStmt && node.kind != NodeKind::RtlInsertStmt)
+            continue;
+
+        bool printing = node.kind == NodeKind::RtlInsertStmt && is_console(ast, child(ast, stmt, 0));
+        for (size_t j = 0; j < node.count && !printing; j++)
+            if (ast.bindings[child(ast, stmt, j)] == var && ast.nodes[child(ast, stmt, j)].kind == NodeKind::Identity)
+                return true;
+    }
+    return false;
+}
+
+// What each of the callee's variables becomes in the copy of its body
+struct InlineBinding
+{
+    Entity *from;
+    Entity *to;         // A fresh variable of the caller, or null if `node` is substituted
+    NodeIndex argument; // An argument that is only read, substituted for every use of the parameter
+};
+
+NodeIndex clone_node(Compiler &compiler, NodeIndex node, const vector<InlineBinding> &bindings)
+{
+    Ast &ast = compiler.ast;
+    Entity *binding = ast.bindings[node];
+    for (const InlineBinding &b : bindings)
+    {
+        if (b.from != binding || binding == nullptr)
+            continue;
+        if (b.to == nullptr)
+            return clone_node(compiler, b.argument, {});
+        binding = b.to;
+        break;
+    }
+
+    size_t base = compiler.scratch.size();
+    for (size_t i = 0; i < ast.nodes[node].count; i++)
+        compiler.scratch.push_back(clone_node(compiler, child(ast, node, i), bindings));
+
+    Node copy = ast.nodes[node];
+    NodeIndex clone = add_node(compiler, copy.kind, copy.token);
+    ast.nodes[clone] = copy;
+    ast.bindings[clone] = binding;
+    set_children(compiler, clone, base);
+    return clone;
+}
+
+Entity *inline_variable(Inliner &inliner, const Entity *original)
+{
+    Compiler &compiler = inliner.compiler;
+    Entity *var = compiler.arena.make<Entity>(EntityKind::Variable, symbol_none, original->identity);
+    var->variable.type = original->variable.type;
+
+    // Generated names end in a number, which the names of source variables never do
+    string c_identity = string(original->identity) + "_" + std::to_string(inliner.variables++);
+    char *chars = compiler.arena.make_array<char>(c_identity.length());
+    memcpy(chars, c_identity.data(), c_identity.length());
+    var->c_identity = string_view(chars, c_identity.length());
+
+    if (inliner.last_variable != nullptr)
+        inliner.last_variable->next_in_scope = var;
+    else
+        compiler.ast.bindings[child(compiler.ast, inliner.caller->function.node, compiler.ast.nodes[inliner.caller->function.node].count - 1)] = var;
+    inliner.last_variable = var;
+    return var;
+}
+
+void report_inlining(Inliner &inliner, NodeIndex call, const Entity *funct, size_t cost, const char *refusal)
+{
+    if (!inliner.compiler.verbose)
+        return;
+    std::cerr << "inline: ";
+    if (refusal != nullptr)
+        std::cerr << "not inlining ";
+    std::cerr << funct->identity << " into " << inliner.caller->identity << " on line " << node_token(inliner.compiler, call).line;
+    if (refusal != nullptr)
+        std::cerr << ", " << refusal;
+    std::cerr << " (cost " << cost << ")\n";
+}
+
+// Decides whether a call can be inlined where it is, returning why not if it cannot
+const char *inline_refusal(Inliner &inliner, NodeIndex call, size_t cost)
+{
+    Ast &ast = inliner.compiler.ast;
+    Entity *funct = ast.bindings[call];
+    if (funct->symbol == symbol_main)
+        return "main cannot be inlined";
+    if (funct == inliner.caller || inliner.recursive[funct->function.index])
+        return "it is recursive";
+    if (ast.nodes[call].count != funct->function.param_count)
+        return "the argument count is wrong";
+    for (size_t i = 0; i < ast.nodes[call].count; i++)
+        if (expression_type(inliner.compiler, child(ast, call, i)) != funct->function.params[i]->variable.type)
+            return "an argument has the wrong type";
+
+    size_t limit = inliner.call_sites[funct->function.index] == 1 ? inline_max_cost_once : inline_max_cost;
+    if (cost > limit)
+        return "it is too large";
+    if (inliner.growth + cost > inline_max_growth)
+        return "the caller has grown too large";
+    return nullptr;
+}
+
+// Finds the first call in an expression, innermost first, whose arguments are already
+// simple enough to be evaluated ahead of the statement
+NodeIndex find_inline_candidate(Inliner &inliner, NodeIndex node, vector<NodeIndex> &refused)
+{
+    Ast &ast = inliner.compiler.ast;
+    if (ast.nodes[node].kind != NodeKind::Call || ast.bindings[node] == nullptr)
+        return 0;
+
+    bool atomic = true;
+    for (size_t i = 0; i < ast.nodes[node].count; i++)
+    {
+        NodeIndex arg = child(ast, node, i);
+        if (NodeIndex found = find_inline_candidate(inliner, arg, refused))
+            return found;
+        if (!is_atomic(ast, arg))
+            atomic = false;
+    }
+
+    if (!atomic || std::find(refused.begin(), refused.end(), node) != refused.end())
+        return 0;
+    return node;
+}
+
+// Counts the calls in an expression, and those that may touch the console
+void count_calls_in(const Ast &ast, NodeIndex node, size_t &calls, size_t &impure)
+{
+    if (ast.nodes[node].kind != NodeKind::Call)
+        return;
+    calls++;
+    if (ast.bindings[node] == nullptr || !ast.bindings[node]->function.pure)
+        impure++;
+    for (size_t i = 0; i < ast.nodes[node].count; i++)
+        count_calls_in(ast, child(ast, node, i), calls, impure);
+}
+
+// Copies the callee's body in front of the statement and replaces the call with what
+// it returns. Returns false if the call was the whole statement and left nothing behind.
+bool inline_call(Inliner &inliner, NodeIndex call, vector<NodeIndex> &stmts)
+{
+    Compiler &compiler = inliner.compiler;
+    Ast &ast = compiler.ast;
+    Entity *funct = ast.bindings[call];
+    NodeIndex function = funct->function.node;
+    NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+    size_t length = inline_body_length(ast, block);
+
+    // Parameters the callee only reads are replaced by their arguments, the rest are copied
+    // into fresh variables so that insertions inside the callee cannot reach the caller
+    vector<InlineBinding> bindings;
+    for (size_t i = 0; i < funct->function.param_count; i++)
+    {
+        Entity *param = funct->function.params[i];
+        NodeIndex arg = child(ast, call, i);
+        if (!written_in(ast, block, length, param))
+        {
+            bindings.push_back({param, nullptr, arg});
+            continue;
+        }
+
+        Entity *var = inline_variable(inliner, param);
+        bindings.push_back({param, var, 0});
+
+        size_t base = compiler.scratch.size();
+        NodeIndex assign = add_node(compiler, NodeKind::AssignStmt, ast.nodes[function].token);
+        ast.nodes[assign].flags = var->variable.type == TinyType::List ? node_list : 0;
+        ast.bindings[assign] = var;
+        compiler.scratch.push_back(clone_node(compiler, arg, {}));
+        set_children(compiler, assign, base);
+        stmts.push_back(assign);
+    }
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+        if (var->kind == EntityKind::Variable)
+            bindings.push_back({var, inline_variable(inliner, var), 0});
+
+    NodeIndex result = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        NodeIndex body_stmt = child(ast, block, i);
+        if (ast.nodes[body_stmt].kind != NodeKind::ReturnStmt)
+            stmts.push_back(clone_node(compiler, body_stmt, bindings));
+        else if (ast.nodes[body_stmt].count > 0)
+            result = clone_node(compiler, child(ast, body_stmt, 0), bindings);
+    }
+
+    if (result == 0)
+        return false;
+
+    // The call node is overwritten in place, so that its parent needs no changes
+    ast.nodes[call] = ast.nodes[result];
+    ast.bindings[call] = ast.bindings[result];
+    return true;
+}
+
+void inline_function(Inliner &inliner, NodeIndex function)
+{
+    Compiler &compiler = inliner.compiler;
+    Ast &ast = compiler.ast;
+    NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+
+    inliner.caller = ast.bindings[function];
+    inliner.growth = 0;
+    inliner.variables = 0;
+    inliner.last_variable = nullptr;
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+        inliner.last_variable = var;
+
+    vector<NodeIndex> stmts;
+    vector<NodeIndex> refused;
+    bool changed = false;
+    for (size_t i = 0; i < ast.nodes[block].count; i++)
+    {
+        NodeIndex stmt = child(ast, block, i);
+        NodeKind kind = ast.nodes[stmt].kind;
+
+        // Only the operands evaluated before the first insertion can have their calls
+        // moved ahead of the statement
+        size_t operands = ast.nodes[stmt].count;
+        if (kind == NodeKind::LtrInsertStmt || kind == NodeKind::RtlInsertStmt)
+            operands = std::min<size_t>(operands, 2);
+
+        bool keep = true;
+        refused.clear();
+        for (size_t j = 0; j < operands && keep; j++)
+        {
+            NodeIndex operand = child(ast, stmt, j);
+            while (NodeIndex call = find_inline_candidate(inliner, operand, refused))
+            {
+                Entity *funct = ast.bindings[call];
+                size_t cost = inline_cost(ast, funct);
+                const char *refusal = inline_refusal(inliner, call, cost);
+
+                // Moving the body ahead of other calls in the statement must not reorder anything
+                // they do with the console
+                size_t calls = 0, impure = 0;
+                for (size_t k = 0; k < ast.nodes[stmt].count; k++)
+                    count_calls_in(ast, child(ast, stmt, k), calls, impure);
+                if (refusal == nullptr && calls > 1 && impure > 0)
+                    refusal = "other calls in the statement use the console";
+
+                NodeIndex function_node = funct->function.node;
+                NodeIndex callee_block = child(ast, function_node, ast.nodes[function_node].count - 1);
+                size_t length = inline_body_length(ast, callee_block);
+                bool returns_value = length > 0 && ast.nodes[child(ast, callee_block, length - 1)].kind == NodeKind::ReturnStmt &&
+                                     ast.nodes[child(ast, callee_block, length - 1)].count > 0;
+                if (refusal == nullptr && !returns_value && !(kind == NodeKind::ExprStmt && operand == call))
+                    refusal = "it does not return a value";
+
+                report_inlining(inliner, call, funct, cost, refusal);
+                if (refusal != nullptr)
+                {
+                    refused.push_back(call);
+                    continue;
+                }
+
+                inliner.growth += cost;
+                compiler.stats.calls_inlined++;
+                changed = true;
+                if (!inline_call(inliner, call, stmts))
+                {
+                    keep = false;
+                    break;
+                }
+            }
+        }
+        if (keep)
+            stmts.push_back(stmt);
+    }
+
+    if (!changed)
+        return;
+    Node &body = ast.nodes[block];
+    body.first = (uint32_t)ast.children.size();
+    body.count = (uint32_t)stmts.size();
+    ast.children.insert(ast.children.end(), stmts.begin(), stmts.end());
+}
+
+void inline_calls(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    size_t count = ast.nodes[ast.root].count;
+    Inliner inliner(compiler);
+    inliner.call_sites.assign(count, 0);
+    inliner.recursive.assign(count, false);
+    compiler.function_calls.assign(count, {});
+
+    for (size_t f = 0; f < count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        count_calls(inliner, child(ast, function, ast.nodes[function].count - 1), ast.bindings[function],
+                    compiler.function_calls[f]);
+    }
+    if (compiler.call_sites != nullptr)
+        inliner.call_sites = *compiler.call_sites;
+
+    for (size_t f = 0; f < count; f++)
+        inline_function(inliner, child(ast, ast.root, f));
+}
+
+// COMMON SUBEXPRESSION ELIMINATION //
+
+// When a variable is assigned the result of a pure call, later copies of the same
+// call are replaced by the variable, for as long as neither the variable nor
+// anything the call reads has been written to in between.
+
+constexpr size_t cse_max_available = 64; // Assigned calls remembered at once in each function
+
+struct AvailableCall
+{
+    NodeIndex call;
+    Entity *holder;
+};
+
+bool same_expression(Compiler &compiler, NodeIndex a, NodeIndex b)
+{
+    Ast &ast = compiler.ast;
+    const Node &x = ast.nodes[a];
+    const Node &y = ast.nodes[b];
+    if (x.kind != y.kind)
+        return false;
+
+    switch (x.kind)
+    {
+    case NodeKind::Identity:
+        return ast.bindings[a] == ast.bindings[b] && ast.bindings[a] != nullptr;
+    case NodeKind::String:
+        return node_token(compiler, a).str == node_token(compiler, b).str;
+    case NodeKind::Constant:
+        return x.first == y.first;
+    case NodeKind::Call:
+        if (ast.bindings[a] != ast.bindings[b] || x.count != y.count)
+            return false;
+        for (size_t i = 0; i < x.count; i++)
+            if (!same_expression(compiler, child(ast, a, i), child(ast, b, i)))
+                return false;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool mentions(Compiler &compiler, NodeIndex node, const Entity *var)
+{
+    Ast &ast = compiler.ast;
+    if (ast.nodes[node].kind == NodeKind::Identity)
+        return ast.bindings[node] == var;
+    if (ast.nodes[node].kind == NodeKind::Call)
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+            if (mentions(compiler, child(ast, node, i), var))
+                return true;
+    return false;
+}
+
+void forget_available(Compiler &compiler, vector<AvailableCall> &available, const Entity *written)
+{
+    size_t kept = 0;
+    for (const AvailableCall &entry : available)
+        if (entry.holder != written && !mentions(compiler, entry.call, written))
+            available[kept++] = entry;
+    available.resize(kept);
+}
+
+// Replaces pure calls in an expression that are already held by a variable. Unless
+// `whole` is set, only the expression's arguments are considered, because the
+// expression itself is going to be written to.
+void replace_available(Compiler &compiler, NodeIndex node, const vector<AvailableCall> &available, bool whole = true)
+{
+    Ast &ast = compiler.ast;
+    if (ast.nodes[node].kind != NodeKind::Call)
+        return;
+
+    for (size_t i = 0; i < ast.nodes[node].count; i++)
+        replace_available(compiler, child(ast, node, i), available);
+
+    Entity *funct = ast.bindings[node];
+    if (!whole || funct == nullptr || !funct->function.pure)
+        return;
+
+    for (const AvailableCall &entry : available)
+    {
+        if (!same_expression(compiler, entry.call, node))
+            continue;
+
+        Node &expr = ast.nodes[node];
+        expr.kind = NodeKind::Identity;
+        expr.flags = 0;
+        expr.type = entry.holder->variable.type;
+        expr.count = 0;
+        ast.bindings[node] = entry.holder;
+        compiler.stats.calls_shared++;
+        return;
+    }
+}
+
+void eliminate_statement(Compiler &compiler, NodeIndex stmt, vector<AvailableCall> &available)
+{
+    Ast &ast = compiler.ast;
+    const Node &node = ast.nodes[stmt];
+
+    switch (node.kind)
+    {
+    case NodeKind::AssignStmt:
+    {
+        Entity *dec = ast.bindings[stmt];
+        if (node.count > 0)
+            replace_available(compiler, child(ast, stmt, 0), available);
+        if (dec == nullptr || dec->kind != EntityKind::Variable)
+            return;
+
+        forget_available(compiler, available, dec);
+        if (node.count == 0)
+            return;
+
+        NodeIndex value = child(ast, stmt, 0);
+        Entity *funct = ast.bindings[value];
+        if (ast.nodes[value].kind == NodeKind::Call && funct != nullptr && funct->function.pure && !mentions(compiler, value, dec))
+        {
+            if (available.size() == cse_max_available)
+                available.erase(available.begin());
+            available.push_back({value, dec});
+        }
+        return;
+    }
+
+    case NodeKind::LtrInsertStmt:
+    case NodeKind::RtlInsertStmt:
+    {
+        // Writing to the console only reads its operands, every other insertion may modify them
+        NodeIndex target = child(ast, stmt, 0);
+        bool console = ast.nodes[target].kind == NodeKind::Identity && ast.bindings[target] == nullptr;
+        bool printing = console && node.kind == NodeKind::RtlInsertStmt;
+        for (size_t i = 0; i < node.count; i++)
+        {
+            NodeIndex operand = child(ast, stmt, i);
+            replace_available(compiler, operand, available, printing);
+            if (!printing && ast.nodes[operand].kind == NodeKind::Identity && ast.bindings[operand] != nullptr)
+                forget_available(compiler, available, ast.bindings[operand]);
+        }
+        return;
+    }
+
+    case NodeKind::ReturnStmt:
+    case NodeKind::ExprStmt:
+        if (node.count > 0)
+            replace_available(compiler, child(ast, stmt, 0), available);
+        return;
+
+    default:
+        return;
+    }
+}
+
+void eliminate_common_calls(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    vector<AvailableCall> available;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+
+        available.clear();
+        for (size_t i = 0; i < ast.nodes[block].count; i++)
+            eliminate_statement(compiler, child(ast, block, i), available);
+    }
+}
+
+// TAIL CALLS //
+
+// A function whose first return statement returns a call to itself can never
+// return any other way, so instead of calling, it starts over: the arguments
+// become the new parameters, its other variables are reset, and control goes back
+// to the top of the body. The stack stays the same size however long it runs.
+// Assigning the call to a variable that is then immediately returned counts too.
+
+bool is_self_tail_call(Compiler &compiler, NodeIndex call, const Entity *fun)
+{
+    Ast &ast = compiler.ast;
+    if (ast.nodes[call].kind != NodeKind::Call || ast.bindings[call] != fun || ast.nodes[call].count != fun->function.param_count)
+        return false;
+    for (size_t i = 0; i < fun->function.param_count; i++)
+        if (expression_type(compiler, child(ast, call, i)) != fun->function.params[i]->variable.type)
+            return false;
+    return true;
+}
+
+bool passes_through(const Ast &ast, NodeIndex call, size_t i, const Entity *fun)
+{
+    NodeIndex arg = child(ast, call, i);
+    return ast.nodes[arg].kind == NodeKind::Identity && ast.bindings[arg] == fun->function.params[i];
+}
+
+void eliminate_tail_calls(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    for (size_t f = 0; f < ast.nodes[ast.root].count; f++)
+    {
+        NodeIndex function = child(ast, ast.root, f);
+        NodeIndex block = child(ast, function, ast.nodes[function].count - 1);
+        Entity *fun = ast.bindings[function];
+        size_t length = inline_body_length(ast, block);
+        if (fun->symbol == symbol_main || length == 0)
+            continue;
+
+        NodeIndex stmt = child(ast, block, length - 1);
+        if (ast.nodes[stmt].kind != NodeKind::ReturnStmt || ast.nodes[stmt].count == 0)
+            continue;
+
+        NodeIndex returned = child(ast, stmt, 0);
+        if (!is_self_tail_call(compiler, returned, fun))
+        {
+            // `x = f(...)` followed by `return x` becomes `return f(...)`
+            if (length < 2 || ast.nodes[returned].kind != NodeKind::Identity)
+                continue;
+            NodeIndex assign = child(ast, block, length - 2);
+            Node &node = ast.nodes[assign];
+            if (node.kind != NodeKind::AssignStmt || node.count == 0 || ast.bindings[assign] != ast.bindings[returned] ||
+                !is_self_tail_call(compiler, child(ast, assign, 0), fun))
+                continue;
+
+            node.kind = NodeKind::ReturnStmt;
+            node.flags = 0;
+            ast.bindings[assign] = nullptr;
+            NodeIndex *stmts = &ast.children[ast.nodes[block].first];
+            std::copy(stmts + length, stmts + ast.nodes[block].count, stmts + length - 1);
+            ast.nodes[block].count--;
+            stmt = assign;
+        }
+
+        ast.nodes[stmt].flags |= node_tail_call;
+        ast.nodes[function].flags |= node_tail_call;
+        compiler.stats.tail_calls++;
+    }
+}
+
+// LAST USE ANALYSIS //
+
+// Programs have no branches or loops, so the last read of a variable is simply
+// the last statement that mentions it. A list that is copied at its last read is
+// moved instead, and a list parameter that is only ever read is passed by const
+// reference rather than copied into the function.
+
+enum class ListUse : uint8_t
+{
+    Read,   // Written to the console or passed by reference
+    Copy,   // Assigned to another variable or passed by value
+    Write,  // Modified by an insertion or assignment
+    Return, // Returned, which already moves a local
+};
+
+struct ListUseSite
+{
+    Entity *var;
+    NodeIndex node;
+    uint32_t stmt;
+    ListUse use;
+};
+
+bool is_list_variable(const Entity *dec)
+{
+    return dec != nullptr && dec->kind == EntityKind::Variable && dec->variable.type == TinyType::List;
+}
+
+void collect_list_uses(Compiler &compiler, NodeIndex node, uint32_t stmt, ListUse use, vector<ListUseSite> &sites)
+{
+    Ast &ast = compiler.ast;
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::Identity:
+        if (is_list_variable(ast.bindings[node]))
+            sites.push_back({ast.bindings[node], node, stmt, use});
+        return;
+
+    case NodeKind::Call:
+    {
+        Entity *funct = ast.bindings[node];
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+        {
+            bool by_reference = funct != nullptr && i < funct->function.param_count &&
+                                (ast.nodes[child(ast, funct->function.node, i)].flags & node_by_reference);
+            collect_list_uses(compiler, child(ast, node, i), stmt, by_reference ? ListUse::Read : ListUse::Copy, sites);
+        }
+        return;
+    }
+
+    default:
+        return;
+    }
+}
+
+// A tail call copies its arguments and overwrites every parameter that is not passed
+// straight through. A parameter that is passed through is read again next time round.
+void collect_tail_call_uses(Compiler &compiler, NodeIndex stmt, uint32_t s, vector<ListUseSite> &sites)
+{
+    Ast &ast = compiler.ast;
+    NodeIndex call = child(ast, stmt, 0);
+    Entity *fun = ast.bindings[call];
+    for (size_t i = 0; i < ast.nodes[call].count; i++)
+    {
+        Entity *param = fun->function.params[i];
+        if (passes_through(ast, call, i, fun))
+        {
+            if (is_list_variable(param))
+                sites.push_back({param, child(ast, call, i), s, ListUse::Read});
+            continue;
+        }
+
+        collect_list_uses(compiler, child(ast, call, i), s, ListUse::Copy, sites);
+        if (is_list_variable(param))
+            sites.push_back({param, stmt, s, ListUse::Write});
+    }
+}
+
+void analyse_function_last_uses(Compiler &compiler, NodeIndex function, vector<ListUseSite> &sites)
+{
+    Ast &ast = compiler.ast;
+    size_t param_count = ast.nodes[function].count - 1;
+    NodeIndex block = child(ast, function, param_count);
+
+    sites.clear();
+    for (uint32_t s = 0; s < ast.nodes[block].count; s++)
+    {
+        NodeIndex stmt = child(ast, block, s);
+        const Node &node = ast.nodes[stmt];
+        switch (node.kind)
+        {
+        case NodeKind::AssignStmt:
+            if (is_list_variable(ast.bindings[stmt]))
+                sites.push_back({ast.bindings[stmt], stmt, s, ListUse::Write});
+            if (node.count > 0)
+                collect_list_uses(compiler, child(ast, stmt, 0), s, ListUse::Copy, sites);
+            break;
+
+        case NodeKind::LtrInsertStmt:
+        case NodeKind::RtlInsertStmt:
+        {
+            // Writing to the console only reads its operands, every other insertion modifies them
+            NodeIndex target = child(ast, stmt, 0);
+            bool console = ast.nodes[target].kind == NodeKind::Identity && ast.bindings[target] == nullptr;
+            ListUse use = console && node.kind == NodeKind::RtlInsertStmt ? ListUse::Read : ListUse::Write;
+            for (size_t i = 0; i < node.count; i++)
+                collect_list_uses(compiler, child(ast, stmt, i), s, use, sites);
+            break;
+        }
+
+        case NodeKind::ReturnStmt:
+            if (node.flags & node_tail_call)
+                collect_tail_call_uses(compiler, stmt, s, sites);
+            else if (node.count > 0)
+                collect_list_uses(compiler, child(ast, stmt, 0), s, ListUse::Return, sites);
+            break;
+
+        case NodeKind::ExprStmt:
+            collect_list_uses(compiler, child(ast, stmt, 0), s, ListUse::Read, sites);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Parameters that are only read can be passed by reference
+    for (size_t i = 0; i < param_count; i++)
+    {
+        NodeIndex param = child(ast, function, i);
+        if (!is_list_variable(ast.bindings[param]))
+            continue;
+
+        bool read_only = true;
+        for (const ListUseSite &site : sites)
+            if (site.var == ast.bindings[param] && site.use != ListUse::Read)
+                read_only = false;
+        if (read_only)
+            ast.nodes[param].flags |= node_by_reference;
+    }
+
+    // Walking backwards, the first read of each variable is its last. It can only be
+    // moved from if nothing else in the same statement mentions the variable.
+    for (const ListUseSite &site : sites)
+        site.var->variable.last_read = UINT32_MAX;
+
+    for (size_t i = sites.size(); i-- > 0;)
+    {
+        const ListUseSite &site = sites[i];
+        Entity *var = site.var;
+        if (ast.nodes[site.node].kind == NodeKind::AssignStmt || ast.nodes[site.node].kind == NodeKind::ReturnStmt)
+            continue; // Overwriting a variable does not read it
+
+        if (var->variable.last_read == UINT32_MAX)
+        {
+            var->variable.last_read = site.stmt;
+            if (site.use == ListUse::Copy)
+                ast.nodes[site.node].flags |= node_move;
+        }
+        else if (var->variable.last_read == site.stmt)
+        {
+            for (size_t j = i + 1; j < sites.size() && sites[j].stmt == site.stmt; j++)
+                if (sites[j].var == var)
+                    ast.nodes[sites[j].node].flags &= ~node_move;
+        }
+    }
+}
+
+void analyse_last_uses(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    vector<ListUseSite> sites;
+    for (size_t i = 0; i < ast.nodes[ast.root].count; i++)
+        analyse_function_last_uses(compiler, child(ast, ast.root, i), sites);
+}
+
+// CODE GENERATION //
+
+// The runtime headers a program needs beyond tiny/list.h, as a bit set, so that
+// generated files only include (and the C++ compiler only parses) what they use
+enum RuntimeHeader : uint8_t
+{
+    header_utility = 1, // std::move
+    header_console = 2,
+    header_memo = 4,
+};
+
+// The state of emitting one run of functions into one emitter. An error is kept
+// until the run is finished rather than reported straight away.
+struct CodeGen
+{
+    Compiler &compiler;
+    Emitter &out;
+
+    bool insert_stmt = false;
+    bool inserting_chars = false;
+    bool in_main = false;
+    NodeIndex function = 0;   // The function being emitted
+    uint32_t temporaries = 0; // Temporaries declared so far in the function being emitted
+    uint8_t headers = 0;      // RuntimeHeader bits for what has been emitted so far
+    vector<uint32_t> literals; // Constants given read-only storage by the function being emitted
+
+    bool failed = false;
+    NodeIndex error_node = 0;
+    string error;
+
+    CodeGen(Compiler &compiler, Emitter &out) : compiler(compiler), out(out) {}
+};
+
+void codegen_error(CodeGen &gen, NodeIndex node, const string msg)
+{
+    if (gen.failed)
+        return;
+    gen.failed = true;
+    gen.error_node = node;
+    gen.error = msg;
+}
+
+void report_codegen_error(CodeGen &gen)
+{
+    if (gen.failed)
+        error_at(gen.compiler, gen.error_node, gen.error);
+}
+
+void emit_expression(CodeGen &gen, NodeIndex node)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+
+    switch (ast.nodes[node].kind)
+    {
+    case NodeKind::Identity:
+    {
+        Entity *dec = ast.bindings[node];
+        if (dec == nullptr)
+        {
+            // The console is only meaningful as the target of an insertion, which emit_insertion handles
+            out << "_ERROR_CONSOLE";
+        }
+        else if (ast.nodes[node].flags & node_move)
+        {
+            out << "std::move(" << dec->c_identity << ")";
+            gen.headers |= header_utility;
+        }
+        else
+        {
+            out << dec->c_identity;
+        }
+        return;
+    }
+
+    case NodeKind::Call:
+    {
+        // A string passed to a function is a list, even when the call's result is written to the console
+        Entity *funct = ast.bindings[node];
+        bool inserting_chars = gen.inserting_chars;
+        gen.inserting_chars = false;
+        out << (funct != nullptr ? funct->c_identity : node_token(gen.compiler, node).str) << "(";
+        for (size_t i = 0; i < ast.nodes[node].count; i++)
+        {
+            if (i > 0)
+                out << ",";
+            emit_expression(gen, child(ast, node, i));
+        }
+        out << ")";
+        gen.inserting_chars = inserting_chars;
+        return;
+    }
+
+    case NodeKind::String:
+    {
+        // The decoded characters are written out again in a form C++ leaves alone
+        tiny::list values = string_literal(gen.compiler, node);
+
+        if (gen.inserting_chars)
+        {
+            out << '"';
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                unsigned char c = (unsigned char)values[i];
+                if (c >= ' ' && c <= '~' && c != '"' && c != '\\')
+                {
+                    out << (char)c;
+                }
+                else if (c == '\n' || c == '\t' || c == '\r' || c == '\\')
+                {
+                    out << (c == '\n' ? "\\n" : c == '\t' ? "\\t" : c == '\r' ? "\\r" : "\\\\");
+                }
+                else
+                {
+                    char octal[] = {'\\', (char)('0' + (c >> 6)), (char)('0' + ((c >> 3) & 7)), (char)('0' + (c & 7))};
+                    out << string_view(octal, sizeof(octal));
+                }
+            }
+            out << '"';
+        }
+        else
+        {
+            // Insertion operands are passed to templates, which cannot deduce a braced list
+            if (gen.insert_stmt)
+                out << "list";
+            out << '{';
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                if (i > 0)
+                    out << ',';
+                out << values[i];
+            }
+            out << '}';
+        }
+        return;
+    }
+
+    case NodeKind::Constant:
+    {
+        const ConstantValue &constant = gen.compiler.constants[ast.nodes[node].first];
+        if (constant.type == TinyType::Value)
+            out << constant.value;
+        else if (constant.type == TinyType::List && constant.list.empty())
+            out << "list()";
+        else if (constant.type == TinyType::List)
+        {
+            size_t literal = std::find(gen.literals.begin(), gen.literals.end(), ast.nodes[node].first) - gen.literals.begin();
+            out << "list(literal" << (int)literal << "_" << ast.bindings[gen.function]->c_identity << ","
+                << (int)constant.list.size() << ")";
+        }
+        return;
+    }
+
+    default:
+        return;
+    }
+}
+
+// The runtime function implementing `a << b` (or `a >> b` when `ltr` is set), if the insertion is valid
+const char *insertion_function(TinyType a, TinyType b, bool ltr)
+{
+    const TinyType V = TinyType::Value, L = TinyType::List;
+    if (a == L && b == V)
+        return ltr ? "pop_back" : "push_back";
+    if (a == V && b == L)
+        return ltr ? "push_front" : "pop_front";
+    if (a == L && b == L)
+        return ltr ? "prepend_all" : "append_all";
+    return nullptr;
+}
+
+// Emits an operand that the runtime may write to, so temporaries have to be passed as lvalues
+void emit_insertion_operand(CodeGen &gen, NodeIndex operand)
+{
+    bool named = gen.compiler.ast.nodes[operand].kind == NodeKind::Identity;
+    if (!named)
+        gen.out << "tiny::lvalue(";
+    emit_expression(gen, operand);
+    if (!named)
+        gen.out << ")";
+}
+
+// Insertions are lowered to one runtime call per operand, each acting on the first
+// operand of the statement. Strings written to the console stay as C++ literals.
+void emit_insertion(CodeGen &gen, NodeIndex stmt, bool ltr)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+    NodeIndex target = child(ast, stmt, 0);
+    TinyType target_type = expression_type(gen.compiler, target);
+
+    gen.insert_stmt = true;
+    if (target_type == TinyType::Console)
+    {
+        gen.headers |= header_console;
+        gen.inserting_chars = !ltr;
+        for (size_t i = 1; i < ast.nodes[stmt].count; i++)
+        {
+            if (i > 1)
+                out << ";";
+            out << (ltr ? "tiny::read(" : "tiny::print(");
+            if (ltr)
+                emit_insertion_operand(gen, child(ast, stmt, i));
+            else
+                emit_expression(gen, child(ast, stmt, i));
+            out << ")";
+        }
+        return;
+    }
+
+    // A target that is not a variable is evaluated once, into a temporary
+    string temporary;
+    if (ast.nodes[target].kind != NodeKind::Identity)
+    {
+        temporary = "tmp" + std::to_string(gen.temporaries++);
+        out << tiny_type_as_c_type(target_type) << " " << temporary << "=";
+        emit_expression(gen, target);
+    }
+
+    for (size_t i = 1; i < ast.nodes[stmt].count; i++)
+    {
+        NodeIndex operand = child(ast, stmt, i);
+        TinyType operand_type = expression_type(gen.compiler, operand);
+        const char *function = insertion_function(target_type, operand_type, ltr);
+        if (function == nullptr)
+        {
+            codegen_error(gen, operand, string("Cannot insert ") + type_name(ltr ? target_type : operand_type) + " into " + type_name(ltr ? operand_type : target_type) + ".");
+            return;
+        }
+
+        if (i > 1 || !temporary.empty())
+            out << ";";
+        out << "tiny::" << function << "(";
+        if (temporary.empty())
+            emit_expression(gen, target);
+        else
+            out << temporary;
+        out << ",";
+        emit_insertion_operand(gen, operand);
+        out << ")";
+    }
+}
+
+// Every argument is evaluated before any parameter is overwritten, as they may read each other
+void emit_tail_call(CodeGen &gen, NodeIndex call)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+    Entity *fun = ast.bindings[call];
+
+    uint32_t first = gen.temporaries;
+    for (size_t i = 0; i < ast.nodes[call].count; i++)
+    {
+        if (passes_through(ast, call, i, fun))
+            continue;
+        out << tiny_type_as_c_type(fun->function.params[i]->variable.type) << " tmp" << std::to_string(gen.temporaries++) << "=";
+        emit_expression(gen, child(ast, call, i));
+        out << ";";
+    }
+
+    uint32_t temporary = first;
+    for (size_t i = 0; i < ast.nodes[call].count; i++)
+    {
+        if (passes_through(ast, call, i, fun))
+            continue;
+        string name = "tmp" + std::to_string(temporary++);
+        if (fun->function.params[i]->variable.type == TinyType::List)
+        {
+            out << fun->function.params[i]->c_identity << "=std::move(" << name << ");";
+            gen.headers |= header_utility;
+        }
+        else
+            out << fun->function.params[i]->c_identity << "=" << name << ";";
+    }
+    out << "continue";
+}
+
+void emit_statement(CodeGen &gen, NodeIndex stmt)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+    const Node &node = ast.nodes[stmt];
+    size_t statement_start = out.buffer.size();
+
+    gen.insert_stmt = false;
+    gen.inserting_chars = false;
+
+    switch (node.kind)
+    {
+    case NodeKind::AssignStmt:
+    {
+        Entity *dec = ast.bindings[stmt];
+        if (node.count > 0 && dec->kind == EntityKind::Variable)
+        {
+            out << dec->c_identity << "=";
+            emit_expression(gen, child(ast, stmt, 0));
+        }
+        break;
+    }
+
+    case NodeKind::LtrInsertStmt:
+    case NodeKind::RtlInsertStmt:
+        emit_insertion(gen, stmt, node.kind == NodeKind::LtrInsertStmt);
+        break;
+
+    case NodeKind::ReturnStmt:
+        if (node.flags & node_tail_call)
+        {
+            emit_tail_call(gen, child(ast, stmt, 0));
+            break;
+        }
+        out << "return";
+        if (node.count > 0)
+        {
+            out << " ";
+            emit_expression(gen, child(ast, stmt, 0));
+        }
+        break;
+
+    case NodeKind::ExprStmt:
+        emit_expression(gen, child(ast, stmt, 0));
+        break;
+
+    default:
+        break;
+    }
+
+    if (out.buffer.size() > statement_start)
+        out << ';';
+}
+
+void emit_statement_block(CodeGen &gen, NodeIndex block)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+
+    out << '{';
+
+    for (Entity *var = ast.bindings[block]; var != nullptr; var = var->next_in_scope)
+    {
+        if (var->kind != EntityKind::Variable)
+            continue;
+
+        out
+            << tiny_type_as_c_type(var->variable.type)
+            << " "
+            << var->c_identity
+            << ";";
+    }
+
+    for (size_t i = 0; i < ast.nodes[block].count; i++)
+        emit_statement(gen, child(ast, block, i));
+
+    if (gen.in_main)
+        out << "return 0;";
+
+    out << '}';
+}
+
+void emit_signature(CodeGen &gen, NodeIndex function, string_view name)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+    Entity *fun = ast.bindings[function];
+
+    // FIXME: Determine what the correct behaviour when generating the main function should actually be.
+    out
+        << (gen.in_main ? "int" : tiny_type_as_c_type(fun->function.return_type))
+        << " "
+        << name
+        << "(";
+
+    size_t param_count = ast.nodes[function].count - 1;
+    for (size_t i = 0; i < param_count; i++)
+    {
+        NodeIndex param_node = child(ast, function, i);
+        Entity *param = ast.bindings[param_node];
+        if (i > 0)
+            out << ",";
+        if (ast.nodes[param_node].flags & node_by_reference)
+            out << "const ";
+        out
+            << tiny_type_as_c_type(param->variable.type)
+            << ((ast.nodes[param_node].flags & node_by_reference) ? "& " : " ")
+            << param->c_identity;
+    }
+
+    out << ")";
+}
+
+void find_literals(CodeGen &gen, NodeIndex node)
+{
+    const Ast &ast = gen.compiler.ast;
+    const Node &n = ast.nodes[node];
+    if (n.kind == NodeKind::Constant)
+    {
+        const ConstantValue &constant = gen.compiler.constants[n.first];
+        if (constant.type == TinyType::List && !constant.list.empty() &&
+            std::find(gen.literals.begin(), gen.literals.end(), n.first) == gen.literals.end())
+            gen.literals.push_back(n.first);
+        return;
+    }
+    for (size_t i = 0; i < n.count; i++)
+        find_literals(gen, child(ast, node, i));
+}
+
+// Constant lists are kept in read-only storage and copied into lists where they are used.
+// Each function defines the ones it uses just before it, numbered in the order they
+// appear, so that its code only depends on itself and the functions it calls.
+void emit_literals(CodeGen &gen, NodeIndex function)
+{
+    Emitter &out = gen.out;
+    gen.literals.clear();
+    find_literals(gen, function);
+    for (size_t i = 0; i < gen.literals.size(); i++)
+    {
+        const tiny::list &list = gen.compiler.constants[gen.literals[i]].list;
+        out << "static constexpr int literal" << (int)i << "_" << gen.compiler.ast.bindings[function]->c_identity << "[]={";
+        for (size_t j = 0; j < list.size(); j++)
+        {
+            if (j > 0)
+                out << ',';
+            out << list[j];
+        }
+        out << "};";
+    }
+}
+
+void emit_function(CodeGen &gen, NodeIndex function)
+{
+    Ast &ast = gen.compiler.ast;
+    Emitter &out = gen.out;
+    Entity *fun = ast.bindings[function];
+    gen.in_main = fun->symbol == symbol_main;
+    gen.function = function;
+    gen.temporaries = 0;
+    emit_literals(gen, function);
+
+    // A memoized function's body is emitted under another name, behind a wrapper that
+    // looks up its arguments in a cache. Recursive calls go through the wrapper too.
+    bool memoized = gen.compiler.memoize && memoizable(fun);
+    if (memoized)
+    {
+        emit_signature(gen, function, fun->c_identity);
+        out << ";";
+    }
+
+    emit_signature(gen, function, memoized ? string(fun->identity) + "_uncached" : string(fun->c_identity));
+    size_t param_count = ast.nodes[function].count - 1;
+    // The body of a function ending in a tail call is a loop, which redeclares its variables each time round
+    if (ast.nodes[function].flags & node_tail_call)
+    {
+        out << "{for(;;)";
+        emit_statement_block(gen, child(ast, function, param_count));
+        out << "}";
+    }
+    else
+    {
+        emit_statement_block(gen, child(ast, function, param_count));
+    }
+
+    if (memoized)
+    {
+        emit_signature(gen, function, fun->c_identity);
+        gen.headers |= header_memo;
+        out << "{static tiny::memo<" << (int)param_count << "> cache;const int args[]={";
+        for (size_t i = 0; i < param_count; i++)
+            out << (i > 0 ? "," : "") << fun->function.params[i]->c_identity;
+        out << "};auto &entry=cache.lookup(args);if(!cache.holds(entry,args))cache.store(entry,args,"
+            << fun->identity << "_uncached(";
+        for (size_t i = 0; i < param_count; i++)
+            out << (i > 0 ? "," : "") << fun->function.params[i]->c_identity;
+        out << "));return entry.result;}";
+    }
+}
+
+// Functions are emitted in blocks of this many, each into an emitter of its own
+constexpr size_t emit_block_size = 64;
+
+// Each function's code ends up in a piece of the output of its own, and the runtime
+// headers it needs are recorded separately, so that watch mode can replace single functions
+void emit_function_piece(CodeGen &gen, NodeIndex function, uint8_t &headers)
+{
+    uint8_t before = gen.headers;
+    gen.headers = 0;
+    emit_function(gen, function);
+    close_run(gen.out);
+    headers = gen.headers;
+    gen.headers |= before;
+}
+
+// With --jobs, blocks of functions are handed out to the worker threads in program
+// order as each thread finishes its last one. Emitting a function only reads the syntax
+// tree and its entities, so the threads share nothing but the counter. The blocks are
+// then spliced into the output in program order, so the result is identical to a serial
+// run, and the error reported is the first one in the program rather than the first found.
+void emit_program(Compiler &compiler)
+{
+    Ast &ast = compiler.ast;
+    Emitter &out = *compiler.out;
+    close_run(out);
+
+    size_t function_count = ast.nodes[ast.root].count;
+    compiler.function_headers.assign(function_count, 0);
+    size_t block_count = (function_count + emit_block_size - 1) / emit_block_size;
+    size_t thread_count = std::min<size_t>(compiler.threads, block_count);
+    if (thread_count <= 1)
+    {
+        CodeGen gen(compiler, out);
+        for (size_t i = 0; i < function_count; i++)
+            emit_function_piece(gen, child(ast, ast.root, i), compiler.function_headers[i]);
+        compiler.runtime_headers = gen.headers;
+        report_codegen_error(gen);
+        return;
+    }
+
+    vector<Emitter> blocks(block_count);
+    vector<CodeGen> gens;
+    gens.reserve(block_count);
+    for (Emitter &block : blocks)
+        gens.emplace_back(compiler, block);
+
+    std::atomic<size_t> next_block{0};
+    auto work = [&]()
+    {
+        for (size_t b = next_block++; b < block_count; b = next_block++)
+        {
+            size_t last = std::min(function_count, (b + 1) * emit_block_size);
+            for (size_t i = b * emit_block_size; i < last; i++)
+                emit_function_piece(gens[b], child(ast, ast.root, i), compiler.function_headers[i]);
+        }
+    };
+
+    vector<std::thread> workers;
+    for (size_t t = 1; t < thread_count; t++)
+        workers.emplace_back(work);
+    work();
+    for (std::thread &worker : workers)
+        worker.join();
+
+    for (Emitter &block : blocks)
+        splice(out, block);
+    compiler.runtime_headers = 0;
+    for (const CodeGen &gen : gens)
+        compiler.runtime_headers |= gen.headers;
+    for (CodeGen &gen : gens)
+    {
+        if (gen.failed)
+        {
+            report_codegen_error(gen);
+            return;
+        }
+    }
+}
+
+// PASS MANAGER //
+
+const Pass passes[] = {
+    {"parse", parse_program, false, target_all, "build the syntax tree"},
+    {"resolve", resolve_program, false, target_all, "bind names to entities"},
+    {"types", infer_types, false, target_all, "infer the types of variables and functions"},
+    {"purity", analyse_purity, false, target_all, "find the functions that never touch the console"},
+    {"unreachable", remove_unreachable_statements, true, target_all, "remove statements after a return"},
+    {"inline", inline_calls, true, target_all, "replace calls to small functions with their bodies"},
+    {"const-eval", evaluate_constants, true, target_all, "evaluate calls with constant arguments at compile time"},
+    {"cse", eliminate_common_calls, true, target_all, "reuse the results of repeated pure calls"},
+    {"pure-statements", remove_pure_statements, true, target_all, "remove statements that have no effect"},
+    {"tail-calls", eliminate_tail_calls, true, target_all, "turn functions that end by calling themselves into loops"},
+    {"last-use", analyse_last_uses, true, target_cpp, "move lists at their last use and pass read-only list parameters by reference"},
+    {"emit", emit_program, false, target_cpp, "generate C++"},
+};
+
+const size_t pass_count = sizeof(passes) / sizeof(passes[0]);
+
+const Pass *find_pass(string_view name)
+{
+    for (const Pass &pass : passes)
+        if (name == pass.name)
+            return &pass;
+    return nullptr;
+}
+
+bool pass_enabled(const Compiler &compiler, const Pass &pass)
+{
+    for (const string &name : compiler.disabled_passes)
+        if (name == pass.name)
+            return false;
+    return true;
+}
+
+void compile_program(Compiler &compiler, Emitter &program, Target target)
+{
+    compiler.out = &program;
+
+    for (const Pass &pass : passes)
+    {
+        if (!(pass.targets & target) || !pass_enabled(compiler, pass))
+            continue;
+
+        PhaseTimer timer(compiler.stats, pass.name);
+        pass.run(compiler);
+    }
+}
+
+string program_prelude(uint8_t runtime_headers)
+{
+    // tiny/list.h always comes first, so that a precompiled copy of it can be used
+    string prelude = "#include \"tiny/list.h\"\n";
+    if (runtime_headers & header_console)
+        prelude += "#include \"tiny/console.h\"\n";
+    if (runtime_headers & header_memo)
+        prelude += "#include \"tiny/memo.h\"\n";
+    if (runtime_headers & header_utility)
+        prelude += "#include <utility>\n";
+    prelude += "using value = int;\n"
+               "using list = tiny::list;\n";
+    return prelude;
+}
+
+void write_program(Compiler &compiler, Emitter &program, const string &out_path)
+{
+    string prelude = program_prelude(compiler.runtime_headers);
+    size_t length = finish(program);
+    if (!write_emitter(program, prelude, out_path))
+    {
+        error(compiler, "Output file " + out_path + " could not be loaded");
+        return;
+    }
+    compiler.stats.bytes_emitted = prelude.length() + length;
+}
+
+// LIBRARY //
+
+// The API declared in tinyc.h. Each context has an interner of its own, so contexts
+// share no state, and keeps its arena and the buffer its sources are copied into from
+// one compilation to the next, as the lexer needs them to be null terminated.
+
+struct ContextState
+{
+    Interner interner;
+    Arena arena;
+    string source;
+};
+
+class StringSink : public OutputSink
+{
+public:
+    explicit StringSink(string &out) : out(out) {}
+    void write(const char *data, size_t length) override { out.append(data, length); }
+
+private:
+    string &out;
+};
+
+Context::Context() : state(std::make_unique<ContextState>()) {}
+
+Context::~Context() = default;
+
+CompileResult Context::compile(string_view source, OutputSink &output, const CompileOptions &options)
+{
+    CompileResult result;
+    for (const string &name : options.disabled_passes)
+    {
+        const Pass *pass = find_pass(name);
+        if (pass == nullptr || !pass->optional)
+        {
+            result.diagnostics.push_back({0, "Cannot disable pass " + name});
+            return result;
+        }
+    }
+
+    state->source.assign(source.data(), source.size());
+    Lexer lexer(&state->source, &state->interner);
+    lexer.diagnostics.echo = nullptr;
+    while (!lexer.finished)
+        next_token(lexer);
+
+    state->arena.reset();
+    Compiler compiler(&lexer, state->arena);
+    compiler.disabled_passes = options.disabled_passes;
+    compiler.memoize = options.memoize;
+    compiler.threads = std::max<size_t>(1, options.threads);
+    Emitter program;
+    compile_program(compiler, program);
+
+    result.diagnostics = std::move(lexer.diagnostics.errors);
+    result.succeeded = result.diagnostics.empty();
+    if (!result.succeeded)
+        return result;
+
+    string prelude = program_prelude(compiler.runtime_headers);
+    finish(program);
+    output.write(prelude.data(), prelude.size());
+    for (const EmitterPiece &piece : program.pieces)
+        output.write(piece.buffer->data() + piece.offset, piece.length);
+    return result;
+}
+
+CompileResult Context::compile(string_view source, string &cpp, const CompileOptions &options)
+{
+    string out;
+    StringSink sink(out);
+    CompileResult result = compile(source, sink, options);
+    if (result.succeeded)
+        cpp.swap(out);
+    return result;
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// The tiny compiler as a library, for compiling programs to C++ inside another
+// process. Build compiler/tinyc.cpp, which leaves out the command line (in main.cpp)
+// and its heap accounting, and link it with the runtime's list.cpp and error.cpp.
+//
+// A context holds everything a compilation needs, including its own table of names,
+// so compilations in different contexts share nothing and can run on different
+// threads at once. Each context compiles one program at a time.
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tinyc
+{
+
+struct Diagnostic
+{
+    size_t line;
+    std::string message;
+};
+
+struct CompileOptions
+{
+    bool memoize = false;                     // Cache the results of memoizable functions
+    size_t threads = 1;                       // Threads generating C++
+    std::vector<std::string> disabled_passes; // Optional passes to skip, by name
+};
+
+struct CompileResult
+{
+    bool succeeded = false;
+    std::vector<Diagnostic> diagnostics;
+};
+
+// Receives the generated C++ a piece at a time, in order
+class OutputSink
+{
+public:
+    virtual ~OutputSink() = default;
+    virtual void write(const char *data, size_t length) = 0;
+};
+
+struct ContextState;
+
+class Context
+{
+public:
+    Context();
+    ~Context();
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    // Compiles a program, passing its C++ to `output` only if it compiles
+    CompileResult compile(std::string_view source, OutputSink &output, const CompileOptions &options = {});
+
+    // Compiles a program, replacing the contents of `cpp` with its C++ if it compiles
+    CompileResult compile(std::string_view source, std::string &cpp, const CompileOptions &options = {});
+
+private:
+    std::unique_ptr<ContextState> state;
+};
+
+}
@@ -0,0 +1,257 @@
+#include "console.h"
+#include "simd.h"
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#define TINY_CONSOLE_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tiny
+{
+
+static bool is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+class console_output
+{
+public:
+    static constexpr size_t capacity = 1 << 16;
+
+    console_output() { before_runtime_error = tiny::flush; }
+    console_output(const console_output &) = delete;
+    console_output &operator=(const console_output &) = delete;
+    ~console_output() { flush(); }
+
+    void write(const char *data, size_t size)
+    {
+        if (size > capacity - used_)
+        {
+            flush();
+            if (size >= capacity)
+            {
+                write_all(data, size);
+                return;
+            }
+        }
+        std::memcpy(buffer_ + used_, data, size);
+        used_ += size;
+    }
+
+    // Makes room for up to `capacity` characters, which are written directly into the buffer and then committed
+    char *reserve(size_t size)
+    {
+        if (size > capacity - used_)
+            flush();
+        return buffer_ + used_;
+    }
+
+    void commit(size_t size) { used_ += size; }
+
+    void flush()
+    {
+        write_all(buffer_, used_);
+        used_ = 0;
+    }
+
+private:
+    static void write_all(const char *data, size_t size)
+    {
+#if defined(TINY_CONSOLE_POSIX)
+        while (size > 0)
+        {
+            ssize_t written = ::write(STDOUT_FILENO, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            data += written;
+            size -= (size_t)written;
+        }
+#else
+        std::fwrite(data, 1, size, stdout);
+        std::fflush(stdout);
+#endif
+    }
+
+    char buffer_[capacity];
+    size_t used_ = 0;
+};
+
+class console_input
+{
+public:
+    static constexpr size_t capacity = 1 << 16;
+
+    console_input() = default;
+    console_input(const console_input &) = delete;
+    console_input &operator=(const console_input &) = delete;
+
+    ~console_input()
+    {
+#if defined(TINY_CONSOLE_POSIX)
+        if (mapped_ != nullptr)
+            munmap(mapped_, mapped_size_);
+#endif
+    }
+
+    // The next character, or -1 at the end of the input
+    int peek()
+    {
+        if (pos_ == end_ && !fill())
+            return -1;
+        return (unsigned char)*pos_;
+    }
+
+    void skip() { pos_++; }
+
+    // Adds the characters up to the next space or the end of the input to the list,
+    // a whole buffered run at a time
+    void read_word(list &word)
+    {
+        while (pos_ != end_ || fill())
+        {
+            const char *start = pos_;
+            while (pos_ != end_ && !is_space((unsigned char)*pos_))
+                pos_++;
+            word.append_chars(start, (size_t)(pos_ - start));
+            if (pos_ != end_)
+                return;
+        }
+    }
+
+private:
+    bool fill()
+    {
+        if (finished_)
+            return false;
+
+#if defined(TINY_CONSOLE_POSIX)
+        if (!started_)
+        {
+            started_ = true;
+            struct stat info;
+            off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            if (fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode) && offset >= 0 && info.st_size > offset)
+            {
+                void *mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+                if (mapped != MAP_FAILED)
+                {
+                    mapped_ = mapped;
+                    mapped_size_ = (size_t)info.st_size;
+                    pos_ = (const char *)mapped + offset;
+                    end_ = (const char *)mapped + info.st_size;
+                    finished_ = true;
+                    return true;
+                }
+            }
+        }
+#endif
+
+        // Anything written so far (such as a prompt) should be visible before waiting for input
+        tiny::flush();
+
+#if defined(TINY_CONSOLE_POSIX)
+        ssize_t size;
+        do
+            size = ::read(STDIN_FILENO, buffer_, capacity);
+        while (size < 0 && errno == EINTR);
+#else
+        size_t size = std::fread(buffer_, 1, capacity, stdin);
+#endif
+        if (size <= 0)
+        {
+            finished_ = true;
+            return false;
+        }
+        pos_ = buffer_;
+        end_ = buffer_ + size;
+        return true;
+    }
+
+    const char *pos_ = nullptr;
+    const char *end_ = nullptr;
+    bool started_ = false;
+    bool finished_ = false;
+    void *mapped_ = nullptr;
+    size_t mapped_size_ = 0;
+    char buffer_[capacity];
+};
+
+static console_output console_out;
+static console_input console_in;
+
+void flush() { console_out.flush(); }
+
+void print_chars(const char *text, size_t size) { console_out.write(text, size); }
+
+void print(int value)
+{
+    char *out = console_out.reserve(16);
+    console_out.commit((size_t)(std::to_chars(out, out + 16, value).ptr - out));
+}
+
+void print(const list &l)
+{
+    size_t start = 0;
+    while (start < l.size())
+    {
+        size_t length;
+        const int *values = l.run(start, length);
+        start += length;
+        while (length > 0)
+        {
+            size_t chunk = length < console_output::capacity ? length : console_output::capacity;
+            simd::narrow(console_out.reserve(chunk), values, chunk);
+            console_out.commit(chunk);
+            values += chunk;
+            length -= chunk;
+        }
+    }
+}
+
+static void skip_spaces()
+{
+    while (is_space(console_in.peek()))
+        console_in.skip();
+}
+
+void read(int &value)
+{
+    skip_spaces();
+    bool negative = false;
+    int c = console_in.peek();
+    if (c == '-' || c == '+')
+    {
+        negative = c == '-';
+        console_in.skip();
+        c = console_in.peek();
+    }
+
+    unsigned n = 0;
+    while (c >= '0' && c <= '9')
+    {
+        n = n * 10 + (unsigned)(c - '0');
+        console_in.skip();
+        c = console_in.peek();
+    }
+    value = (int)(negative ? 0u - n : n);
+}
+
+void read(list &l)
+{
+    skip_spaces();
+    list word;
+    console_in.read_word(word);
+    l.prepend(word);
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+// Console input and output for generated programs. Output is gathered in one
+// large buffer, which is written out when it fills, before the program waits
+// for input, and at exit. Input is read in large blocks, or mapped straight into
+// memory when it comes from a file. The buffers live in console.cpp, part of the
+// runtime library.
+
+#include "list.h"
+#include <cstddef>
+
+namespace tiny
+{
+
+void flush();
+
+void print_chars(const char *text, size_t size);
+
+// console << value
+void print(int value);
+
+// console << "text", copied into the buffer in one go
+template <size_t N>
+inline void print(const char (&text)[N])
+{
+    print_chars(text, N - 1);
+}
+
+// console << list, written as characters
+void print(const list &l);
+
+// console >> value reads a number, or 0 if the input does not start with one
+void read(int &value);
+
+// console >> list adds one word to the front of the list
+void read(list &l);
+
+}
@@ -0,0 +1,19 @@
+#include "error.h"
+#include <cstdio>
+#include <cstdlib>
+
+namespace tiny
+{
+
+void (*before_runtime_error)() = nullptr;
+
+void runtime_error(const char *msg)
+{
+    if (before_runtime_error != nullptr)
+        before_runtime_error();
+    std::fflush(stdout);
+    std::printf("Runtime error: %s\n", msg);
+    std::exit(1);
+}
+
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Runtime errors end the program after reporting what went wrong.
+
+namespace tiny
+{
+
+// Called before an error is reported, so that output buffered by the runtime comes first
+extern void (*before_runtime_error)();
+
+[[noreturn]] void runtime_error(const char *msg);
+
+}
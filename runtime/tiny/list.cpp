@@ -0,0 +1,145 @@
+#include "list.h"
+#include "simd.h"
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+namespace tiny
+{
+
+list::list(const int *values, size_t count)
+{
+    reserve(count);
+    if (count > 0)
+        std::memcpy(data_, values, count * sizeof(int));
+    size_ = count;
+}
+
+list::list(const list &other)
+{
+    reserve(other.size_);
+    other.copy_out(data_, 0, other.size_);
+    size_ = other.size_;
+}
+
+list &list::operator=(const list &other)
+{
+    if (this != &other)
+    {
+        clear();
+        reserve(other.size_);
+        other.copy_out(data_, 0, other.size_);
+        size_ = other.size_;
+    }
+    return *this;
+}
+
+list &list::operator=(list &&other) noexcept
+{
+    if (this != &other)
+    {
+        list discarded(std::move(*this));
+        swap(other);
+    }
+    return *this;
+}
+
+list::~list() { std::free(data_); }
+
+void list::swap(list &other) noexcept
+{
+    std::swap(data_, other.data_);
+    std::swap(head_, other.head_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+}
+
+void list::grow(size_t count)
+{
+    size_t capacity = capacity_ == 0 ? 8 : capacity_;
+    while (capacity < count)
+        capacity *= 2;
+
+    int *data = static_cast<int *>(std::malloc(capacity * sizeof(int)));
+    if (data == nullptr)
+        runtime_error("out of memory");
+    copy_out(data, 0, size_);
+    std::free(data_);
+    data_ = data;
+    head_ = 0;
+    capacity_ = capacity;
+}
+
+void list::append(list &from)
+{
+    if (&from == this)
+        return;
+    if (from.size_ > size_ && from.capacity_ >= size_ + from.size_)
+    {
+        from.head_ = (from.head_ - size_) & (from.capacity_ - 1);
+        from.copy_in(0, *this);
+        from.size_ += size_;
+        swap(from);
+        from.clear();
+        return;
+    }
+
+    reserve(size_ + from.size_);
+    copy_in(size_, from);
+    size_ += from.size_;
+    from.clear();
+}
+
+void list::prepend(list &from)
+{
+    if (&from == this)
+        return;
+    if (from.size_ > size_ && from.capacity_ >= size_ + from.size_)
+    {
+        from.copy_in(from.size_, *this);
+        from.size_ += size_;
+        swap(from);
+        from.clear();
+        return;
+    }
+
+    reserve(size_ + from.size_);
+    head_ = (head_ - from.size_) & (capacity_ - 1);
+    copy_in(0, from);
+    size_ += from.size_;
+    from.clear();
+}
+
+void list::append_chars(const char *chars, size_t count)
+{
+    if (count == 0)
+        return;
+    reserve(size_ + count);
+    size_t first = (head_ + size_) & (capacity_ - 1);
+    size_t run = capacity_ - first < count ? capacity_ - first : count;
+    simd::widen(data_ + first, chars, run);
+    simd::widen(data_, chars + run, count - run);
+    size_ += count;
+}
+
+void list::copy_out(int *out, size_t start, size_t count) const
+{
+    if (count == 0)
+        return;
+    size_t first = (head_ + start) & (capacity_ - 1);
+    size_t run = capacity_ - first < count ? capacity_ - first : count;
+    std::memcpy(out, data_ + first, run * sizeof(int));
+    std::memcpy(out + run, data_, (count - run) * sizeof(int));
+}
+
+void list::copy_in(size_t start, const list &from)
+{
+    if (from.size_ == 0)
+        return;
+    size_t first = (head_ + start) & (capacity_ - 1);
+    size_t run = capacity_ - first < from.size_ ? capacity_ - first : from.size_;
+    from.copy_out(data_ + first, 0, run);
+    from.copy_out(data_, run, from.size_ - run);
+}
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// Runtime support for tiny's list type, used by generated C++ and by the
+// compiler's virtual machine. A list is a growable ring buffer, so values can
+// be pushed and popped at either end in constant time, and splicing one list
+// onto either end of another costs at most one copy of the source.
+//
+// Only the operations on the fast path of an insertion are defined here; the
+// rest are in list.cpp, part of the runtime library, so that generated code has
+// as little as possible to parse.
+
+#include "error.h"
+#include <cstddef>
+#include <initializer_list>
+
+namespace tiny
+{
+
+class list
+{
+public:
+    list() noexcept = default;
+    list(const int *values, size_t count);
+    list(std::initializer_list<int> values) : list(values.begin(), values.size()) {}
+    list(const list &other);
+    list(list &&other) noexcept { swap(other); }
+    list &operator=(const list &other);
+    list &operator=(list &&other) noexcept;
+    ~list();
+
+    void swap(list &other) noexcept;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    int operator[](size_t i) const { return data_[(head_ + i) & (capacity_ - 1)]; }
+    int &operator[](size_t i) { return data_[(head_ + i) & (capacity_ - 1)]; }
+
+    void clear()
+    {
+        head_ = 0;
+        size_ = 0;
+    }
+
+    // Capacities are always powers of two so that wrapping around is a mask
+    void reserve(size_t count)
+    {
+        if (count > capacity_)
+            grow(count);
+    }
+
+    void push_back(int value)
+    {
+        reserve(size_ + 1);
+        data_[(head_ + size_) & (capacity_ - 1)] = value;
+        size_++;
+    }
+
+    void push_front(int value)
+    {
+        reserve(size_ + 1);
+        head_ = (head_ - 1) & (capacity_ - 1);
+        data_[head_] = value;
+        size_++;
+    }
+
+    int pop_back()
+    {
+        if (size_ == 0)
+            runtime_error("cannot pop from an empty list");
+        size_--;
+        return data_[(head_ + size_) & (capacity_ - 1)];
+    }
+
+    int pop_front()
+    {
+        if (size_ == 0)
+            runtime_error("cannot pop from an empty list");
+        int value = data_[head_];
+        head_ = (head_ + 1) & (capacity_ - 1);
+        size_--;
+        return value;
+    }
+
+    // Moves every value of `from` onto the end of this list, leaving `from` empty.
+    // If `from` is the larger list and has room for both, this list's values are
+    // copied into its buffer instead, which is then taken over.
+    void append(list &from);
+
+    // Moves every value of `from` onto the front of this list, leaving `from` empty,
+    // taking over the buffer of `from` in the same way as append()
+    void prepend(list &from);
+
+    // Adds characters to the end of the list as values from 0 to 255. The buffer wraps
+    // around at most once, so this converts at most two contiguous runs.
+    void append_chars(const char *chars, size_t count);
+
+    // Copies `count` values starting at position `start` into a flat array
+    void copy_out(int *out, size_t start, size_t count) const;
+
+    // The values from position `start` up to the end of the list or the point where the
+    // buffer wraps around, whichever comes first
+    const int *run(size_t start, size_t &length) const
+    {
+        size_t first = (head_ + start) & (capacity_ - 1);
+        length = capacity_ - first < size_ - start ? capacity_ - first : size_ - start;
+        return data_ + first;
+    }
+
+private:
+    void grow(size_t count);
+
+    // Copies all of `from` into this list's storage starting at position `start`
+    void copy_in(size_t start, const list &from);
+
+    int *data_ = nullptr;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
+
+// The insertion operators, one function per valid row of the table in documentation.md.
+// Generated code passes temporaries through lvalue() so every operand can be written to.
+
+template <class T>
+T &lvalue(T &&value) { return value; }
+
+inline void push_back(list &a, int b) { a.push_back(b); }      // list << value
+inline void pop_front(int &a, list &b) { a = b.pop_front(); }  // value << list
+inline void append_all(list &a, list &b) { a.append(b); }      // list << list
+inline void push_front(int a, list &b) { b.push_front(a); }    // value >> list
+inline void pop_back(list &a, int &b) { b = a.pop_back(); }    // list >> value
+inline void prepend_all(list &a, list &b) { b.prepend(a); }    // list >> list
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+// A small cache for the results of pure functions, used by generated code when
+// the compiler is run with --memoize. Each function gets one fixed-size table
+// indexed by a hash of its arguments; a colliding call simply replaces the
+// entry that was there, so the table never grows.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tiny
+{
+
+template <size_t Arity, size_t Size = 256>
+class memo
+{
+    static_assert((Size & (Size - 1)) == 0, "memo tables must have a power of two size");
+
+public:
+    struct entry
+    {
+        bool used;
+        int args[Arity];
+        int result;
+    };
+
+    // The only entry that could hold a result for `args`
+    entry &lookup(const int *args)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < Arity; i++)
+            hash = (hash ^ (uint32_t)args[i]) * 16777619u;
+        return entries_[(hash ^ (hash >> 16)) & (Size - 1)];
+    }
+
+    bool holds(const entry &e, const int *args) const
+    {
+        if (!e.used)
+            return false;
+        for (size_t i = 0; i < Arity; i++)
+            if (e.args[i] != args[i])
+                return false;
+        return true;
+    }
+
+    void store(entry &e, const int *args, int result)
+    {
+        e.used = true;
+        for (size_t i = 0; i < Arity; i++)
+            e.args[i] = args[i];
+        e.result = result;
+    }
+
+private:
+    entry entries_[Size] = {};
+};
+
+}
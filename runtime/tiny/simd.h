@@ -0,0 +1,130 @@
+#pragma once
+
+// Conversions between list values and characters, used whenever a list is read
+// from or written to the console. On x86-64 these use SSE2, which every such
+// processor has, or AVX2 when the processor running the program supports it.
+// Characters widen to values from 0 to 255, and values narrow to their low byte.
+
+#include <cstddef>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TINY_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace tiny
+{
+namespace simd
+{
+
+inline void narrow_scalar(char *out, const int *values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = (char)values[i];
+}
+
+inline void widen_scalar(int *out, const char *chars, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        out[i] = (unsigned char)chars[i];
+}
+
+#if defined(TINY_SIMD_X86)
+
+// Values are masked to their low byte first, so that the saturating packs keep them unchanged
+inline void narrow_sse2(char *out, const int *values, size_t count)
+{
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i)), low_byte);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i + 4)), low_byte);
+        __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i + 8)), low_byte);
+        __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i + 12)), low_byte);
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i *)(out + i), bytes);
+    }
+    narrow_scalar(out + i, values + i, count - i);
+}
+
+inline void widen_sse2(int *out, const char *chars, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(chars + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(low, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(low, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(high, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(high, zero));
+    }
+    widen_scalar(out + i, chars + i, count - i);
+}
+
+// The packs work within each 128-bit half, so the result's 4-byte groups are put back in order at the end
+__attribute__((target("avx2"))) inline void narrow_avx2(char *out, const int *values, size_t count)
+{
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(values + i)), low_byte);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(values + i + 8)), low_byte);
+        __m256i c = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(values + i + 16)), low_byte);
+        __m256i d = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(values + i + 24)), low_byte);
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    narrow_sse2(out + i, values + i, count - i);
+}
+
+__attribute__((target("avx2"))) inline void widen_avx2(int *out, const char *chars, size_t count)
+{
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i *)(chars + i));
+        __m128i high = _mm_loadu_si128((const __m128i *)(chars + i + 16));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepu8_epi32(low));
+        _mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+        _mm256_storeu_si256((__m256i *)(out + i + 16), _mm256_cvtepu8_epi32(high));
+        _mm256_storeu_si256((__m256i *)(out + i + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)));
+    }
+    widen_sse2(out + i, chars + i, count - i);
+}
+
+inline bool has_avx2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+inline void narrow(char *out, const int *values, size_t count)
+{
+    if (has_avx2())
+        narrow_avx2(out, values, count);
+    else
+        narrow_sse2(out, values, count);
+}
+
+inline void widen(int *out, const char *chars, size_t count)
+{
+    if (has_avx2())
+        widen_avx2(out, chars, count);
+    else
+        widen_sse2(out, chars, count);
+}
+
+#else
+
+inline void narrow(char *out, const int *values, size_t count) { narrow_scalar(out, values, count); }
+inline void widen(int *out, const char *chars, size_t count) { widen_scalar(out, chars, count); }
+
+#endif
+
+}
+}
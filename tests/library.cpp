@@ -0,0 +1,47 @@
+// Compiles each file given with the compiler library, every file on a thread and in a
+// context of its own, writing the C++ for <name>.tiny to <dir>/<name>.cpp, or its
+// errors to <dir>/<name>.errors
+//
+//   library <dir> <file>...
+
+#include "../compiler/tinyc.h"
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+void compile(const std::string &dir, const std::string &path)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    tinyc::Context context;
+    std::string cpp;
+    tinyc::CompileResult result = context.compile(source, cpp);
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    name = name.substr(0, name.rfind(".tiny"));
+    if (result.succeeded)
+    {
+        std::ofstream(dir + "/" + name + ".cpp", std::ios::out | std::ios::binary) << cpp;
+        return;
+    }
+    std::ofstream errors(dir + "/" + name + ".errors");
+    for (const tinyc::Diagnostic &diagnostic : result.diagnostics)
+        errors << "Error on line " << diagnostic.line << ": " << diagnostic.message << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return 1;
+
+    std::vector<std::thread> threads;
+    for (int i = 2; i < argc; i++)
+        threads.emplace_back(compile, argv[1], argv[i]);
+    for (std::thread &thread : threads)
+        thread.join();
+    return 0;
+}
@@ -0,0 +1,608 @@
+#!/bin/bash
+# Checks that every mode of the compiler agrees with compiling a program the default
+# way. Builds the compiler into tests/local, and runs it from tests/, so sources are
+# named relative to the repository as usual.
+#
+#   tests/run.sh [check]...
+#
+# runs the named checks, or all of them. $CXX is the C++ compiler to use.
+
+cd "$(dirname "$0")" || exit 1
+CXX=${CXX:-c++}
+TINY=local/tiny
+failures=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+build_compiler()
+{
+    mkdir -p local/runtime
+    $CXX -std=c++17 -O2 -o $TINY ../compiler/main.cpp ../compiler/tinyc.cpp ../runtime/tiny/list.cpp ../runtime/tiny/error.cpp || exit 1
+    local src
+    for src in ../runtime/tiny/*.cpp; do
+        $CXX -std=c++17 -O2 -c "$src" -o "local/runtime/$(basename "$src" .cpp).o" || exit 1
+    done
+    rm -f local/libtiny.a
+    ar rcs local/libtiny.a local/runtime/*.o || exit 1
+}
+
+# Every program in cases/, each with the input in <name>.in, if there is one, and the
+# output the default pipeline gives it in <name>.out
+cases()
+{
+    local src
+    for src in cases/*.tiny; do
+        basename "$src" .tiny
+    done
+}
+
+# Runs a command on a case's input, writing what it prints and its exit status to `out`
+run_case()
+{
+    local name=$1 out=$2
+    shift 2
+    local input=/dev/null
+    [ -f cases/$name.in ] && input=cases/$name.in
+    "$@" < $input > $out 2>&1
+    echo "exit $?" >> $out
+}
+
+# Compiles a case to C++ with the given options, builds it against the runtime library
+# and runs it, writing what it prints and its exit status to `out`
+run_cpp()
+{
+    local name=$1 out=$2
+    shift 2
+    rm -f local/output.cpp local/program
+    if ! $TINY tests/cases/$name.tiny "$@" > local/compile.log || grep -q Error local/compile.log; then
+        cat local/compile.log > $out
+        return
+    fi
+    if ! $CXX -std=c++17 -O2 -I ../runtime local/output.cpp local/libtiny.a -o local/program 2> $out; then
+        return
+    fi
+    run_case $name $out local/program
+}
+
+# Fails unless `out` holds what the case should print, as run with `how`
+expect_output()
+{
+    local name=$1 out=$2 how=$3
+    if ! cmp -s cases/$name.out $out; then
+        fail "$name $how printed something else:"
+        diff cases/$name.out $out | head -10
+    fi
+}
+
+optional_passes()
+{
+    $TINY --list-passes | sed -n 's/^\([a-z-]*\) (optional).*/\1/p'
+}
+
+# The options that disable every optional pass
+disable_all()
+{
+    optional_passes | sed 's/^/--disable-pass=/'
+}
+
+# Every case, and synthetic programs of long strings and of many names, lexed with each
+# string kernel the CPU supports, which must all give the same tokens
+check_lexer()
+{
+    local name target
+    local targets=("strings 100000" "functions 1000")
+    for name in $(cases); do
+        targets+=("tests/cases/$name.tiny 0")
+    done
+    for target in "${targets[@]}"; do
+        $TINY --bench-lex $target 1 > local/lexer.log ||
+            fail "the lexer kernels gave different tokens for ${target% *}"
+    done
+}
+
+# Every case, and every program in errors/, with --stats written to a file, which must
+# report each phase that ran and as many tokens as --trace-tokens prints, and leave the
+# compiler's own output as it is
+check_stats()
+{
+    local src name pass key
+    for src in cases/*.tiny errors/*.tiny; do
+        name=$(basename "$src" .tiny)
+        rm -f local/stats.json
+        $TINY tests/$src > local/expected 2>&1
+        $TINY tests/$src --stats=local/stats.json > local/actual 2>&1
+        cmp -s local/expected local/actual || fail "$name printed something else with --stats"
+        if [ ! -s local/stats.json ]; then
+            fail "$name wrote no statistics with --stats=local/stats.json"
+            continue
+        fi
+
+        for key in source succeeded phases total_ms source_bytes tokens scopes entities \
+            bytes_emitted calls_shared calls_inlined tail_calls functions_jitted peak_heap_bytes; do
+            grep -q "\"$key\":" local/stats.json || fail "the statistics for $name have no $key"
+        done
+        grep -q "\"source_bytes\": $(wc -c < $src)," local/stats.json ||
+            fail "the statistics for $name have the wrong source_bytes"
+        grep -q "\"tokens\": $($TINY tests/$src --trace-tokens | grep -c '^[0-9][0-9] ')," local/stats.json ||
+            fail "the statistics for $name count a different number of tokens than --trace-tokens prints"
+        [[ $src == errors/* ]] && continue
+
+        grep -q '"succeeded": true' local/stats.json || fail "the statistics for $name report a failure"
+        for pass in read lex $($TINY --list-passes | sed -n 's/^\([a-z-]*\) [-(].*/\1/p' | grep -vx lower) write; do
+            grep -q "{\"name\": \"$pass\", \"ms\": " local/stats.json ||
+                fail "the statistics for $name do not time the $pass phase"
+        done
+    done
+}
+
+# Every program in errors/, which should fail to compile with the errors in <name>.out,
+# each naming the token it was found at as it is written in the source
+check_errors()
+{
+    local src name
+    for src in errors/*.tiny; do
+        name=$(basename "$src" .tiny)
+        $TINY tests/$src > local/actual 2>&1
+        echo "exit $?" >> local/actual
+        if ! cmp -s errors/$name.out local/actual; then
+            fail "the errors in $name are reported differently:"
+            diff errors/$name.out local/actual | head -10
+        fi
+    done
+}
+
+# Each shape of synthetic program, small, which must compile, build and print the same
+# as C++ as it does in the bytecode interpreter, and benchmark without a compile error
+check_corpus()
+{
+    local shape
+    for shape in "functions 50" "lines 100" "blocks 100" "strings 1000" "calls 5"; do
+        $TINY --generate $shape > local/corpus.tiny
+        if ! $TINY tests/local/corpus.tiny > local/compile.log || grep -q Error local/compile.log; then
+            fail "the generated ${shape% *} program did not compile"
+            continue
+        fi
+        if ! $CXX -std=c++17 -O2 -I ../runtime local/output.cpp local/libtiny.a -o local/program; then
+            fail "the generated ${shape% *} program did not build"
+            continue
+        fi
+        echo 5 | local/program > local/expected 2>&1
+        echo 5 | $TINY tests/local/corpus.tiny --run > local/actual 2>&1
+        cmp -s local/expected local/actual || fail "the generated ${shape% *} program printed something else with --run"
+
+        $TINY --bench $shape 1 > local/bench.log
+        ! grep -q "compile error" local/bench.log || fail "--bench ${shape% *} hit a compile error"
+    done
+}
+
+# Every case in the bytecode interpreter, with and without the JIT, and with every
+# optional pass disabled
+check_run()
+{
+    local name
+    for name in $(cases); do
+        run_case $name local/actual $TINY tests/cases/$name.tiny --run
+        expect_output $name local/actual "with --run"
+        run_case $name local/actual $TINY tests/cases/$name.tiny --run --no-jit
+        expect_output $name local/actual "with --run --no-jit"
+        run_case $name local/actual $TINY tests/cases/$name.tiny --run $(disable_all)
+        expect_output $name local/actual "with --run and every optional pass disabled"
+    done
+
+    # calls makes thousands of calls between value functions, so it runs native code
+    run_case calls local/actual $TINY tests/cases/calls.tiny --run --stats=local/stats.json
+    grep -q '"functions_jitted": [1-9]' local/stats.json ||
+        fail "calls compiled no functions to machine code with --run"
+    run_case calls local/actual $TINY tests/cases/calls.tiny --run --stats=local/stats.json $(disable_all)
+    grep -q '"functions_jitted": [1-9]' local/stats.json ||
+        fail "calls compiled no functions to machine code with --run and every optional pass disabled"
+}
+
+# The phases --stats times, in order
+phases()
+{
+    sed -n 's/^ *{"name": "\([a-z-]*\)", "ms": .*/\1/p' local/stats.json | tr '\n' ' '
+}
+
+# The pass manager, which must run the passes --list-passes lists in that order, skip
+# only an optional pass that is disabled, and refuse to disable any other
+check_pipeline()
+{
+    local pass passes
+    passes="read lex $($TINY --list-passes | sed -n 's/^\([a-z-]*\) [-(].*/\1/p' | grep -vx lower | tr '\n' ' ')write "
+    $TINY tests/cases/cse.tiny --stats=local/stats.json > local/compile.log
+    [ "$(phases)" == "$passes" ] || fail "the passes ran in the order $(phases)rather than $passes"
+
+    for pass in $(optional_passes); do
+        $TINY tests/cases/cse.tiny --disable-pass=$pass --stats=local/stats.json > local/compile.log
+        [ "$(phases)" == "${passes/ $pass / }" ] || fail "with --disable-pass=$pass, the passes ran in the order $(phases)"
+    done
+    for pass in $($TINY --list-passes | sed -n 's/^\([a-z-]*\) - .*/\1/p') bogus; do
+        $TINY tests/cases/cse.tiny --disable-pass=$pass > local/compile.log 2>&1 &&
+            fail "--disable-pass=$pass was accepted"
+        grep -q "Cannot disable pass $pass" local/compile.log || fail "--disable-pass=$pass was not refused"
+    done
+}
+
+# Every case, as C++, with each optional pass disabled and with all of them disabled
+check_passes()
+{
+    local pass name
+    for name in $(cases); do
+        run_cpp $name local/actual
+        expect_output $name local/actual "as C++"
+        for pass in $(optional_passes); do
+            run_cpp $name local/actual --disable-pass=$pass
+            expect_output $name local/actual "as C++ with --disable-pass=$pass"
+        done
+        run_cpp $name local/actual $(disable_all)
+        expect_output $name local/actual "as C++ with every optional pass disabled"
+    done
+}
+
+# Fails unless --stats reports a count above zero for `key` when a case is compiled with
+# the given options
+expect_stat()
+{
+    local name=$1 key=$2
+    shift 2
+    $TINY tests/cases/$name.tiny "$@" --stats=local/stats.json > local/compile.log
+    grep -q "\"$key\": [1-9]" local/stats.json || fail "$name has no $key with options: $*"
+}
+
+# The optimisations the cases were written for, which must take place
+check_optimise()
+{
+    # Inlining g would leave no calls to share
+    expect_stat cse calls_shared --disable-pass=inline
+
+    # Small calls are inlined, but never a function into itself
+    expect_stat inlining calls_inlined
+    $TINY tests/cases/inlining.tiny --verbose > local/compile.log 2> local/inlined
+    grep -q "^inline: not inlining rec into rec .* it is recursive" local/inlined ||
+        fail "inlining did not report that rec calls itself with --verbose"
+
+    # Functions that end by calling themselves become loops, so a program can recurse a
+    # million times over, as C++ and in the bytecode interpreter, until it fails for want
+    # of a value. Memory is limited so that it would fail quickly if it did use a frame
+    # for each call.
+    expect_stat tail tail_calls
+    local i
+    {
+        printf 'drain(l[], n) {\n    x\n    l >> x\n    return drain(l, x)\n}\n\nmain() {\n    l[] = "ab"\n'
+        for i in $(seq 19); do
+            printf '    c[] = l\n    l << c\n'
+        done
+        printf '    n\n    drain(l, n)\n}\n'
+    } > local/deep.tiny
+    printf 'Runtime error: cannot pop from an empty list\nexit 1\n' > local/expected
+    (
+        ulimit -v 4000000
+        $TINY tests/local/deep.tiny --run > local/actual 2>&1
+        echo "exit $?" >> local/actual
+    )
+    cmp -s local/expected local/actual || fail "a million calls in a row did not run as a loop with --run"
+    if ! $TINY tests/local/deep.tiny > local/compile.log || grep -q Error local/compile.log ||
+        ! $CXX -std=c++17 -O2 -I ../runtime local/output.cpp local/libtiny.a -o local/program; then
+        fail "the program making a million calls in a row did not build"
+        return
+    fi
+    (
+        ulimit -v 4000000
+        local/program > local/actual 2>&1
+        echo "exit $?" >> local/actual
+    )
+    cmp -s local/expected local/actual || fail "a million calls in a row did not run as a loop as C++"
+}
+
+# The runtime's conversions between list values and characters, with each kernel the CPU
+# supports, for every length up to a few blocks of the widest and for long lists, all of
+# which must give what the plain loops give
+check_kernels()
+{
+    local count
+    for count in $(seq 0 100) 1000 65537; do
+        $TINY --bench-kernels $count 1 > local/kernels.log ||
+            fail "the character conversion kernels gave different results for $count values"
+    done
+}
+
+# A program's list loops, built with its runtime at -O3, against the compiler's report of
+# the loops it vectorized. Only compilers that take -fopt-info-vec (GCC) report them.
+check_vectorize()
+{
+    if ! $CXX -fopt-info-vec -x c++ -c /dev/null -o /dev/null 2> /dev/null; then
+        echo "Skipping vectorize: $CXX does not report vectorized loops"
+        return
+    fi
+    if ! $TINY tests/cases/inlining.tiny > local/compile.log || grep -q Error local/compile.log; then
+        fail "inlining did not compile"
+        return
+    fi
+    $CXX -std=c++17 -O3 -fopt-info-vec -I ../runtime local/output.cpp ../runtime/tiny/*.cpp \
+        -o local/program 2> local/vectorized || fail "inlining did not build at -O3"
+
+    # The plain loops that convert between list values and characters, reported at the
+    # line of their `for`
+    local function line
+    for function in narrow_scalar widen_scalar; do
+        line=$(awk "/void $function\\(/ { found = 1 } found && /for \\(/ { print NR; exit }" ../runtime/tiny/simd.h)
+        grep -q "simd.h:$line:[0-9]*: optimized: loop vectorized" local/vectorized ||
+            fail "the loop in $function (runtime/tiny/simd.h:$line) was not vectorized"
+    done
+}
+
+# A program that prints more than the console's output buffer holds and then fails, as
+# C++ with its input read from a file and from a pipe, and in the bytecode interpreter.
+# Everything it printed must come out, whole and ahead of the error.
+check_console()
+{
+    local i
+    {
+        printf 'main() {\n    w[]\n    console >> w\n    n\n    console >> n\n    l[] = w\n'
+        for i in $(seq 17); do
+            printf '    c[] = l\n    l << c\n'
+        done
+        printf '    console << l << n << "\\n"\n    e[]\n    x\n    x << e\n    console << x\n}\n'
+    } > local/console.tiny
+    echo "ab 42" > local/console.in
+    {
+        yes ab | head -n 131072 | tr -d '\n'
+        printf '42\nRuntime error: cannot pop from an empty list\nexit 1\n'
+    } > local/expected
+
+    if ! $TINY tests/local/console.tiny > local/compile.log || grep -q Error local/compile.log ||
+        ! $CXX -std=c++17 -O2 -I ../runtime local/output.cpp local/libtiny.a -o local/program; then
+        fail "the console program did not build"
+        return
+    fi
+    local/program < local/console.in > local/actual 2>&1
+    echo "exit $?" >> local/actual
+    cmp -s local/expected local/actual || fail "the console program printed something else reading a file"
+    cat local/console.in | local/program > local/actual 2>&1
+    echo "exit $?" >> local/actual
+    cmp -s local/expected local/actual || fail "the console program printed something else reading a pipe"
+    $TINY tests/local/console.tiny --run < local/console.in > local/actual 2>&1
+    echo "exit $?" >> local/actual
+    cmp -s local/expected local/actual || fail "the console program printed something else with --run"
+}
+
+# Every case built with the runtime's sources, and against the runtime library with the
+# runtime's header precompiled, which must print what it should. GCC must report using
+# the precompiled header; other compilers may not find it, and build from the header.
+check_build()
+{
+    local name
+    mkdir -p local/pch/tiny
+    if ! $CXX -std=c++17 -O2 -x c++-header ../runtime/tiny/list.h -o local/pch/tiny/list.h.gch 2> local/pch.log; then
+        fail "the runtime's header did not precompile:"
+        head -10 local/pch.log
+        return
+    fi
+    local gcc=1
+    $CXX -dM -E -x c++ /dev/null | grep -q __clang__ && gcc=0
+
+    for name in $(cases); do
+        if ! $TINY tests/cases/$name.tiny > local/compile.log || grep -q Error local/compile.log; then
+            fail "$name did not compile"
+            continue
+        fi
+        $CXX -std=c++17 -O2 -I ../runtime local/output.cpp ../runtime/tiny/*.cpp -o local/program 2> local/actual &&
+            run_case $name local/actual local/program
+        expect_output $name local/actual "built with the runtime's sources"
+
+        if $CXX -std=c++17 -O2 -Winvalid-pch -H -I local/pch -I ../runtime local/output.cpp local/libtiny.a \
+            -o local/program 2> local/includes; then
+            run_case $name local/actual local/program
+        else
+            cp local/includes local/actual
+        fi
+        expect_output $name local/actual "built with the precompiled header"
+        [ $gcc == 0 ] || grep -q '^! local/pch/tiny/list.h.gch' local/includes ||
+            fail "$name was not built with the precompiled header"
+    done
+}
+
+# Every case with pure functions memoized, as C++ and in the bytecode interpreter
+check_memoize()
+{
+    local name
+    for name in $(cases); do
+        run_cpp $name local/actual --memoize
+        expect_output $name local/actual "as C++ with --memoize"
+        run_case $name local/actual $TINY tests/cases/$name.tiny --run --memoize
+        expect_output $name local/actual "with --run --memoize"
+    done
+}
+
+# Every case, and synthetic programs with many blocks of functions, as C++ written on
+# several threads, against the C++ written on one
+check_jobs()
+{
+    local shape src threads
+    local sources=()
+    for shape in functions calls; do
+        $TINY --generate $shape 300 > local/$shape.tiny
+        sources+=(tests/local/$shape.tiny)
+    done
+    for src in $(cases); do
+        sources+=(tests/cases/$src.tiny)
+    done
+
+    for src in "${sources[@]}"; do
+        $TINY $src > /dev/null
+        cp local/output.cpp local/expected.cpp
+        for threads in 2 3 8; do
+            $TINY $src --jobs=$threads > /dev/null
+            cmp -s local/expected.cpp local/output.cpp ||
+                fail "$src with --jobs=$threads wrote different C++"
+        done
+    done
+}
+
+# Every case built and run through the build cache, first on a miss and then on a hit,
+# which must reuse the executable, with the C++ in the cache against a plain compile
+check_cache()
+{
+    local name path executable
+    rm -rf local/cache
+    for name in $(cases); do
+        run_case $name local/actual env TINY_CACHE_DIR=local/cache $TINY run tests/cases/$name.tiny
+        expect_output $name local/actual "with tiny run"
+
+        path=$(TINY_CACHE_DIR=local/cache $TINY build tests/cases/$name.tiny)
+        executable=$(stat -c %i "$path")
+        run_case $name local/actual env TINY_CACHE_DIR=local/cache $TINY run tests/cases/$name.tiny
+        expect_output $name local/actual "with tiny run from the cache"
+        [ "$(stat -c %i "$path")" = "$executable" ] || fail "$name was built again on a cache hit"
+
+        $TINY tests/cases/$name.tiny > /dev/null
+        cmp -s local/output.cpp "$path.cpp" || fail "$name has different C++ in the cache"
+    done
+}
+
+# Every case, a synthetic program and one with an error, compiled at once through the
+# compiler library, each on a thread and in a context of its own, against the command
+# line's C++ and errors
+check_library()
+{
+    if ! $CXX -std=c++17 -O2 -c ../compiler/tinyc.cpp -o local/tinyc.o ||
+        ! $CXX -std=c++17 -O2 -pthread -o local/library library.cpp local/tinyc.o \
+            ../runtime/tiny/list.cpp ../runtime/tiny/error.cpp; then
+        fail "could not build the compiler library"
+        return
+    fi
+
+    # The library is what a compilation needs, without the command line and its modes
+    local symbol
+    for symbol in "tinyc::compiler_main(" "tinyc::run_bytecode(" "tinyc::watch_main(" "operator new("; do
+        nm -C --defined-only local/tinyc.o | grep -qF "$symbol" && fail "the compiler library defines $symbol...)"
+    done
+
+    $TINY --generate functions 300 > local/functions.tiny
+    printf 'main() {\n    f(x)\n}\n' > local/error.tiny
+    local sources=(local/functions.tiny local/error.tiny) name
+    for name in $(cases); do
+        sources+=(cases/$name.tiny)
+    done
+    rm -rf local/library-out
+    mkdir -p local/library-out
+    local/library local/library-out "${sources[@]}"
+
+    local src
+    for src in "${sources[@]}"; do
+        name=$(basename $src .tiny)
+        $TINY tests/$src > local/compile.log
+        if grep -q Error local/compile.log; then
+            grep Error local/compile.log | cmp -s - local/library-out/$name.errors ||
+                fail "$name has different errors through the library"
+        else
+            cmp -s local/output.cpp local/library-out/$name.cpp ||
+                fail "$name has different C++ through the library"
+        fi
+    done
+}
+
+# The cases directory, synthetic programs and a program with an error, compiled in one
+# batch on several threads, against the command line's C++ and errors for each file
+check_batch()
+{
+    local shape
+    for shape in functions calls; do
+        $TINY --generate $shape 300 > local/$shape.tiny
+    done
+    printf 'main() {\n    f(x)\n}\n' > local/error.tiny
+    local sources=(tests/local/functions.tiny tests/local/calls.tiny tests/local/error.tiny) name
+    for name in $(cases); do
+        sources+=(tests/cases/$name.tiny)
+    done
+
+    local options src
+    for options in "" "--memoize"; do
+        rm -rf local/batch
+        $TINY batch tests/cases tests/local/functions.tiny tests/local/calls.tiny tests/local/error.tiny \
+            --jobs=4 $options > local/batch.log
+        for src in "${sources[@]}"; do
+            $TINY $src $options > local/compile.log
+            if grep -q Error local/compile.log; then
+                grep Error local/compile.log | sed "s|^|../$src: |" | cmp -s - <(grep Error local/batch.log) ||
+                    fail "batch $options reported different errors for $src"
+            else
+                cmp -s local/output.cpp local/batch/${src%.tiny}.cpp ||
+                    fail "batch $options wrote different C++ for $src"
+            fi
+        done
+    done
+}
+
+# Waits for the watch writing to `log` to have reported `count` rebuilds
+wait_for_rebuilds()
+{
+    local log=$1 count=$2
+    for _ in $(seq 500); do
+        [ "$(grep -c "ompiled" "$log")" -ge "$count" ] && return 0
+        sleep 0.01
+    done
+    return 1
+}
+
+# tiny watch, after each of a series of edits, against compiling the edited source afresh
+check_watch()
+{
+    local options
+    for options in "" "--memoize --disable-pass=unreachable"; do
+        local src=local/watch/watch.tiny log=local/watch/log
+        rm -rf local/watch
+        mkdir -p local/watch
+        cp cases/watch.tiny $src
+        $TINY watch tests/$src $options > $log &
+        local watch=$!
+
+        local edits=(
+            's/"hi"/"ho"/'
+            's/    console << g(a)$/    console << g(g(a))/'
+            '/^    console << g(g(a))$/d'
+            's/b << a$/b << a << a/'
+            's/second(a, b) = b/second(a, b) = a/'
+            's/^say/k(x) = x\n\nsay/'
+            's/console << a << "\\n"/console << "[" << a << "]"/'
+        )
+        local step=0 edit
+        wait_for_rebuilds $log 1 || fail "watch $options did not compile $src"
+        for edit in "${edits[@]}"; do
+            sed -i "$edit" $src
+            if ! wait_for_rebuilds $log $((step + 2)); then
+                fail "watch $options did not rebuild after '$edit'"
+                break
+            fi
+            step=$((step + 1))
+            cp $src local/watch/$step.tiny
+            cp local/output.cpp local/watch/$step.cpp
+        done
+        kill $watch
+        wait $watch 2> /dev/null
+
+        for ((i = 1; i <= step; i++)); do
+            $TINY tests/local/watch/$i.tiny $options > /dev/null
+            cmp -s local/output.cpp local/watch/$i.cpp ||
+                fail "watch $options wrote different C++ to a full compile after edit $i (${edits[i - 1]})"
+        done
+    done
+}
+
+build_compiler
+checks=("$@")
+[ ${#checks[@]} -gt 0 ] || checks=(errors lexer corpus stats pipeline passes optimise run console build memoize jobs cache watch library batch kernels vectorize)
+for check in "${checks[@]}"; do
+    "check_$check"
+done
+
+if [ $failures -gt 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "All checks passed"